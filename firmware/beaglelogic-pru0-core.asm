@@ -13,44 +13,172 @@
 
 ;* C declaration:
 ;* void run(struct capture_context *ctx, u32 trigger_flags)
+;*
+;* ctx->list is a ring of ctx->listcount descriptors. A descriptor is only
+;* filled once the kernel has set its OWN flag, then it is written back with
+;* DONE. While we own no descriptor, the data from PRU1 is dropped and the
+;* next buffer is flagged with GAP. One-shot captures end on the LAST flag.
+;*
+;* Descriptors are 32 bytes. On completion we also write back the IEP count
+;* (PRU cycles since the start) of the first and the last block and the PRU1
+;* byte counter, so the kernel can timestamp buffers and count lost bytes.
+;*
+;* ctx->donecount counts the descriptors written back. ARM is only signalled
+;* every ctx->coalesce descriptors (and on the last one), the kernel polls
+;* for the others. R4-R7 are saved on the stack for this bookkeeping.
+;*
+;* For window captures (ctx->posttrigger != 0), PRU1 also sends a trigger
+;* marker in R20: the byte offset + 1 of the first trigger match in the block.
+;* The trigger position is written to ctx->trigpos and the capture ends
+;* ctx->posttrigger bytes later.
 	.clink
 	.global run
 run:
-	LDI	R17, (MAX_BUFLIST_ENTRIES * 8)
+	SUB	R2, R2, 16
+	SBBO	&R4, R2, 0, 16
+	; PRU1 reloads its sample divisor R14 from bank 1 [see samplexm]
+	MOV	R21, R14
+	LBBO	&R14, R21, 12, 4	; ctx->samplediv
+	XOUT	11, &R14, 4
+	MOV	R14, R21
 	LDI	R0, SYSEV_PRU1_TO_PRU0
-	LDI	R1, 0
+	; R6 = Descriptors written back, R7 = Countdown to the next interrupt
+	LDI	R6, 0
+	LBBO	&R7, R14, 56, 4
+	; R1 = Window: bytes after the trigger, then end of the window
+	LBBO	&R1, R14, 48, 4
+	; End of the ring = &ctx->list[ctx->listcount]
+	LBBO	&R17, R14, 24, 4
+	LSL	R17, R17, 5
+	ADD	R17, R17, 136
+	ADD	R17, R17, R14
+	; R15 = Flags to write back on completion, and our ARMED state
+	LDI	R15, DESC_DONE
+	QBEQ	$run$0, R1, 0
+	SET	R15, R15, 4		; DESC_ARMED
 $run$0:
-	; Load scatter/gather list entries
-	ADD	R16, R14, 24
+	; Back to the first descriptor
+	ADD	R16, R14, 136
 $run$1:
+	; Check if the kernel handed this descriptor over to us
+	LBBO	&R20, R16, 8, 4
+	QBBC	$run$stall, R20, 0
 	; Load start and end address of mem chunk
-	; If it's zero, we're done
 	LBBO	&R18, R16, 0, 8
-	QBEQ	$run$canexit, R18, 0
+	LDI	R5, 1			; Timestamp the first block
+	QBNE	$run$w0, R1, 0
 $run$2:
 	; Wait for and clear the buffer ready signal from PRU1
-	WBS	R31, 30
+	; PRU1 may be waiting for a trigger, so keep an eye on the kill signal
+	QBBS	$run$3, R31, 30
+	QBBS	$run$exit, R31, 31
+	JMP	$run$2
+$run$3:
 	SBCO	&R0, C0, 0x24, 4
 
 	XIN	10, &R21, 36		; Get the logic data from PRU1
 	SBBO	&R21, R18, 0, 32	; Write buffer
+	QBEQ	$run$4, R5, 0
+	LBCO	&R4, C26, 0x0C, 4	; IEP count
+	LDI	R5, 0
+$run$4:
 	ADD	R18, R18, 32
+	; With one block left, hand a staged divisor over to PRU1: it takes it
+	; at the end of the block it is sampling, the last one of this buffer
+	SUB	R21, R19, R18
+	QBNE	$run$6, R21, 32
+	LBBO	&R21, R14, 88, 4	; ctx->nextdiv
+	QBEQ	$run$6, R21, 0
+	MOV	R20, R14
+	MOV	R14, R21
+	XOUT	11, &R14, 4
+	MOV	R14, R20
+	SBBO	&R21, R14, 12, 4	; ctx->samplediv
+	LDI	R21, 0
+	SBBO	&R21, R14, 88, 4
+	SET	R15, R15, 6		; DESC_RECONFPEND
+$run$6:
 	QBLT	$run$2, R19, R18
+$run$wb:
+	; Give the descriptor back to the kernel
+	LBCO	&R5, C26, 0x0C, 4
+	SBBO	&R18, R16, 12, 4	; Write pointer
+	SBBO	&R4, R16, 16, 8		; Timestamps and byte counter
+	SBBO	&R29, R16, 24, 4
+	LBBO	&R20, R16, 8, 4
+	AND	R20, R20, DESC_LAST
+	OR	R20, R20, R15
+	CLR	R20, R20, 4		; DESC_ARMED is ours
+	CLR	R20, R20, 6		; DESC_RECONFPEND too
+	SBBO	&R20, R16, 8, 4
+	ADD	R6, R6, 1
+	SBBO	&R6, R14, 60, 4		; ctx->donecount
+	; The next buffer is the first one at a staged sample rate
+	LSR	R21, R15, 1
+	AND	R21, R21, DESC_RECONF
+	AND	R15, R15, DESC_ARMED
+	OR	R15, R15, DESC_DONE
+	OR	R15, R15, R21
 
-	; Signal ARM that one buffer is now ready
+	; Signal ARM that ctx->coalesce buffers are now ready
 	; Also check if we received the kill signal
+	SUB	R7, R7, 1
+	QBEQ	$run$irq, R7, 0
+	QBBC	$run$5, R20, 2
+$run$irq:
 	LDI	R31, 32 | (SYSEV_PRU0_TO_ARM_A - 16)
+	LBBO	&R7, R14, 56, 4
+$run$5:
 	QBBS	$run$exit, R31, 31
+	QBBS	$run$exit, R20, 2	; DESC_LAST, capture done
 
-	; Move to next buffer
-	ADD	R16, R16, 8
+	; Move to next descriptor
+	ADD	R16, R16, 32
 	QBLT	$run$1, R17, R16
+	JMP	$run$0
+$run$w0:
+	; Same as above for window captures, with the trigger marker
+	QBBS	$run$w1, R31, 30
+	QBBS	$run$exit, R31, 31
+	JMP	$run$w0
+$run$w1:
+	SBCO	&R0, C0, 0x24, 4
+
+	XIN	10, &R20, 40		; Get the marker and the data from PRU1
+	SBBO	&R21, R18, 0, 32
+	QBEQ	$run$w4, R5, 0
+	LBCO	&R4, C26, 0x0C, 4
+	LDI	R5, 0
+$run$w4:
+	ADD	R18, R18, 32
+	QBBC	$run$w2, R15, 4		; Triggered already
+	QBEQ	$run$w3, R20, 0		; No trigger in this block
 
-	LDI	R14, 0
-	JMP	$run$exit
-$run$canexit:
-	QBBS	$run$0, R15, 0
-$run$error:
-	MOV	R14, R29
+	; Trigger at (R29 - 32) + (R20 - 1), the window ends R1 bytes later
+	ADD	R20, R20, R29
+	SUB	R20, R20, 33
+	SBBO	&R20, R14, 52, 4	; ctx->trigpos
+	ADD	R1, R1, R20
+	CLR	R15, R15, 4
+$run$w2:
+	QBGE	$run$wend, R1, R29
+$run$w3:
+	QBLT	$run$w0, R19, R18
+	JMP	$run$wb
+$run$wend:
+	SET	R15, R15, 2		; DESC_LAST
+	JMP	$run$wb
+$run$stall:
+	; No buffer to write to, keep up with PRU1 and drop the data
+	QBBS	$run$exit, R31, 31
+	QBBC	$run$1, R31, 30
+	SBCO	&R0, C0, 0x24, 4
+	LBBO	&R20, R14, 28, 4	; ctx->stalls++
+	ADD	R20, R20, 1
+	SBBO	&R20, R14, 28, 4
+	SET	R15, R15, 3		; DESC_GAP
+	JMP	$run$1
 $run$exit:
+	LBBO	&R4, R2, 0, 16
+	ADD	R2, R2, 16
 	JMP	R3.w2
@@ -16,6 +16,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <pru_cfg.h>
+#include <pru_iep.h>
 #include <pru_intc.h>
 #include <rsc_types.h>
 
@@ -24,27 +25,69 @@
 
 /*
  * Define firmware version
- * This is version 0.3 [v0.2 was firmware for 3.8.13]
+ * This is version 0.17 [v0.16 took the last trigger match of a block and
+ * had no window test pattern, v0.15 could not change the sample rate while
+ * running, v0.14 had no command queue, v0.13 reconfigured PRU1 on every
+ * start, v0.12 had an unpaced test pattern, v0.11 had no synchronized
+ * start, v0.10 had no external clock, v0.9 had no fractional
+ * sample periods, v0.8 had no channel packing, v0.7 had one interrupt
+ * per buffer, v0.6 had no buffer timestamps, v0.5 had no trigger window,
+ * v0.4 had no trigger, v0.3 had a zero-terminated buffer list, v0.2 was
+ * firmware for 3.8.13]
  */
 #define MAJORVER	0
-#define MINORVER	3
+#define MINORVER	17
 
-/* Maximum number of SG entries; each entry is 8 bytes */
+/* Maximum number of SG ring entries; each entry is 32 bytes */
 #define MAX_BUFLIST_ENTRIES	128
 
+/* Descriptor flags, the kernel sets OWN and we write back DONE */
+#define DESC_OWN	0x01	/* We may fill this buffer */
+#define DESC_DONE	0x02	/* Buffer filled */
+#define DESC_LAST	0x04	/* Stop after filling this buffer */
+#define DESC_GAP	0x08	/* Samples were dropped before this buffer */
+#define DESC_ARMED	0x10	/* Internal: waiting for the trigger window */
+#define DESC_RECONF	0x20	/* First buffer at the new sample rate */
+#define DESC_RECONFPEND	0x40	/* Internal: DESC_RECONF on the next buffer */
+
+/* PRU1 spends this many sample slots worth of cycles checking the trigger
+ * on every sample during window captures, see beaglelogic-pru1-core.asm */
+#define WINDOW_TRIGCHK_DIV	4
+
+/* Fixed part of the sample period in the fractional loop [see samplefrac],
+ * the DELAY count R7 >= 2 adds 2 cycles per count */
+#define FRAC_LOOP_CYCLES	11
+
+/* Synchronized start [cxt.syncstart = mode << 8 | pin], the pin is a bit of
+ * R30 (master) or R31 (slave) */
+#define SYNC_MASTER	1	/* Raise the sync line when starting */
+#define SYNC_SLAVE	2	/* Wait for the sync line before starting */
+#define SYNC_MODE(x)	((x) >> 8)
+#define SYNC_PIN(x)	(1U << ((x) & 0xFF))
+
 /* Commands */
 #define CMD_GET_VERSION	1   /* Firmware version */
 #define CMD_GET_MAX_SG	2   /* Get the max number of bufferlist entries */
 #define CMD_SET_CONFIG 	3   /* Get the context pointer */
 #define CMD_START	4   /* Arm the LA (start sampling) */
 
+/* Commands queued by the kernel [see main], a power of 2 */
+#define CMDQ_LEN	4
+
 /* Define magic bytes for the structure. This "looks like" BEAGLELO */
 #define FW_MAGIC	0xBEA61E10
 
-/* Structure describing the start and end buffer addresses */
+/* Structure describing the start and end buffer addresses. The fields
+ * after 'flags' are written back along with DONE */
 typedef struct buflist {
 	uint32_t dma_start_addr;
 	uint32_t dma_end_addr;
+	uint32_t flags;
+	uint32_t dma_cur_addr;	// Write pointer
+	uint32_t tstart;	// IEP count when the first block came in
+	uint32_t tend;		// IEP count when the last block came in
+	uint32_t byteseq;	// PRU1 byte counter after the last block
+	uint32_t reserved;
 } bufferlist;
 
 /* Structure describing the core context.
@@ -56,9 +99,40 @@ struct capture_context {
 	uint32_t resp;          // Response code
 
 	uint32_t samplediv;     // Sample rate = (100 / samplediv) MHz
-	uint32_t sampleunit;    // 0 = 16-bit, 1 = 8-bit
+	uint32_t sampleunit;    // 0 = 16-bit, 1 = 8-bit, 2 = RLE, 3 = bursts
 	uint32_t triggerflags;  // 0 = one-shot, 1 = continuous sampling
 
+	uint32_t listcount;     // Descriptors in use in the ring
+	uint32_t stalls;        // 32-byte blocks dropped for lack of a buffer
+
+	uint32_t trigqmask;     // Trigger: wait for (input & qmask) == qval
+	uint32_t trigqval;
+	uint32_t trigfmask;     // then fire on (input & fmask) == fval
+	uint32_t trigfval;      // trigfmask = 0 disables the trigger
+
+	uint32_t posttrigger;   // Window capture: bytes from the trigger on
+	uint32_t trigpos;       // Byte offset of the trigger, written back
+
+	uint32_t coalesce;      // Descriptors per interrupt to the host, >= 1
+	uint32_t donecount;     // Descriptors written back, written back
+
+	uint32_t channelmask;   // Channels to pack, 0 = sampleunit as is
+	uint32_t sampleperiod;  // PRU cycles per sample (16.16), 0 = samplediv
+	uint32_t extclock;      // Clock channel | edge << 8 [1 = rising], 0 = off
+	uint32_t syncstart;     // Sync pin | mode << 8 [1 = master], 0 = off
+
+	uint32_t armed;         // PRU1 configured, waiting for CMD_START
+	uint32_t runs;          // Captures completed, written back
+	uint32_t nextdiv;       // Divisor from the next buffer on, 0 = none
+	uint32_t reserved;
+
+	uint32_t cmdhead;       // Commands queued by the kernel
+	uint32_t cmdtail;       // Commands done, written back
+	struct {
+		uint32_t cmd;
+		uint32_t resp;  // Written back
+	} cmdq[CMDQ_LEN];
+
 	bufferlist list[MAX_BUFLIST_ENTRIES];
 } cxt __attribute__((location(0))) = {0};
 
@@ -83,6 +157,15 @@ static inline int wait_other_pru_timeout(uint32_t timeout) {
 
 /* Write the registers of PRU1 (samplerate and sample and enable it */
 int configure_capture() {
+	uint32_t width;
+
+	/* Armed PRU1 waits to sample, send it back to the configuration HALT */
+	if (cxt.armed) {
+		cxt.armed = 0;
+		PCTRL_OTHER(0x0000) &= (uint16_t)~CONTROL_SOFT_RST_N;
+		__delay_cycles(10);
+	}
+
 	/* Verify if PRU1 is indeed halted and waiting for us */
 	if (wait_other_pru_timeout(200))
 		return -1;
@@ -94,6 +177,49 @@ int configure_capture() {
 	/* All clear, now write the configuration bits */
 	pru_other_write_reg(14, cxt.samplediv);
 	pru_other_write_reg(15, cxt.sampleunit);
+	pru_other_write_reg(16, cxt.trigqmask);
+	pru_other_write_reg(17, cxt.trigqval);
+	pru_other_write_reg(18, cxt.trigfmask);
+	pru_other_write_reg(19, cxt.trigfval);
+
+	/* Window captures use the sample loops that check the trigger */
+	pru_other_write_reg(11, cxt.posttrigger ?
+			cxt.samplediv - WINDOW_TRIGCHK_DIV : 0);
+
+	/* Channel packing: R6 = width of the group, R5 = samples per word,
+	 * R9 = shift bringing the group to the top of the register and
+	 * R8 = mask of the top R6 bits [see samplepack] */
+	width = 0;
+	if (cxt.channelmask) {
+		uint32_t shift = 0;
+
+		while (!(cxt.channelmask & (1 << shift)))
+			shift++;
+		while (cxt.channelmask & (1 << (shift + width)))
+			width++;
+
+		pru_other_write_reg(5, 32 / width);
+		pru_other_write_reg(8, ~((1 << (32 - width)) - 1));
+		pru_other_write_reg(9, 32 - width - shift);
+	}
+	pru_other_write_reg(6, width);
+
+	/* Fractional sample periods: R4 = fraction of a cycle added up on
+	 * every sample, R5 = extra cycle, R7 = DELAY count [0 = samplediv] */
+	if (cxt.sampleperiod) {
+		uint32_t cycles = (cxt.sampleperiod >> 16) - FRAC_LOOP_CYCLES;
+
+		pru_other_write_reg(4, cxt.sampleperiod & 0xFFFF);
+		pru_other_write_reg(5, cycles & 1);
+		pru_other_write_reg(7, cycles >> 1);
+	} else {
+		pru_other_write_reg(7, 0);
+	}
+
+	/* External clock: R9 = clock channel, R10 = edge [0 = samplediv] */
+	if (cxt.extclock)
+		pru_other_write_reg(9, cxt.extclock & 0xFF);
+	pru_other_write_reg(10, cxt.extclock >> 8);
 
 	/* Resume over the HALT instruction, give it some time to configure */
 	resume_other_pru();
@@ -102,6 +228,7 @@ int configure_capture() {
 		return -1;
 
 	/* Now the other PRU should be ready to take instructions */
+	cxt.armed = 1;
 	return 0;
 }
 
@@ -117,6 +244,7 @@ static int handle_command(uint32_t cmd) {
 			return configure_capture();
 
 		case CMD_START:
+			cxt.armed = 0;
 			state_run = 1;
 			return 0;
 	}
@@ -126,6 +254,8 @@ static int handle_command(uint32_t cmd) {
 extern void run(struct capture_context *ctx, uint32_t trigger_flags);
 
 int main(void) {
+	uint32_t i;
+
 	/* Enable OCP Master Port */
 	CT_CFG.SYSCFG_bit.STANDBY_INIT = 0;
 	cxt.magic = FW_MAGIC;
@@ -134,7 +264,19 @@ int main(void) {
 	CT_INTC.SECR0 = 0xFFFFFFFF;
 
 	while (1) {
-		/* Process received command */
+		/* Run the commands the kernel queued, then signal it once for
+		 * the whole batch. It sleeps until then */
+		if (cxt.cmdtail != cxt.cmdhead) {
+			while (cxt.cmdtail != cxt.cmdhead) {
+				i = cxt.cmdtail % CMDQ_LEN;
+				cxt.cmdq[i].resp = handle_command(cxt.cmdq[i].cmd);
+				cxt.cmdtail++;
+			}
+			SIGNAL_EVENT(SYSEV_PRU0_TO_ARM_B);
+		}
+
+		/* Polled command, only used by the kernel to check the
+		 * firmware version before anything else */
 		if (cxt.cmd != 0)
 		{
 			cxt.resp = handle_command(cxt.cmd);
@@ -146,15 +288,46 @@ int main(void) {
 			/* Clear all pending interrupts */
 			CT_INTC.SECR0 = 0xFFFFFFFF;
 
+			/* Slaves start on the rising edge of the sync line,
+			 * unless the kernel stops the capture first [R31 bit
+			 * 31, like in run()] */
+			if (SYNC_MODE(cxt.syncstart) == SYNC_SLAVE) {
+				while ((__R31 & SYNC_PIN(cxt.syncstart)) &&
+						!pru1_signal());
+				while (!(__R31 & SYNC_PIN(cxt.syncstart)) &&
+						!pru1_signal());
+				if (pru1_signal())
+					goto done;
+			}
+
+			/* Buffer timestamps count PRU cycles from here on */
+			CT_IEP.TMR_GLB_CFG_bit.CNT_EN = 0;
+			CT_IEP.TMR_CNT = 0xFFFFFFFF;
+			CT_IEP.TMR_GLB_CFG_bit.DEFAULT_INC = 1;
+			CT_IEP.TMR_GLB_CFG_bit.CNT_EN = 1;
+
+			/* The master starts along with its slaves */
+			if (SYNC_MODE(cxt.syncstart) == SYNC_MASTER)
+				__R30 |= SYNC_PIN(cxt.syncstart);
+
 			resume_other_pru();
 			run(&cxt, cxt.triggerflags);
 
+			if (SYNC_MODE(cxt.syncstart) == SYNC_MASTER)
+				__R30 &= ~SYNC_PIN(cxt.syncstart);
+done:
 			/* Signal completion */
+			cxt.runs++;
 			SIGNAL_EVENT(SYSEV_PRU0_TO_ARM_B);
 
 			/* Reset PRU1 and our state */
 			PCTRL_OTHER(0x0000) &= (uint16_t)~CONTROL_SOFT_RST_N;
 			state_run = 0;
+
+			/* Arm PRU1 again with the same settings, the next
+			 * start then skips CMD_SET_CONFIG */
+			__delay_cycles(10);
+			configure_capture();
 		}
 	}
 }
@@ -24,6 +24,60 @@ $M?:	SUB	R0, R0, 1
 $E?:	op
 	.endm
 
+; Trigger check for window captures, takes 8 cycles on every path
+; R12 = previous sample, R16-R19 = trigger (see below)
+; Sets R20 = off [byte offset of the sample in the block + 1] on the first
+; match in the block, later ones leave it alone
+TRIGCHK	.macro cur, off
+	AND    R13, R12, R16
+	MOV    R12, cur
+	QBNE   $N?, R13, R17
+	AND    R13, R12, R18
+	QBNE   $M?, R13, R19
+	QBEQ   $S?, R20, 0
+	JMP    $E?
+$N?:	NOP
+	NOP
+$M?:	NOP
+	JMP    $E?
+$S?:	LDI    R20, off
+$E?:	NOP
+	.endm
+
+; Same for the first sample of a block, which starts the marker over:
+; R20 = 1 on a match, 0 otherwise. The last block went out with its XOUT
+TRIGCHK1	.macro cur
+	AND    R13, R12, R16
+	MOV    R12, cur
+	QBNE   $N?, R13, R17
+	AND    R13, R12, R18
+	QBNE   $M?, R13, R19
+	LDI    R20, 1
+	JMP    $E?
+$N?:	NOP
+	NOP
+$M?:	LDI    R20, 0
+	NOP
+$E?:	NOP
+	.endm
+
+; External clock sample loop, one sample per active edge of channel R9
+; wait / seen: QBBS, QBBC for rising edges and QBBC, QBBS for falling ones
+; The inputs are sampled along with the clock, at most 10 ns after the edge
+SAMPLECLK	.macro wait, seen, mvi, sample, size
+$W?:	wait   $W?, R31, R9
+$S?:	MOV    R12, R31
+	seen   $S?, R12, R9
+	mvi    *R1.b0, sample
+	ADD    R1.b0, R1.b0, size
+	QBNE   $W?, R1.b0, 29 * 4
+	ADD    R29, R29, 32                     ; Maintain global byte counter
+	XOUT   10, &R21, 36                     ; Move data across the broadside
+	LDI    R31, PRU1_PRU0_INTERRUPT + 16    ; Jab PRU0
+	LDI    R1.b0, 21 * 4
+	JMP    $W?
+	.endm
+
 	.sect ".text:main"
 	.global asm_main
 asm_main:
@@ -57,10 +111,36 @@ asm_main:
 	LDI    R31, PRU0_ARM_INTERRUPT_B + 16   ; Signal SYSEV_PRU0_TO_ARM_B to kernel driver
 	HALT
 
+	; Hardware trigger, R16-R19 are loaded by PRU0 along with R14, R15
+	; Wait for (R31 & R16) == R17 [edge channels in their initial state]
+	; then fire on (R31 & R18) == R19 [pattern and edge channels flipped]
+	; Go back to the first stage if the edge happens on a wrong pattern
+	; Window captures [R11 != 0] check the trigger while sampling instead
+	QBNE   trigdone, R11, 0
+	QBEQ   trigdone, R18, 0
+trigqualify:
+	MOV    R1, R31
+	AND    R20, R1, R16
+	QBNE   trigqualify, R20, R17
+trigfire:
+	MOV    R1, R31
+	AND    R20, R1, R18
+	QBEQ   trigdone, R20, R19
+	AND    R20, R1, R16
+	QBEQ   trigfire, R20, R17
+	JMP    trigqualify
+trigdone:
+
 	; Sample starts here
 	; Maintain global bytes transferred counter (8 byte bursts)
 	LDI    R29, 0
-	QBEQ   sampleincnumberstest, R14, 0
+	QBNE   samplewin, R11, 0
+	QBEQ   sampleincnumberstest, R15, 4
+	QBNE   sampleclk, R10, 0
+	QBNE   samplepack, R6, 0
+	QBEQ   samplerle, R15, 2
+	QBEQ   sample200m8, R15, 3
+	QBNE   samplefrac, R7, 0
 	QBNE   samplexm, R14, 1
 sample100m:
 	QBEQ   sample100m8, R15, 1
@@ -174,6 +254,50 @@ $sample100m8$2:
 	MOV    R21.b1, R31.b0
 	JMP    $sample100m8$2
 
+; 8-bit bursts [sampleunit 3, samplerate = 200 MHz]: 32 samples on
+; consecutive cycles, then 4 cycles to hand them over to PRU0. Sample k is
+; taken at cycle 36 * (k / 32) + (k % 32)
+sample200m8:
+	MOV    R21.b0, R31.b0
+	MOV    R21.b1, R31.b0
+	MOV    R21.b2, R31.b0
+	MOV    R21.b3, R31.b0
+	MOV    R22.b0, R31.b0
+	MOV    R22.b1, R31.b0
+	MOV    R22.b2, R31.b0
+	MOV    R22.b3, R31.b0
+	MOV    R23.b0, R31.b0
+	MOV    R23.b1, R31.b0
+	MOV    R23.b2, R31.b0
+	MOV    R23.b3, R31.b0
+	MOV    R24.b0, R31.b0
+	MOV    R24.b1, R31.b0
+	MOV    R24.b2, R31.b0
+	MOV    R24.b3, R31.b0
+	MOV    R25.b0, R31.b0
+	MOV    R25.b1, R31.b0
+	MOV    R25.b2, R31.b0
+	MOV    R25.b3, R31.b0
+	MOV    R26.b0, R31.b0
+	MOV    R26.b1, R31.b0
+	MOV    R26.b2, R31.b0
+	MOV    R26.b3, R31.b0
+	MOV    R27.b0, R31.b0
+	MOV    R27.b1, R31.b0
+	MOV    R27.b2, R31.b0
+	MOV    R27.b3, R31.b0
+	MOV    R28.b0, R31.b0
+	MOV    R28.b1, R31.b0
+	MOV    R28.b2, R31.b0
+	MOV    R28.b3, R31.b0
+	ADD    R29, R29, 32                     ; Maintain global byte counter
+	XOUT   10, &R21, 36                     ; Move data across the broadside
+	LDI    R31, PRU1_PRU0_INTERRUPT + 16    ; Jab PRU0
+	JMP    sample200m8
+
+; Divided sample rates. R14 is reloaded from scratchpad bank 1 before the
+; last sample period of every block, so PRU0 can change the sample rate from
+; the next block on without stopping the capture
 samplexm:
 	QBEQ   samplexm8, R15, 1
 samplexm16:
@@ -205,9 +329,9 @@ $samplexm16$2:
 	MOV    R27.w0, R31.w0
 	DELAY  R14, NOP
 	MOV    R27.w2, R31.w0
-	DELAY  R14, NOP
-	MOV    R28.w0, R31.w0
 	DELAY  R14, "ADD    R29, R29, 32"                     ; Maintain global byte counter
+	MOV    R28.w0, R31.w0
+	DELAY  R14, "XIN    11, &R14, 4"                      ; Divisor of the next block
 	MOV    R28.w2, R31.w0
 	DELAY  R14, "XOUT   10, &R21, 36"                     ; Move data across the broadside
 	MOV    R21.w0, R31.w0
@@ -276,9 +400,9 @@ $samplexm8$2:
 	MOV    R28.b0, R31.b0
 	DELAY  R14, NOP
 	MOV    R28.b1, R31.b0
-	DELAY  R14, NOP
-	MOV    R28.b2, R31.b0
 	DELAY  R14, "ADD    R29, R29, 32"
+	MOV    R28.b2, R31.b0
+	DELAY  R14, "XIN    11, &R14, 4"
 	MOV    R28.b3, R31.b0
 	DELAY  R14, "XOUT   10, &R21, 36"
 	MOV    R21.b0, R31.b0
@@ -286,45 +410,442 @@ $samplexm8$2:
 	MOV    R21.b1, R31.b0
 	DELAY  R14, "JMP    $samplexm8$2"
 
-; Unit test to check for dropped frames
-; Runs at 100 MHz
-sampleincnumberstest:
+; Window captures: same as samplexm, but the trigger is checked on every
+; sample and the marker in R20 is sent to PRU0 along with the data.
+; R11 = R14 - 4 keeps the sample period at 2 * R14 cycles [R14 >= 6]
+samplewin:
+	LDI    R20, 0
+	QBEQ   samplewintest, R15, 4
+	MOV    R12, R31.w0
+	QBEQ   samplewin8, R15, 1
+samplewin16:
+	MOV    R21.w0, R31.w0
+	TRIGCHK1 R21.w0
+	DELAY  R11, NOP
+	MOV    R21.w2, R31.w0
+	TRIGCHK R21.w2, 3
+	DELAY  R11, NOP
+$samplewin16$2:
+	MOV    R22.w0, R31.w0
+	TRIGCHK R22.w0, 5
+	DELAY  R11, NOP
+	MOV    R22.w2, R31.w0
+	TRIGCHK R22.w2, 7
+	DELAY  R11, NOP
+	MOV    R23.w0, R31.w0
+	TRIGCHK R23.w0, 9
+	DELAY  R11, NOP
+	MOV    R23.w2, R31.w0
+	TRIGCHK R23.w2, 11
+	DELAY  R11, NOP
+	MOV    R24.w0, R31.w0
+	TRIGCHK R24.w0, 13
+	DELAY  R11, NOP
+	MOV    R24.w2, R31.w0
+	TRIGCHK R24.w2, 15
+	DELAY  R11, NOP
+	MOV    R25.w0, R31.w0
+	TRIGCHK R25.w0, 17
+	DELAY  R11, NOP
+	MOV    R25.w2, R31.w0
+	TRIGCHK R25.w2, 19
+	DELAY  R11, NOP
+	MOV    R26.w0, R31.w0
+	TRIGCHK R26.w0, 21
+	DELAY  R11, NOP
+	MOV    R26.w2, R31.w0
+	TRIGCHK R26.w2, 23
+	DELAY  R11, NOP
+	MOV    R27.w0, R31.w0
+	TRIGCHK R27.w0, 25
+	DELAY  R11, NOP
+	MOV    R27.w2, R31.w0
+	TRIGCHK R27.w2, 27
+	DELAY  R11, NOP
+	MOV    R28.w0, R31.w0
+	TRIGCHK R28.w0, 29
+	DELAY  R11, "ADD    R29, R29, 32"
+	MOV    R28.w2, R31.w0
+	TRIGCHK R28.w2, 31
+	DELAY  R11, "XOUT   10, &R20, 40"
+	MOV    R21.w0, R31.w0
+	TRIGCHK1 R21.w0
+	DELAY  R11, "LDI    R31, PRU1_PRU0_INTERRUPT + 16"
+	MOV    R21.w2, R31.w0
+	TRIGCHK R21.w2, 3
+	DELAY  R11, "JMP    $samplewin16$2"
+
+samplewin8:
+	MOV    R12, R31.b0
+	MOV    R21.b0, R31.b0
+	TRIGCHK1 R21.b0
+	DELAY  R11, NOP
+	MOV    R21.b1, R31.b0
+	TRIGCHK R21.b1, 2
+	DELAY  R11, NOP
+$samplewin8$2:
+	MOV    R21.b2, R31.b0
+	TRIGCHK R21.b2, 3
+	DELAY  R11, NOP
+	MOV    R21.b3, R31.b0
+	TRIGCHK R21.b3, 4
+	DELAY  R11, NOP
+	MOV    R22.b0, R31.b0
+	TRIGCHK R22.b0, 5
+	DELAY  R11, NOP
+	MOV    R22.b1, R31.b0
+	TRIGCHK R22.b1, 6
+	DELAY  R11, NOP
+	MOV    R22.b2, R31.b0
+	TRIGCHK R22.b2, 7
+	DELAY  R11, NOP
+	MOV    R22.b3, R31.b0
+	TRIGCHK R22.b3, 8
+	DELAY  R11, NOP
+	MOV    R23.b0, R31.b0
+	TRIGCHK R23.b0, 9
+	DELAY  R11, NOP
+	MOV    R23.b1, R31.b0
+	TRIGCHK R23.b1, 10
+	DELAY  R11, NOP
+	MOV    R23.b2, R31.b0
+	TRIGCHK R23.b2, 11
+	DELAY  R11, NOP
+	MOV    R23.b3, R31.b0
+	TRIGCHK R23.b3, 12
+	DELAY  R11, NOP
+	MOV    R24.b0, R31.b0
+	TRIGCHK R24.b0, 13
+	DELAY  R11, NOP
+	MOV    R24.b1, R31.b0
+	TRIGCHK R24.b1, 14
+	DELAY  R11, NOP
+	MOV    R24.b2, R31.b0
+	TRIGCHK R24.b2, 15
+	DELAY  R11, NOP
+	MOV    R24.b3, R31.b0
+	TRIGCHK R24.b3, 16
+	DELAY  R11, NOP
+	MOV    R25.b0, R31.b0
+	TRIGCHK R25.b0, 17
+	DELAY  R11, NOP
+	MOV    R25.b1, R31.b0
+	TRIGCHK R25.b1, 18
+	DELAY  R11, NOP
+	MOV    R25.b2, R31.b0
+	TRIGCHK R25.b2, 19
+	DELAY  R11, NOP
+	MOV    R25.b3, R31.b0
+	TRIGCHK R25.b3, 20
+	DELAY  R11, NOP
+	MOV    R26.b0, R31.b0
+	TRIGCHK R26.b0, 21
+	DELAY  R11, NOP
+	MOV    R26.b1, R31.b0
+	TRIGCHK R26.b1, 22
+	DELAY  R11, NOP
+	MOV    R26.b2, R31.b0
+	TRIGCHK R26.b2, 23
+	DELAY  R11, NOP
+	MOV    R26.b3, R31.b0
+	TRIGCHK R26.b3, 24
+	DELAY  R11, NOP
+	MOV    R27.b0, R31.b0
+	TRIGCHK R27.b0, 25
+	DELAY  R11, NOP
+	MOV    R27.b1, R31.b0
+	TRIGCHK R27.b1, 26
+	DELAY  R11, NOP
+	MOV    R27.b2, R31.b0
+	TRIGCHK R27.b2, 27
+	DELAY  R11, NOP
+	MOV    R27.b3, R31.b0
+	TRIGCHK R27.b3, 28
+	DELAY  R11, NOP
+	MOV    R28.b0, R31.b0
+	TRIGCHK R28.b0, 29
+	DELAY  R11, NOP
+	MOV    R28.b1, R31.b0
+	TRIGCHK R28.b1, 30
+	DELAY  R11, NOP
+	MOV    R28.b2, R31.b0
+	TRIGCHK R28.b2, 31
+	DELAY  R11, "ADD    R29, R29, 32"
+	MOV    R28.b3, R31.b0
+	TRIGCHK R28.b3, 32
+	DELAY  R11, "XOUT   10, &R20, 40"
+	MOV    R21.b0, R31.b0
+	TRIGCHK1 R21.b0
+	DELAY  R11, "LDI    R31, PRU1_PRU0_INTERRUPT + 16"
+	MOV    R21.b1, R31.b0
+	TRIGCHK R21.b1, 2
+	DELAY  R11, "JMP    $samplewin8$2"
+
+; Window captures of the test pattern [sampleunit 4]: the counter of
+; sampleincnumberstest, with the trigger checked on both 16-bit halves of
+; every word, so that trigger positions can be checked against the stream.
+; One word every 2 * R14 cycles, R11 = R14 / 2 - 4 [at least 2]
+samplewintest:
+	LSR    R11, R14, 1
+	QBLE   $samplewintest$0, R11, 6
+	LDI    R11, 6
+$samplewintest$0:
+	SUB    R11, R11, 4
+	LDI    R12, 0
 	LDI    R21, 0
+	TRIGCHK1 R21.w0
+	DELAY  R11, NOP
+	NOP
+	TRIGCHK R21.w2, 3
+	DELAY  R11, NOP
+$samplewintest$2:
+	ADD    R22, R21, 1
+	TRIGCHK R22.w0, 5
+	DELAY  R11, NOP
+	NOP
+	TRIGCHK R22.w2, 7
+	DELAY  R11, NOP
+	ADD    R23, R22, 1
+	TRIGCHK R23.w0, 9
+	DELAY  R11, NOP
 	NOP
+	TRIGCHK R23.w2, 11
+	DELAY  R11, NOP
+	ADD    R24, R23, 1
+	TRIGCHK R24.w0, 13
+	DELAY  R11, NOP
 	NOP
+	TRIGCHK R24.w2, 15
+	DELAY  R11, NOP
+	ADD    R25, R24, 1
+	TRIGCHK R25.w0, 17
+	DELAY  R11, NOP
 	NOP
-$S1:	ADD    R22, R21, 1
+	TRIGCHK R25.w2, 19
+	DELAY  R11, NOP
+	ADD    R26, R25, 1
+	TRIGCHK R26.w0, 21
+	DELAY  R11, NOP
 	NOP
+	TRIGCHK R26.w2, 23
+	DELAY  R11, NOP
+	ADD    R27, R26, 1
+	TRIGCHK R27.w0, 25
+	DELAY  R11, NOP
 	NOP
+	TRIGCHK R27.w2, 27
+	DELAY  R11, NOP
+	ADD    R28, R27, 1
+	TRIGCHK R28.w0, 29
+	DELAY  R11, "ADD    R29, R29, 32"
 	NOP
-	ADD    R23, R22, 1
+	TRIGCHK R28.w2, 31
+	DELAY  R11, "XOUT   10, &R20, 40"
+	ADD    R21, R28, 1
+	TRIGCHK1 R21.w0
+	DELAY  R11, "LDI    R31, PRU1_PRU0_INTERRUPT + 16"
 	NOP
+	TRIGCHK R21.w2, 3
+	DELAY  R11, "JMP    $samplewintest$2"
+
+; Run length encoding [sampleunit = 2], one 32-bit record per run:
+; value in bits 0-15, repeat count - 1 in bits 16-31.
+; Every path through the loop takes 15 cycles + DELAY R7, R7 = R14 - 7
+; keeps the sample period at 2 * R14 cycles [R14 >= 9]
+; R13 = value of the current run, R10 = its length - 1, R8 = max length - 1
+; R1.b0 = register file address of the next record [R21-R28]
+samplerle:
+	SUB    R7, R14, 7
+	LDI    R8, 0xFFFF
+	LDI    R1.b0, 21 * 4
+	MOV    R13, R31.w0
+	LDI    R10, 0
+$samplerle$1:
+	MOV    R12, R31.w0
+	QBNE   $samplerle$chg, R12, R13
+	QBEQ   $samplerle$new, R10, R8          ; Run too long, start another
+	ADD    R10, R10, 1
+	JMP    $samplerle$padA
+$samplerle$chg:
+	JMP    $samplerle$new
+$samplerle$new:
+	; Record the current run, start a new one with this sample
+	LSL    R9, R10, 16
+	OR     R9, R9, R13
+	MVID   *R1.b0, R9
+	MOV    R13, R12
+	LDI    R10, 0
+	ADD    R1.b0, R1.b0, 4
+	QBNE   $samplerle$padB, R1.b0, 29 * 4
+	ADD    R29, R29, 32                     ; Maintain global byte counter
+	XOUT   10, &R21, 36                     ; Move data across the broadside
+	LDI    R31, PRU1_PRU0_INTERRUPT + 16    ; Jab PRU0
+	LDI    R1.b0, 21 * 4
 	NOP
+	DELAY  R7, "JMP    $samplerle$1"
+$samplerle$padA:
 	NOP
-	ADD    R24, R23, 1
 	NOP
 	NOP
 	NOP
-	ADD    R25, R24, 1
 	NOP
+$samplerle$padB:
 	NOP
 	NOP
-	ADD    R26, R25, 1
 	NOP
 	NOP
 	NOP
-	ADD    R27, R26, 1
+	DELAY  R7, "JMP    $samplerle$1"
+
+; Channel packing [channelmask != 0], only a group of R6 = 1, 2, 4 or 8
+; channels is stored, R5 = 32 / R6 samples per word, first sample in the
+; lowest bits. R9 brings the group to the top bits of R12 [R8 = their mask]
+; and the word in R13 moves down to make room for it.
+; Every path takes 15 cycles + DELAY R7 like samplerle [R14 >= 9]
+; R10 = samples left in this word, R1.b0 = register to store it to [R21-R28]
+samplepack:
+	SUB    R7, R14, 7
+	LDI    R1.b0, 21 * 4
+	MOV    R10, R5
+$samplepack$1:
+	LSL    R12, R31, R9
+	AND    R12, R12, R8
+	LSR    R13, R13, R6
+	OR     R13, R13, R12
+	SUB    R10, R10, 1
+	QBEQ   $samplepack$word, R10, 0
+	JMP    $samplepack$padA
+$samplepack$word:
+	; Word complete, move on to the next register
+	MVID   *R1.b0, R13
+	MOV    R10, R5
+	ADD    R1.b0, R1.b0, 4
+	QBNE   $samplepack$padB, R1.b0, 29 * 4
+	ADD    R29, R29, 32                     ; Maintain global byte counter
+	XOUT   10, &R21, 36                     ; Move data across the broadside
+	LDI    R31, PRU1_PRU0_INTERRUPT + 16    ; Jab PRU0
+	LDI    R1.b0, 21 * 4
+	NOP
+	DELAY  R7, "JMP    $samplepack$1"
+$samplepack$padA:
+	NOP
+	NOP
+	NOP
+$samplepack$padB:
+	NOP
 	NOP
 	NOP
 	NOP
+	NOP
+	DELAY  R7, "JMP    $samplepack$1"
+
+; Fractional sample periods [R7 != 0, 8 or 16-bit samples]: every path
+; takes 11 + R5 + 2 * R7 cycles, plus one more when the phase accumulator R3
+; carries into bit 16 after adding R4 [fraction of a cycle, in 1/65536].
+; The average period is exact to 2^-16 cycles, every sample is taken within
+; one cycle (5 ns) of its ideal time [R7 >= 2, period >= 15 cycles]
+; R1.b0 = register file address of the next sample [R21-R28]
+samplefrac:
+	LDI    R1.b0, 21 * 4
+	LDI    R3, 0
+	QBEQ   samplefrac8, R15, 1
+samplefrac16:
+	MVIW   *R1.b0, R31.w0
+	ADD    R1.b0, R1.b0, 2
+	QBNE   $samplefrac16$pad, R1.b0, 29 * 4
+	ADD    R29, R29, 32                     ; Maintain global byte counter
+	XOUT   10, &R21, 36                     ; Move data across the broadside
+	LDI    R31, PRU1_PRU0_INTERRUPT + 16    ; Jab PRU0
+	LDI    R1.b0, 21 * 4
+	JMP    $samplefrac16$acc
+$samplefrac16$pad:
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+$samplefrac16$acc:
+	ADD    R3, R3, R4
+	QBBC   $samplefrac16$1, R3, 16
+	NOP
+$samplefrac16$1:
+	CLR    R3, R3, 16
+	QBBC   $samplefrac16$2, R5, 0
+	NOP
+$samplefrac16$2:
+	DELAY  R7, "JMP    samplefrac16"
+
+samplefrac8:
+	MVIB   *R1.b0, R31.b0
+	ADD    R1.b0, R1.b0, 1
+	QBNE   $samplefrac8$pad, R1.b0, 29 * 4
+	ADD    R29, R29, 32                     ; Maintain global byte counter
+	XOUT   10, &R21, 36                     ; Move data across the broadside
+	LDI    R31, PRU1_PRU0_INTERRUPT + 16    ; Jab PRU0
+	LDI    R1.b0, 21 * 4
+	JMP    $samplefrac8$acc
+$samplefrac8$pad:
+	NOP
+	NOP
+	NOP
+	NOP
+	NOP
+$samplefrac8$acc:
+	ADD    R3, R3, R4
+	QBBC   $samplefrac8$1, R3, 16
+	NOP
+$samplefrac8$1:
+	CLR    R3, R3, 16
+	QBBC   $samplefrac8$2, R5, 0
+	NOP
+$samplefrac8$2:
+	DELAY  R7, "JMP    samplefrac8"
+
+; External clock [R10 = 1 rising, 2 falling edges], 8 or 16-bit samples
+; R1.b0 = register file address of the next sample [R21-R28]. Handing a
+; block over takes 5 more cycles, the clock must not be faster than ~15 MHz
+sampleclk:
+	LDI    R1.b0, 21 * 4
+	QBEQ   sampleclkf, R10, 2
+	QBEQ   sampleclkr8, R15, 1
+sampleclkr16:
+	SAMPLECLK QBBS, QBBC, MVIW, R12.w0, 2
+sampleclkr8:
+	SAMPLECLK QBBS, QBBC, MVIB, R12.b0, 1
+sampleclkf:
+	QBEQ   sampleclkf8, R15, 1
+sampleclkf16:
+	SAMPLECLK QBBC, QBBS, MVIW, R12.w0, 2
+sampleclkf8:
+	SAMPLECLK QBBC, QBBS, MVIB, R12.b0, 1
+
+; Unit test to check for dropped frames [sampleunit 4]
+; Emits a 32-bit counter incremented on every word, one word every 2 * R14
+; cycles [R14 >= 2]: 200 MB/s at R14 = 2. R8 = 2 * R14 - 2 makes up for
+; the hand over in the last word of every block
+sampleincnumberstest:
+	LSL    R8, R14, 1
+	SUB    R8, R8, 2
+	LDI    R21, 0
+	DELAY  R14, NOP
+$S1:	ADD    R22, R21, 1
+	DELAY  R14, NOP
+	ADD    R23, R22, 1
+	DELAY  R14, NOP
+	ADD    R24, R23, 1
+	DELAY  R14, NOP
+	ADD    R25, R24, 1
+	DELAY  R14, NOP
+	ADD    R26, R25, 1
+	DELAY  R14, NOP
+	ADD    R27, R26, 1
+	DELAY  R14, NOP
 	ADD    R28, R27, 1
+	ADD    R29, R29, 32                     ; Maintain global byte counter
 	XOUT   10, &R21, 36
 	LDI    R31, PRU1_PRU0_INTERRUPT + 16
-	NOP
 	ADD    R21, R28, 1
-	NOP
-	NOP
-	JMP    $S1
+	DELAY  R8, "JMP    $S1"
 
 ; End-of-firmware
 	HALT
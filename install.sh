@@ -94,6 +94,12 @@ install_go_and_compile_server() {
 	/bin/su ${DEFAULT_USER} -c "go build server.go"
 }
 
+compile_c_server() {
+	echo "${log} Compiling C TCP Server"
+	cd ${DIR}/tcp-server-c
+	/bin/su ${DEFAULT_USER} -c "gcc -O2 -Wall -I../testapp -o server server.c ../testapp/beaglelogic.c"
+}
+
 update_uboot_uenv_txt() {
 	if [ ! "x${RUNNING_AS_CHROOT}" = "xyes" ] ; then
 		echo "${log} Updating uEnv.txt"
@@ -144,6 +150,7 @@ install_udev_rules
 install_systemd_service
 install_node_modules
 install_go_and_compile_server
+compile_c_server
 install_sigrok
 if [ "x${UPGRADING}" = "xno" ] ; then
 	update_uboot_uenv_txt
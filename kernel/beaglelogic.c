@@ -30,12 +30,18 @@
 #include <linux/interrupt.h>
 #include <linux/irqreturn.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/genalloc.h>
 #include <linux/mm.h>
 #include <linux/dma-mapping.h>
 
 #include <linux/kobject.h>
 #include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/hrtimer.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
 
 #include <linux/of.h>
 #include <linux/of_platform.h>
@@ -44,15 +50,19 @@
 
 #include <linux/sysfs.h>
 #include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "beaglelogic.h"
 
+#define CREATE_TRACE_POINTS
+#include "beaglelogic_trace.h"
+
 /* Buffer states */
 enum bufstates {
 	STATE_BL_BUF_ALLOC,
 	STATE_BL_BUF_MAPPED,
-	STATE_BL_BUF_UNMAPPED,
-	STATE_BL_BUF_DROPPED
+	STATE_BL_BUF_UNMAPPED
 };
 
 /* PRU Commands */
@@ -61,12 +71,67 @@ enum bufstates {
 #define CMD_SET_CONFIG  3   /* Get the context pointer */
 #define CMD_START       4   /* Arm the LA (start sampling) */
 
-/* PRU-side sample buffer descriptor */
+/* Command queue of the firmware, a power of 2 */
+#define BL_CMDQ_LEN		4
+#define BL_CMD_TIMEOUT_MS	20
+
+/* PRU-side sample buffer descriptor, arranged as a ring */
 struct buflist {
 	uint32_t dma_start_addr;
 	uint32_t dma_end_addr;
+	uint32_t flags;
+	uint32_t dma_cur_addr;	/* Write pointer, written back by the PRU */
+	uint32_t tstart;	/* IEP count at the first block, written back */
+	uint32_t tend;		/* IEP count at the last block, written back */
+	uint32_t byteseq;	/* PRU1 byte counter after the last block */
+	uint32_t reserved;
 };
 
+/* Descriptor flags */
+#define BL_DESC_OWN	(1 << 0)    /* Owned by the PRU, may be filled */
+#define BL_DESC_DONE	(1 << 1)    /* Filled, written back by the PRU */
+#define BL_DESC_LAST	(1 << 2)    /* Stop the capture after this buffer */
+#define BL_DESC_GAP	(1 << 3)    /* Samples dropped before this buffer */
+#define BL_DESC_RECONF	(1 << 5)    /* First buffer at the staged divisor */
+
+/* Firmware changing the sample rate on the fly [0.16] */
+#define BL_FW_MIN_VERSION	0x0011
+
+/* PRU0 pins that can carry the sync line */
+#define BL_SYNC_PINS		0xFFFF
+
+/* The run length loop takes 15 cycles per sample, samplediv >= 9 */
+#define BL_RLE_MIN_SAMPLEDIV	9
+
+/* So does the channel packing loop */
+#define BL_PACK_MIN_SAMPLEDIV	9
+
+/* Sample rates above coreclockfreq / 2 select bursts of 32 8-bit samples
+ * taken on consecutive PRU cycles, sampleunit 3 for the firmware */
+#define BL_PRU_SAMPLEUNIT_BURST	3
+#define BL_BURST_SAMPLES	32
+#define BL_BURST_CYCLES		36
+
+/* PRU1 counter test pattern instead of samples, sampleunit 4 for the
+ * firmware: one 32-bit word every 2 * samplediv cycles, samplediv >= 2 */
+#define BL_PRU_SAMPLEUNIT_TEST	4
+
+/* Rates that are not (100 / n) MHz are generated with a fractional sample
+ * period (in 1/65536 PRU cycles) for plain 8 and 16-bit samples. The loop
+ * takes 15 cycles at least and the period has to fit in 16 bits */
+#define BL_FRAC_MIN_CYCLES	15
+#define BL_FRAC_MAX_CYCLES	0xFFFF
+
+/* Window captures check the trigger on every sample, which takes 8 cycles
+ * out of each sample period on PRU1: samplediv >= 6, i.e. <= 16.6 MSPS */
+#define BL_WINDOW_MIN_SAMPLEDIV	6
+
+/* Channels that can take part in a trigger */
+#define BL_TRIGGER_CHANNELS	0xFFFF
+
+/* Max sample buffers in the pool, independently of the ring size */
+#define BL_MAX_BUFCOUNT		1024
+
 /* Shared structure containing PRU attributes */
 struct capture_context {
 	/* Magic bytes */
@@ -77,12 +142,56 @@ struct capture_context {
 	uint32_t resp;          // Response code
 
 	uint32_t samplediv;     // Sample rate = (100 / samplediv) MHz
-	uint32_t sampleunit;    // 0 = 16-bit, 1 = 8-bit
+	uint32_t sampleunit;    // 0 = 16-bit, 1 = 8-bit, 2 = RLE, 3 = bursts
 	uint32_t triggerflags;  // 0 = one-shot, 1 = continuous sampling
 
+	uint32_t listcount;     // Descriptors in use in the ring
+	uint32_t stalls;        // 32-byte blocks dropped for lack of a buffer
+
+	uint32_t trigqmask;     // Trigger: wait for (input & qmask) == qval
+	uint32_t trigqval;
+	uint32_t trigfmask;     // then fire on (input & fmask) == fval
+	uint32_t trigfval;
+
+	uint32_t posttrigger;   // Window capture: bytes from the trigger on
+	uint32_t trigpos;       // Byte offset of the trigger, written back
+
+	uint32_t coalesce;      // Descriptors per interrupt to the host, >= 1
+	uint32_t donecount;     // Descriptors written back, written back
+
+	uint32_t channelmask;   // Channels to pack, 0 = sampleunit as is
+	uint32_t sampleperiod;  // PRU cycles per sample (16.16), 0 = samplediv
+	uint32_t extclock;      // Clock channel | edge << 8 [1 = rising], 0 = off
+	uint32_t syncstart;     // Sync pin | mode << 8 [1 = master], 0 = off
+
+	uint32_t armed;         // PRU1 configured, waiting for CMD_START
+	uint32_t runs;          // Captures completed, written back
+	uint32_t nextdiv;       // Divisor from the next buffer on, 0 = none
+	uint32_t reserved;
+
+	uint32_t cmdhead;       // Commands queued by the kernel
+	uint32_t cmdtail;       // Commands done, written back
+	struct {
+		uint32_t cmd;
+		uint32_t resp;  // Written back
+	} cmdq[BL_CMDQ_LEN];
+
 	struct buflist list_head;
 };
 
+/* Settings PRU0 hands over to PRU1 on CMD_SET_CONFIG. The others are read by
+ * PRU0 as the capture starts, and can change without reconfiguring */
+struct beaglelogic_pruconfig {
+	uint32_t samplediv;
+	uint32_t sampleunit;
+	uint32_t trigqmask, trigqval;
+	uint32_t trigfmask, trigfval;
+	uint32_t posttrigger;
+	uint32_t channelmask;
+	uint32_t sampleperiod;
+	uint32_t extclock;
+};
+
 /* Forward declration */
 static const struct file_operations pru_beaglelogic_fops;
 
@@ -96,6 +205,17 @@ struct logic_buffer {
 	unsigned short state;
 	unsigned short index;
 
+	/* Allocated with dma_alloc_coherent, never mapped / unmapped */
+	bool coherent;
+
+	/* Mapped for its entire lifetime, ownership moves with dma_sync_*
+	 * over the 'synced' bytes last handed over to the CPU */
+	bool persistent;
+	uint32_t synced;
+
+	/* Metadata of the data it holds, valid once filled */
+	struct beaglelogic_bufinfo info;
+
 	struct logic_buffer *next;
 };
 
@@ -103,6 +223,24 @@ struct beaglelogic_private_data {
 	const char *fw_names[PRUSS_NUM_PRUS];
 };
 
+/* Delay between the end of a buffer and the wakeup of a reader waiting for
+ * it, bucket n counts delays of 2^(n-1) to 2^n us (< 1 us for bucket 0) */
+#define BL_LATENCY_BUCKETS	20
+
+/* Statistics since the module was loaded, or since they were reset */
+struct beaglelogic_stats {
+	u64 bytes;		/* Bytes captured into the buffers */
+	u64 buffers;		/* Buffers completed */
+	u64 gaps;		/* Buffers after samples dropped by the PRU */
+	u64 lostbytes;		/* Bytes dropped by the PRU, no buffer free */
+	u64 overwritten;	/* Buffers overwritten before being consumed */
+	u64 irqs;		/* Runs of beaglelogic_serve_irq */
+	u64 irqtime;		/* Time spent in beaglelogic_serve_irq, ns */
+	u64 irqmax;		/* Longest beaglelogic_serve_irq, ns */
+	uint32_t maxlag;	/* Most buffers held for the slowest consumer */
+	uint32_t latency[BL_LATENCY_BUCKETS];
+};
+
 struct beaglelogicdev {
 	/* Misc device descriptor */
 	struct miscdevice miscdev;
@@ -134,22 +272,88 @@ struct beaglelogicdev {
 	uint32_t bufcount;
 	wait_queue_head_t wait;
 
+	/* Zero-copy ring control area, shared with userspace. The indexes
+	 * are only ever stored into it, filledseq being the producer */
+	struct beaglelogic_ring *ring;
+	size_t ringsize;
+	uint32_t ring_users;	/* Readers that have mapped the ring */
+	uint32_t ring_consumer;	/* Kernel copy of ring->consumer */
+	uint32_t ring_dropped;	/* Kernel copy of ring->dropped */
+
+	/* PRU descriptor ring, buffers are posted and retired in pool order
+	 * [protected by desclock]
+	 *
+	 * Completed buffers are numbered in sequence. Every reader has its own
+	 * cursor and a buffer is only posted again once all the cursors (the
+	 * read() readers and the shared zero-copy ring) have passed it */
+	spinlock_t desclock;
+	struct logic_buffer *bufnextpost;	/* Next buffer to post */
+	uint32_t desccount;	/* Descriptors in use in the ring */
+	uint32_t deschead;	/* Next descriptor to post */
+	uint32_t desctail;	/* Next descriptor to be written back */
+	uint32_t descposted;	/* Buffers currently owned by the PRU */
+	uint32_t bufsposted;	/* Buffers posted in this session */
+	uint32_t bufsfree;	/* Buffers consumed, waiting to be posted */
+	uint32_t bufsfilled;	/* Buffers filled, not yet consumed */
+	uint32_t filledseq;	/* Sequence number of the next buffer to fill */
+	uint32_t releasedseq;	/* Oldest buffer still held by a reader */
+	struct list_head readers;	/* Readers consuming through read() */
+	uint32_t users;		/* Open files, the last one stops the capture */
+	uint32_t retiredcount;	/* Descriptors retired, follows donecount */
+
+	/* Interrupt coalescing: the PRU interrupts us every 'coalesce'
+	 * buffers, and we poll for the others every 'coalesce_usecs' */
+	uint32_t coalesce;
+	uint32_t coalesce_usecs;
+	struct hrtimer polltimer;
+
+	/* Buffer metadata, extended from the 32-bit PRU counters */
+	u64 starttime;		/* ktime of the capture start, in ns */
+	bool syncwait;		/* Start time unknown until the first buffer */
+	u64 streampos;		/* Bytes sampled up to the last buffer */
+	u64 lostbytes;		/* Bytes dropped in this capture */
+	uint32_t caprate;	/* Sample rate of the buffers being filled */
+	uint32_t stagedrate;	/* Rate from the next buffer on [desclock] */
+	bool ratepending;	/* stagedrate not reached a buffer [desclock] */
+
 	/* ISR Bookkeeping */
 	uint32_t previntcount;	/* Previous interrupt count read from PRU */
 
 	/* Firmware capabilities */
 	struct capture_context *cxt_pru;
+	wait_queue_head_t cmdwait;	/* Woken up as PRU0 completes commands */
+
+	/* Settings PRU1 was last armed with, only written again on change */
+	struct beaglelogic_pruconfig pruconfig;
+	uint32_t pruruns;	/* cxt_pru->runs as the capture started */
 
 	/* Device capabilities */
-	uint32_t maxbufcount;	/* Max buffer count supported by the PRU FW */
+	uint32_t maxdesccount;	/* Max ring descriptors supported by the PRU FW */
+	uint32_t maxbufcount;	/* Max buffers in the pool */
 	uint32_t bufunitsize;  	/* Size of 1 Allocation unit */
 	uint32_t samplerate; 	/* Sample rate = 100 / n MHz, n = 1+ (int) */
 	uint32_t triggerflags;	/* 0:one-shot, 1:continuous */
 	uint32_t sampleunit; 	/* 0:16bits, 1:8bits */
-
-	/* State */
+	uint32_t channelmask;	/* Packed channels, 0 for none */
+	uint32_t testmode;	/* 1: PRU test pattern instead of samples */
+	struct beaglelogic_clock clock;	/* External sample clock */
+	struct beaglelogic_sync sync;	/* Synchronized start */
+	uint32_t allocmode;	/* 0:kmalloc, 1:coherent, 2:streaming */
+	struct beaglelogic_trigger trigger;
+	struct beaglelogic_window window;	/* In samples */
+
+	/* Trigger window of the current / last capture */
+	bool windowmode;
+	uint32_t winpre, winpost;	/* In bytes */
+	struct beaglelogic_triggerinfo triginfo;
+
+	/* State, its session transitions are made under desclock */
 	uint32_t state;
 	uint32_t lasterror;
+
+	/* Statistics, in sysfs (stats) and debugfs (latency histogram) */
+	struct beaglelogic_stats stats;
+	struct dentry *debugfs;
 };
 
 struct logic_buffer_reader {
@@ -158,28 +362,143 @@ struct logic_buffer_reader {
 
 	uint32_t pos;
 	uint32_t remaining;
+
+	bool reading;		/* Consumes buffers through read() */
+	struct list_head node;	/* In bldev->readers while reading */
+	uint32_t seq;		/* Sequence number of the buffer being read */
+	u64 offset;		/* Stream offset of the next byte to read */
+	u64 lost;		/* Bytes this reader did not get */
+	uint32_t winpos;	/* Bytes of the trigger window already read */
+
+	/* Set if this reader consumes through the mmap()ed ring */
+	bool ring_mapped;
 };
 
 #define to_beaglelogicdev(dev)	container_of((dev), \
 		struct beaglelogicdev, miscdev)
 
 #define DRV_NAME	"beaglelogic"
-#define DRV_VERSION	"1.2"
+#define DRV_VERSION	"1.3"
+
+/* Smallest unit the coherent allocator falls back to */
+#define BL_MIN_COHERENT_UNIT	(256 * 1024)
 
 /* Begin Buffer Management section */
 
+static const char * const beaglelogic_allocmode_names[] = {
+	[BL_ALLOCMODE_KMALLOC] = "kmalloc",
+	[BL_ALLOCMODE_COHERENT] = "coherent",
+	[BL_ALLOCMODE_STREAMING] = "streaming",
+};
+
+/* Allocate one buffer unit in the current allocation mode */
+static int beaglelogic_alloc_unit(struct beaglelogicdev *bldev,
+                                  struct logic_buffer *lbuf)
+{
+	void *buf;
+	dma_addr_t dma_addr;
+
+	if (bldev->allocmode == BL_ALLOCMODE_COHERENT) {
+		/* Backed by CMA, device owns it for the entire lifetime */
+		buf = dma_alloc_coherent(bldev->p_dev, bldev->bufunitsize,
+				&dma_addr, GFP_KERNEL | __GFP_NOWARN);
+		if (!buf)
+			return -ENOMEM;
+
+		lbuf->phys_addr = dma_addr;
+		lbuf->coherent = true;
+		lbuf->state = STATE_BL_BUF_MAPPED;
+
+		/* Fill with 0xFF */
+		memset(buf, 0xFF, bldev->bufunitsize);
+	} else {
+		buf = kmalloc(bldev->bufunitsize, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+
+		/* Fill with 0xFF */
+		memset(buf, 0xFF, bldev->bufunitsize);
+
+		lbuf->phys_addr = virt_to_phys(buf);
+		lbuf->coherent = false;
+		lbuf->persistent = false;
+	}
+
+	/* Map once, the device owns it until the first completion */
+	if (bldev->allocmode == BL_ALLOCMODE_STREAMING) {
+		dma_addr = dma_map_single(bldev->miscdev.this_device, buf,
+				bldev->bufunitsize, DMA_FROM_DEVICE);
+		if (dma_mapping_error(bldev->miscdev.this_device, dma_addr)) {
+			kfree(buf);
+			return -ENOMEM;
+		}
+
+		lbuf->phys_addr = dma_addr;
+		lbuf->persistent = true;
+		lbuf->synced = 0;
+		lbuf->state = STATE_BL_BUF_MAPPED;
+	}
+
+	lbuf->buf = buf;
+	lbuf->size = bldev->bufunitsize;
+
+	return 0;
+}
+
+static void beaglelogic_free_unit(struct beaglelogicdev *bldev,
+                                  struct logic_buffer *lbuf)
+{
+	if (!lbuf->buf)
+		return;
+
+	if (lbuf->coherent) {
+		dma_free_coherent(bldev->p_dev, lbuf->size, lbuf->buf,
+				lbuf->phys_addr);
+	} else {
+		if (lbuf->persistent)
+			dma_unmap_single(bldev->miscdev.this_device,
+					lbuf->phys_addr, lbuf->size,
+					DMA_FROM_DEVICE);
+		kfree(lbuf->buf);
+	}
+
+	lbuf->buf = NULL;
+}
+
+/* A capture session runs from its start until the PRU signals its end */
+static bool beaglelogic_session_active(struct beaglelogicdev *bldev)
+{
+	uint32_t state = READ_ONCE(bldev->state);
+
+	return state == STATE_BL_RUNNING || state == STATE_BL_REQUEST_STOP;
+}
+
+/* Take the device mutex to change the configuration or the buffers, which
+ * are left alone while a capture session runs */
+static bool beaglelogic_trylock_idle(struct beaglelogicdev *bldev)
+{
+	if (!mutex_trylock(&bldev->mutex))
+		return false;
+
+	if (beaglelogic_session_active(bldev)) {
+		mutex_unlock(&bldev->mutex);
+		return false;
+	}
+	return true;
+}
+
 /* Allocate DMA buffers for the PRU
  * This method acquires & releases the device mutex */
 static int beaglelogic_memalloc(struct device *dev, uint32_t bufsize)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
-	int i, cnt;
-	void *buf;
+	int i, cnt, failed;
 
 	/* Check if BL is in use */
-	if (!mutex_trylock(&bldev->mutex))
+	if (!beaglelogic_trylock_idle(bldev))
 		return -EBUSY;
 
+retry:
 	/* Compute no. of buffers to allocate, round up
 	 * We need at least two buffers for ping-pong action */
 	cnt = max(DIV_ROUND_UP(bufsize, bldev->bufunitsize), (uint32_t)2);
@@ -201,39 +520,58 @@ static int beaglelogic_memalloc(struct device *dev, uint32_t bufsize)
 
 	/* Allocate DMA buffers */
 	for (i = 0; i < cnt; i++) {
-		buf = kmalloc(bldev->bufunitsize, GFP_KERNEL);
-		if (!buf)
+		if (beaglelogic_alloc_unit(bldev, &bldev->buffers[i]))
 			goto failrelease;
 
-		/* Fill with 0xFF */
-		memset(buf, 0xFF, bldev->bufunitsize);
-
-		/* Set the buffers */
-		bldev->buffers[i].buf = buf;
-		bldev->buffers[i].phys_addr = virt_to_phys(buf);
-		bldev->buffers[i].size = bldev->bufunitsize;
 		bldev->buffers[i].index = i;
 
 		/* Circularly link the buffers */
 		bldev->buffers[i].next = &bldev->buffers[(i + 1) % cnt];
 	}
 
+	/* Allocate the ring control area, mapped by zero-copy readers */
+	bldev->ringsize = PAGE_ALIGN(sizeof(struct beaglelogic_ring) +
+			cnt * sizeof(struct beaglelogic_ring_desc));
+	bldev->ring = vmalloc_user(bldev->ringsize);
+	if (!bldev->ring)
+		goto failrelease;
+
+	bldev->ring->magic = BL_RING_MAGIC;
+	bldev->ring->bufcount = cnt;
+	bldev->ring->bufunitsize = bldev->bufunitsize;
+	for (i = 0; i < cnt; i++)
+		bldev->ring->desc[i].seq = BL_RING_SEQ_INVALID;
+
 	/* Write log and unlock */
-	dev_info(dev, "Successfully allocated %d bytes of memory.\n",
-			cnt * bldev->bufunitsize);
+	dev_info(dev, "Successfully allocated %d bytes of %s memory "\
+			"in %d units of %d bytes.\n",
+			cnt * bldev->bufunitsize,
+			beaglelogic_allocmode_names[bldev->allocmode],
+			cnt, bldev->bufunitsize);
 
 	mutex_unlock(&bldev->mutex);
 
 	/* Done */
 	return 0;
 failrelease:
-	for (i = 0; i < cnt; i++) {
-		if (bldev->buffers[i].buf)
-			kfree(bldev->buffers[i].buf);
-	}
+	failed = i;
+	for (i = 0; i < cnt; i++)
+		beaglelogic_free_unit(bldev, &bldev->buffers[i]);
 	devm_kfree(dev, bldev->buffers);
 	bldev->bufcount = 0;
 	bldev->buffers = NULL;
+
+	/* Contiguous memory may be too fragmented for large chunks. Retry
+	 * with smaller units as long as the PRU buffer list can hold them */
+	if (bldev->allocmode == BL_ALLOCMODE_COHERENT && failed < cnt &&
+			bldev->bufunitsize / 2 >= BL_MIN_COHERENT_UNIT &&
+			DIV_ROUND_UP(bufsize, bldev->bufunitsize / 2) <=
+				bldev->maxbufcount) {
+		bldev->bufunitsize /= 2;
+		dev_warn(dev, "Retrying allocation with %d byte units\n",
+				bldev->bufunitsize);
+		goto retry;
+	}
 	dev_err(dev, "Sample buffer allocation:");
 failnomem:
 	dev_err(dev, "Not enough memory\n");
@@ -241,23 +579,33 @@ failnomem:
 	return -ENOMEM;
 }
 
-/* Frees the DMA buffers and the bufferlist */
-static void beaglelogic_memfree(struct device *dev)
+/* Frees the DMA buffers and the bufferlist, unless a capture uses them */
+static int beaglelogic_memfree(struct device *dev)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
 	int i;
 
-	mutex_lock(&bldev->mutex);
+	if (mutex_lock_interruptible(&bldev->mutex))
+		return -ERESTARTSYS;
+
+	if (beaglelogic_session_active(bldev)) {
+		mutex_unlock(&bldev->mutex);
+		return -EBUSY;
+	}
+
 	if (bldev->buffers) {
 		for (i = 0; i < bldev->bufcount; i++)
-			if (bldev->buffers[i].buf)
-				kfree(bldev->buffers[i].buf);
+			beaglelogic_free_unit(bldev, &bldev->buffers[i]);
 
 		devm_kfree(dev, bldev->buffers);
 		bldev->buffers = NULL;
 		bldev->bufcount = 0;
+
+		vfree(bldev->ring);
+		bldev->ring = NULL;
 	}
 	mutex_unlock(&bldev->mutex);
+	return 0;
 }
 
 /* No argument checking for the map/unmap functions */
@@ -269,6 +617,22 @@ static int beaglelogic_map_buffer(struct device *dev, struct logic_buffer *buf)
 	if (buf->state == STATE_BL_BUF_MAPPED)
 		return 0;
 
+	/* Coherent buffers only change hands */
+	if (buf->coherent) {
+		buf->state = STATE_BL_BUF_MAPPED;
+		return 0;
+	}
+
+	/* Persistent mappings: give back what the CPU was handed */
+	if (buf->persistent) {
+		if (buf->synced)
+			dma_sync_single_for_device(dev, buf->phys_addr,
+					buf->synced, DMA_FROM_DEVICE);
+		buf->synced = 0;
+		buf->state = STATE_BL_BUF_MAPPED;
+		return 0;
+	}
+
 	dma_addr = dma_map_single(dev, buf->buf, buf->size, DMA_FROM_DEVICE);
 	if (dma_mapping_error(dev, dma_addr))
 		goto fail;
@@ -283,22 +647,37 @@ fail:
 	return -1;
 }
 
+/* Hand a buffer over to the CPU, 'len' being the bytes the PRU wrote */
 static void beaglelogic_unmap_buffer(struct device *dev,
-                                     struct logic_buffer *buf)
+                                     struct logic_buffer *buf, uint32_t len)
 {
-	dma_unmap_single(dev, buf->phys_addr, buf->size, DMA_FROM_DEVICE);
+	/* Not mapped, nothing to do */
+	if (buf->state == STATE_BL_BUF_ALLOC ||
+			buf->state == STATE_BL_BUF_UNMAPPED)
+		return;
+
+	if (buf->persistent) {
+		len = min_t(uint32_t, len, buf->size);
+		if (len)
+			dma_sync_single_for_cpu(dev, buf->phys_addr, len,
+					DMA_FROM_DEVICE);
+		buf->synced = len;
+	} else if (!buf->coherent)
+		dma_unmap_single(dev, buf->phys_addr, buf->size,
+				DMA_FROM_DEVICE);
 	buf->state = STATE_BL_BUF_UNMAPPED;
 }
 
 /* Fill the sample buffer with a pattern of increasing 32-bit ints
  * This can be studied to watch out for dropped bytes/buffers */
-static void beaglelogic_fill_buffer_testpattern(struct device *dev)
+static int beaglelogic_fill_buffer_testpattern(struct device *dev)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
 	int i, j;
 	uint32_t cnt = 0, *addr;
 
-	mutex_lock(&bldev->mutex);
+	if (!beaglelogic_trylock_idle(bldev))
+		return -EBUSY;
 	for (i = 0; i < bldev->bufcount; i++) {
 		addr = bldev->buffers[i].buf;
 
@@ -306,16 +685,272 @@ static void beaglelogic_fill_buffer_testpattern(struct device *dev)
 			*addr++ = cnt++;
 	}
 	mutex_unlock(&bldev->mutex);
+	return 0;
+}
+
+/* Reset the ring control area at the beginning of a capture session */
+static void beaglelogic_ring_reset(struct beaglelogicdev *bldev)
+{
+	struct beaglelogic_ring *ring = bldev->ring;
+	int i;
+
+	if (!ring)
+		return;
+
+	bldev->ring_dropped = 0;
+	ring->producer = 0;
+	ring->consumer = 0;
+	ring->dropped = 0;
+	for (i = 0; i < bldev->bufcount; i++)
+		ring->desc[i].seq = BL_RING_SEQ_INVALID;
+}
+
+/* Publish a completed buffer to zero-copy readers, before filledseq moves
+ * past it [called from the ISR, desclock held] */
+static void beaglelogic_ring_publish(struct beaglelogicdev *bldev,
+                                     struct logic_buffer *buf, uint32_t size)
+{
+	struct beaglelogic_ring *ring = bldev->ring;
+	uint32_t seq = bldev->filledseq;
+
+	ring->desc[buf->index].seq = seq;
+	ring->desc[buf->index].size = size;
+	ring->desc[buf->index].flags = buf->info.flags;
+	ring->desc[buf->index].lost = buf->info.lost;
+	ring->desc[buf->index].offset = buf->info.offset;
+	ring->desc[buf->index].tstart = buf->info.tstart;
+	ring->desc[buf->index].tend = buf->info.tend;
+	ring->desc[buf->index].samplerate = buf->info.samplerate;
+
+	/* The descriptor must be visible before the producer index moves */
+	smp_wmb();
+	ring->producer = seq + 1;
+
+	/* Filling this buffer overwrote sequence (seq - bufcount) */
+	if (bldev->ring_users && seq >= bldev->bufcount &&
+			(int32_t)(seq - bldev->bufcount -
+				bldev->ring_consumer) >= 0) {
+		ring->dropped = ++bldev->ring_dropped;
+		bldev->stats.overwritten++;
+		bldev->lasterror = 0x10000 | buf->index;
+	}
+}
+
+/* Hand free buffers over to the PRU, in pool order [desclock held]
+ *
+ * The PRU fills descriptors in ring order and the buffers are posted in pool
+ * order, so buffers complete in the order of their 'next' links. A buffer is
+ * only posted again once it has been consumed, so a slow reader stalls the
+ * PRU (which then drops samples and flags the next buffer) instead of having
+ * its data overwritten */
+static void beaglelogic_post_buffers(struct beaglelogicdev *bldev)
+{
+	struct device *dev = bldev->miscdev.this_device;
+	struct buflist *desc = &bldev->cxt_pru->list_head;
+	struct logic_buffer *buf;
+	uint32_t flags;
+
+	while (bldev->bufsfree && bldev->descposted < bldev->desccount) {
+		/* One-shot captures fill every buffer exactly once */
+		if (bldev->triggerflags == BL_TRIGGERFLAGS_ONESHOT &&
+				!bldev->windowmode &&
+				bldev->bufsposted == bldev->bufcount)
+			break;
+
+		buf = bldev->bufnextpost;
+		if (beaglelogic_map_buffer(dev, buf))
+			break;
+
+		flags = BL_DESC_OWN;
+		if (bldev->triggerflags == BL_TRIGGERFLAGS_ONESHOT &&
+				!bldev->windowmode &&
+				bldev->bufsposted == bldev->bufcount - 1)
+			flags |= BL_DESC_LAST;
+
+		desc[bldev->deschead].dma_start_addr = buf->phys_addr;
+		desc[bldev->deschead].dma_end_addr = buf->phys_addr + buf->size;
+
+		/* The PRU must see the addresses before the owner bit */
+		wmb();
+		desc[bldev->deschead].flags = flags;
+
+		bldev->deschead = (bldev->deschead + 1) % bldev->desccount;
+		bldev->bufnextpost = buf->next;
+		bldev->descposted++;
+		bldev->bufsposted++;
+		bldev->bufsfree--;
+
+		trace_beaglelogic_repost(buf->index, bldev->bufsposted,
+				bldev->starttime, bldev->coreclockfreq);
+	}
+}
+
+/* PRU cycles since the start of the capture, from the kernel clock */
+static u64 beaglelogic_pru_now(struct beaglelogicdev *bldev)
+{
+	return div_u64((ktime_get_ns() - bldev->starttime) *
+			(bldev->coreclockfreq / 1000000), 1000);
+}
+
+/* Fill in the metadata of a buffer from its written back descriptor
+ *
+ * The PRU counters are 32 bits wide. The byte counter is extended from the
+ * previous buffer, the end timestamp from the current time (the interrupt
+ * comes in right after the last block) and the start timestamp from the end */
+static void beaglelogic_record_bufinfo(struct beaglelogicdev *bldev,
+                                       struct logic_buffer *buf,
+                                       struct buflist *desc, uint32_t size)
+{
+	struct beaglelogic_bufinfo *info = &buf->info;
+	u64 now, end;
+
+	end = bldev->streampos +
+			(uint32_t)(desc->byteseq - (uint32_t)bldev->streampos);
+	/* A slave starts whenever the sync line rises, the first buffer
+	 * tells when that was */
+	if (bldev->syncwait) {
+		bldev->starttime = ktime_get_ns() - div_u64((u64)desc->tend *
+				1000, bldev->coreclockfreq / 1000000);
+		bldev->syncwait = false;
+	}
+
+	now = beaglelogic_pru_now(bldev);
+
+	info->index = buf->index;
+	info->size = size;
+	info->offset = end - size;
+	info->lost = min_t(u64, info->offset - bldev->streampos, U32_MAX);
+	info->flags = info->lost ? BL_BUF_OVERRUN : 0;
+	if (desc->flags & BL_DESC_RECONF) {
+		info->flags |= BL_BUF_RATECHANGE;
+		bldev->caprate = bldev->stagedrate;
+		bldev->ratepending = false;
+	}
+	info->samplerate = bldev->caprate;
+	info->tend = now + (int32_t)(desc->tend - (uint32_t)now);
+	info->tstart = info->tend - (uint32_t)(desc->tend - desc->tstart);
+	trace_beaglelogic_buffer_done(info->index, info->offset, size,
+			info->lost, info->tstart, info->tend, now);
+
+	bldev->lostbytes += info->offset - bldev->streampos;
+	bldev->stats.lostbytes += info->offset - bldev->streampos;
+	bldev->stats.bytes += size;
+	bldev->stats.buffers++;
+	bldev->streampos = end;
+}
+
+/* Retire the buffers written back by the PRU [called from the ISR] */
+static void beaglelogic_retire_buffers(struct beaglelogicdev *bldev)
+{
+	struct device *dev = bldev->miscdev.this_device;
+	struct buflist *desc = &bldev->cxt_pru->list_head;
+	struct logic_buffer *buf;
+	uint32_t flags, size, done;
+
+	/* The PRU counts the descriptors it wrote back, retire them all */
+	done = READ_ONCE(bldev->cxt_pru->donecount);
+	rmb();
+
+	spin_lock(&bldev->desclock);
+	while (bldev->descposted && bldev->retiredcount != done) {
+		flags = desc[bldev->desctail].flags;
+		if (!(flags & BL_DESC_DONE))
+			break;
+		bldev->retiredcount++;
+
+		/* The last buffer of a window capture may be partly filled */
+		size = desc[bldev->desctail].dma_cur_addr -
+				desc[bldev->desctail].dma_start_addr;
+
+		buf = bldev->bufbeingread;
+		beaglelogic_record_bufinfo(bldev, buf,
+				&desc[bldev->desctail], size);
+
+		desc[bldev->desctail].flags = 0;
+		bldev->desctail = (bldev->desctail + 1) % bldev->desccount;
+		bldev->descposted--;
+
+		bldev->lastbufready = buf;
+		beaglelogic_unmap_buffer(dev, buf, size);
+
+		if (flags & BL_DESC_GAP) {
+			dev_warn_ratelimited(dev, "%u bytes dropped before "\
+					"buffer %d, %llu bytes total\n",
+					buf->info.lost, buf->index,
+					bldev->lostbytes);
+			bldev->lasterror = 0x20000 | buf->index;
+			bldev->stats.gaps++;
+		}
+
+		/* Avoid a false buffer overrun warning on the last run */
+		if (!(flags & BL_DESC_LAST))
+			bldev->bufbeingread = buf->next;
+
+		beaglelogic_ring_publish(bldev, buf, size);
+
+		/* Without any consumer, buffers are overwritten as they come.
+		 * So are they while a window capture waits for its trigger */
+		bldev->filledseq++;
+		if (bldev->windowmode || (list_empty(&bldev->readers) &&
+				!bldev->ring_users)) {
+			bldev->bufsfree++;
+			bldev->releasedseq++;
+		} else {
+			bldev->bufsfilled++;
+			bldev->stats.maxlag = max(bldev->stats.maxlag,
+					bldev->bufsfilled);
+		}
+	}
+	beaglelogic_post_buffers(bldev);
+	spin_unlock(&bldev->desclock);
 }
 
-/* Map all the buffers. This is done just before beginning a sample operation
+/* Post again the buffers every consumer is done with [desclock held] */
+static void beaglelogic_release_buffers(struct beaglelogicdev *bldev)
+{
+	struct logic_buffer_reader *reader;
+	uint32_t seq = bldev->filledseq, count;
+
+	/* Find the slowest cursor */
+	list_for_each_entry(reader, &bldev->readers, node)
+		if ((int32_t)(reader->seq - seq) < 0)
+			seq = reader->seq;
+	if (bldev->ring_users && (int32_t)(bldev->ring_consumer - seq) < 0)
+		seq = bldev->ring_consumer;
+
+	count = seq - bldev->releasedseq;
+	if ((int32_t)count <= 0)
+		return;
+
+	count = min(count, bldev->bufsfilled);
+	bldev->bufsfilled -= count;
+	bldev->bufsfree += count;
+	bldev->releasedseq += count;
+
+	if (bldev->state == STATE_BL_RUNNING)
+		beaglelogic_post_buffers(bldev);
+}
+
+/* Rewind a reader to the start of the capture [desclock held] */
+static void beaglelogic_reader_reset(struct logic_buffer_reader *reader)
+{
+	reader->seq = 0;
+	reader->buf = &reader->bldev->buffers[0];
+	reader->pos = 0;
+	reader->remaining = reader->buf->size;
+	reader->offset = 0;
+}
+
+/* Map all the buffers and post the first ones to the descriptor ring.
+ * This is done just before beginning a sample operation
  * NOTE: PRUs are halted at this time */
 static int beaglelogic_map_and_submit_all_buffers(struct device *dev)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
 	struct buflist *pru_buflist = &bldev->cxt_pru->list_head;
+	struct logic_buffer_reader *reader;
+	unsigned long flags;
 	int i, j;
-	dma_addr_t addr;
 
 	if (!pru_buflist)
 		return -1;
@@ -323,16 +958,49 @@ static int beaglelogic_map_and_submit_all_buffers(struct device *dev)
 	for (i = 0; i < bldev->bufcount;i++) {
 		if (beaglelogic_map_buffer(dev, &bldev->buffers[i]))
 			goto fail;
+
+		memset(&bldev->buffers[i].info, 0,
+				sizeof(bldev->buffers[i].info));
 	}
 
-	/* Write buffer table to the PRU memory, and null terminate */
-	for (i = 0; i < bldev->bufcount; i++) {
-		addr = bldev->buffers[i].phys_addr;
-		pru_buflist[i].dma_start_addr = addr;
-		pru_buflist[i].dma_end_addr = addr + bldev->buffers[i].size;
+	/* Reset the descriptor ring in the PRU memory */
+	spin_lock_irqsave(&bldev->desclock, flags);
+	for (i = 0; i < bldev->maxdesccount; i++) {
+		pru_buflist[i].dma_start_addr = 0;
+		pru_buflist[i].dma_end_addr = 0;
+		pru_buflist[i].flags = 0;
+		pru_buflist[i].dma_cur_addr = 0;
+		pru_buflist[i].tstart = 0;
+		pru_buflist[i].tend = 0;
+		pru_buflist[i].byteseq = 0;
 	}
-	pru_buflist[i].dma_start_addr = 0;
-	pru_buflist[i].dma_end_addr = 0;
+	bldev->desccount = min(bldev->bufcount, bldev->maxdesccount);
+	bldev->cxt_pru->listcount = bldev->desccount;
+	bldev->cxt_pru->stalls = 0;
+	bldev->cxt_pru->donecount = 0;
+	bldev->retiredcount = 0;
+
+	bldev->deschead = 0;
+	bldev->desctail = 0;
+	bldev->descposted = 0;
+	bldev->bufsposted = 0;
+	bldev->bufsfilled = 0;
+	bldev->bufsfree = bldev->bufcount;
+	bldev->filledseq = 0;
+	bldev->releasedseq = 0;
+	bldev->ring_consumer = 0;
+	bldev->streampos = 0;
+	bldev->lostbytes = 0;
+	bldev->bufnextpost = &bldev->buffers[0];
+	bldev->bufbeingread = &bldev->buffers[0];
+
+	/* Everyone reads the new capture from its start */
+	list_for_each_entry(reader, &bldev->readers, node)
+		beaglelogic_reader_reset(reader);
+
+	beaglelogic_post_buffers(bldev);
+	spin_unlock_irqrestore(&bldev->desclock, flags);
+	i = bldev->bufcount;
 
 	/* Update state to ready */
 	if (i)
@@ -342,7 +1010,8 @@ static int beaglelogic_map_and_submit_all_buffers(struct device *dev)
 fail:
 	/* Unmap the buffers */
 	for (j = 0; j < i; j++)
-		beaglelogic_unmap_buffer(dev, &bldev->buffers[j]);
+		beaglelogic_unmap_buffer(dev, &bldev->buffers[j],
+				bldev->buffers[j].size);
 
 	dev_err(dev, "DMA Mapping failed at i=%d\n", i);
 
@@ -353,7 +1022,8 @@ fail:
 /* End Buffer Management section */
 
 /* Begin Device Attributes Configuration Section
- * All set operations lock and unlock the device mutex */
+ * All set operations lock and unlock the device mutex, and are refused while
+ * a capture session runs */
 
 uint32_t beaglelogic_get_samplerate(struct device *dev)
 {
@@ -361,20 +1031,116 @@ uint32_t beaglelogic_get_samplerate(struct device *dev)
 	return bldev->samplerate;
 }
 
+/* Whether a sample rate needs a fractional sample period */
+static bool beaglelogic_fractional(struct beaglelogicdev *bldev,
+		uint32_t samplerate)
+{
+	return samplerate <= bldev->coreclockfreq / BL_FRAC_MIN_CYCLES &&
+		samplerate > bldev->coreclockfreq / BL_FRAC_MAX_CYCLES &&
+		(bldev->coreclockfreq / 2) % samplerate;
+}
+
+/* Sample period used with the current settings, in 1/65536 PRU cycles.
+ * Run length encoding, packing and windows only have integer divisors */
+static uint64_t beaglelogic_sampleperiod(struct beaglelogicdev *bldev)
+{
+	if (bldev->samplerate > bldev->coreclockfreq / 2)
+		return 1 << 16;
+
+	if (beaglelogic_fractional(bldev, bldev->samplerate) &&
+			bldev->sampleunit != BL_SAMPLEUNIT_RLE &&
+			!bldev->channelmask && !bldev->window.posttrigger)
+		return DIV_ROUND_CLOSEST_ULL((uint64_t)bldev->coreclockfreq
+				<< 16, bldev->samplerate);
+
+	return (uint64_t)((bldev->coreclockfreq / 2) / bldev->samplerate)
+			<< 17;
+}
+
+void beaglelogic_get_rate(struct device *dev, struct beaglelogic_rate *rate)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+
+	rate->clock = bldev->coreclockfreq;
+	rate->reserved = 0;
+	if (bldev->clock.edge) {
+		rate->period = rate->millihz = 0;
+		return;
+	}
+	rate->period = beaglelogic_sampleperiod(bldev);
+	rate->millihz = div64_u64(((uint64_t)bldev->coreclockfreq << 16) *
+			1000 + rate->period / 2, rate->period);
+}
+
+/* Change the sample rate of the running capture from the next buffer on,
+ * PRU0 hands the divisor to PRU1 at the buffer boundary. Only the divided
+ * sample loops can do that, so the rate is rounded to 100 / n MHz. PRU0
+ * looks for the boundary one block ahead, buffers need two blocks at least */
+static int beaglelogic_stage_samplerate(struct beaglelogicdev *bldev,
+		uint32_t samplerate)
+{
+	struct capture_context *cxt = bldev->cxt_pru;
+	uint32_t div = (bldev->coreclockfreq / 2) / samplerate;
+	unsigned long flags;
+	int ret = 0;
+
+	/* Keep beaglelogic_start() out: it resets what is staged here and
+	 * reads the settings. It only holds the mutex to set a capture up */
+	if (!mutex_trylock(&bldev->mutex))
+		return -EBUSY;
+
+	if (bldev->state != STATE_BL_RUNNING || bldev->windowmode ||
+			bldev->testmode || bldev->bufunitsize < 64 ||
+			div < 2 || cxt->samplediv < 2 ||
+			cxt->sampleunit > BL_SAMPLEUNIT_8_BITS ||
+			cxt->channelmask || cxt->sampleperiod || cxt->extclock) {
+		mutex_unlock(&bldev->mutex);
+		return -EBUSY;
+	}
+
+	spin_lock_irqsave(&bldev->desclock, flags);
+	if (bldev->ratepending || bldev->state != STATE_BL_RUNNING) {
+		/* The last change has not reached a retired buffer yet. PRU0
+		 * takes nextdiv one buffer ahead of that. Or the capture
+		 * ended in the meantime */
+		ret = -EBUSY;
+	} else {
+		bldev->stagedrate = (bldev->coreclockfreq / 2) / div;
+		bldev->samplerate = bldev->stagedrate;
+		bldev->ratepending = true;
+		WRITE_ONCE(cxt->nextdiv, div);
+
+		/* PRU0 overwrites ctx->samplediv and arms PRU1 with it after
+		 * the run: the cached configuration no longer holds */
+		memset(&bldev->pruconfig, 0, sizeof(bldev->pruconfig));
+	}
+	spin_unlock_irqrestore(&bldev->desclock, flags);
+	mutex_unlock(&bldev->mutex);
+
+	return ret;
+}
+
 int beaglelogic_set_samplerate(struct device *dev, uint32_t samplerate)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
-	if (samplerate > bldev->coreclockfreq / 2 || samplerate < 1)
+	if (samplerate > bldev->coreclockfreq || samplerate < 1)
 		return -EINVAL;
 
-	if (mutex_trylock(&bldev->mutex)) {
-		/* Get sample rate nearest to divisor */
-		bldev->samplerate = (bldev->coreclockfreq / 2) /
+	if (beaglelogic_trylock_idle(bldev)) {
+		/* Get sample rate nearest to divisor, one sample per PRU cycle
+		 * beyond the fastest divisor (burst mode). Rates in between
+		 * divisors are kept if a fractional period can make them */
+		if (samplerate > bldev->coreclockfreq / 2)
+			bldev->samplerate = bldev->coreclockfreq;
+		else if (beaglelogic_fractional(bldev, samplerate))
+			bldev->samplerate = samplerate;
+		else
+			bldev->samplerate = (bldev->coreclockfreq / 2) /
 				((bldev->coreclockfreq / 2)/ samplerate);
 		mutex_unlock(&bldev->mutex);
 		return 0;
 	}
-	return -EBUSY;
+	return beaglelogic_stage_samplerate(bldev, samplerate);
 }
 
 uint32_t beaglelogic_get_sampleunit(struct device *dev)
@@ -386,10 +1152,10 @@ uint32_t beaglelogic_get_sampleunit(struct device *dev)
 int beaglelogic_set_sampleunit(struct device *dev, uint32_t sampleunit)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
-	if (sampleunit > 2)
+	if (sampleunit > BL_SAMPLEUNIT_RLE)
 		return -EINVAL;
 
-	if (mutex_trylock(&bldev->mutex)) {
+	if (beaglelogic_trylock_idle(bldev)) {
 		bldev->sampleunit = sampleunit;
 		mutex_unlock(&bldev->mutex);
 
@@ -398,20 +1164,29 @@ int beaglelogic_set_sampleunit(struct device *dev, uint32_t sampleunit)
 	return -EBUSY;
 }
 
-uint32_t beaglelogic_get_triggerflags(struct device *dev)
+uint32_t beaglelogic_get_channelmask(struct device *dev)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
-	return bldev->triggerflags;
+	return bldev->channelmask;
 }
 
-int beaglelogic_set_triggerflags(struct device *dev, uint32_t triggerflags)
+/* Packed channels are a group of 1, 2, 4 or 8 neighbours, starting at a
+ * multiple of the group size (e.g. 0x0003, 0x00F0 or 0xFF00) */
+int beaglelogic_set_channelmask(struct device *dev, uint32_t channelmask)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
-	if (triggerflags > 1)
+	uint32_t width = hweight32(channelmask);
+
+	if (channelmask & ~BL_TRIGGER_CHANNELS)
 		return -EINVAL;
 
-	if (mutex_trylock(&bldev->mutex)) {
-		bldev->triggerflags = triggerflags;
+	if (channelmask && (!is_power_of_2(width) || width > 8 ||
+			__ffs(channelmask) % width ||
+			channelmask >> __ffs(channelmask) != (1 << width) - 1))
+		return -EINVAL;
+
+	if (beaglelogic_trylock_idle(bldev)) {
+		bldev->channelmask = channelmask;
 		mutex_unlock(&bldev->mutex);
 
 		return 0;
@@ -419,70 +1194,579 @@ int beaglelogic_set_triggerflags(struct device *dev, uint32_t triggerflags)
 	return -EBUSY;
 }
 
-/* End Device Attributes Configuration Section */
-
-/* Send command to the PRU firmware */
-static int beaglelogic_send_cmd(struct beaglelogicdev *bldev, uint32_t cmd)
+void beaglelogic_get_clock(struct device *dev, struct beaglelogic_clock *clock)
 {
-#define TIMEOUT     200
-	uint32_t timeout = TIMEOUT;
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	*clock = bldev->clock;
+}
 
-	bldev->cxt_pru->cmd = cmd;
+int beaglelogic_set_clock(struct device *dev, struct beaglelogic_clock *clock)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
 
-	/* Wait for firmware to process the command */
-	while (--timeout && bldev->cxt_pru->cmd != 0)
-		cpu_relax();
+	if (clock->edge > BL_CLOCK_FALLING || clock->channel > 31 ||
+			!(BL_TRIGGER_CHANNELS & (1 << clock->channel)))
+		return -EINVAL;
 
-	if (timeout == 0)
-		return -1;
+	if (beaglelogic_trylock_idle(bldev)) {
+		bldev->clock = *clock;
+		if (!clock->edge)
+			bldev->clock.channel = 0;
+		mutex_unlock(&bldev->mutex);
 
-	return bldev->cxt_pru->resp;
+		return 0;
+	}
+	return -EBUSY;
 }
 
-/* Request the PRU firmware to stop capturing */
-static void beaglelogic_request_stop(struct beaglelogicdev *bldev)
+void beaglelogic_get_sync(struct device *dev, struct beaglelogic_sync *sync)
 {
-	/* Trigger interrupt */
-	pruss_intc_trigger(bldev->to_bl_irq);
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	*sync = bldev->sync;
 }
 
-/* This is [to be] called from a threaded IRQ handler */
-irqreturn_t beaglelogic_serve_irq(int irqno, void *data)
+int beaglelogic_set_sync(struct device *dev, struct beaglelogic_sync *sync)
 {
-	struct beaglelogicdev *bldev = data;
-	struct device *dev = bldev->miscdev.this_device;
-	uint32_t state = bldev->state;
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
 
-	dev_dbg(dev, "Beaglelogic IRQ #%d\n", irqno);
-	if (irqno == bldev->from_bl_irq_1) {
-		/* Manage the buffers */
-		bldev->lastbufready = bldev->bufbeingread;
-		beaglelogic_unmap_buffer(dev, bldev->lastbufready);
+	if (sync->mode > BL_SYNC_SLAVE || sync->pin > 31 ||
+			!(BL_SYNC_PINS & (1 << sync->pin)))
+		return -EINVAL;
 
-		/* Avoid a false buffer overrun warning on the last run */
-		if (bldev->triggerflags != BL_TRIGGERFLAGS_ONESHOT ||
-			bldev->bufbeingread->next->index != 0) {
-			bldev->bufbeingread = bldev->bufbeingread->next;
-			beaglelogic_map_buffer(dev, bldev->bufbeingread);
-		}
-		wake_up_interruptible(&bldev->wait);
-	} else if (irqno == bldev->from_bl_irq_2) {
-		/* This interrupt occurs twice:
-		 *  1. After a successful configuration of PRU capture
-		 *  2. After the last buffer transferred  */
-		state = bldev->state;
-		if (state <= STATE_BL_ARMED) {
-			dev_dbg(dev, "config written, BeagleLogic ready\n");
+	if (beaglelogic_trylock_idle(bldev)) {
+		bldev->sync = *sync;
+		if (!sync->mode)
+			bldev->sync.pin = 0;
+		mutex_unlock(&bldev->mutex);
+
+		return 0;
+	}
+	return -EBUSY;
+}
+
+uint32_t beaglelogic_get_testmode(struct device *dev)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	return bldev->testmode;
+}
+
+int beaglelogic_set_testmode(struct device *dev, uint32_t testmode)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	if (testmode > 1)
+		return -EINVAL;
+
+	if (beaglelogic_trylock_idle(bldev)) {
+		bldev->testmode = testmode;
+		mutex_unlock(&bldev->mutex);
+
+		return 0;
+	}
+	return -EBUSY;
+}
+
+uint32_t beaglelogic_get_triggerflags(struct device *dev)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	return bldev->triggerflags;
+}
+
+int beaglelogic_set_triggerflags(struct device *dev, uint32_t triggerflags)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	if (triggerflags > 1)
+		return -EINVAL;
+
+	if (beaglelogic_trylock_idle(bldev)) {
+		bldev->triggerflags = triggerflags;
+		mutex_unlock(&bldev->mutex);
+
+		return 0;
+	}
+	return -EBUSY;
+}
+
+void beaglelogic_get_trigger(struct device *dev,
+                            struct beaglelogic_trigger *trigger)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	*trigger = bldev->trigger;
+}
+
+int beaglelogic_set_trigger(struct device *dev,
+                            struct beaglelogic_trigger *trigger)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+
+	/* A channel cannot rise and fall at the same time */
+	if (trigger->rising & trigger->falling)
+		return -EINVAL;
+
+	if ((trigger->mask | trigger->rising | trigger->falling) &
+			~BL_TRIGGER_CHANNELS)
+		return -EINVAL;
+
+	if (beaglelogic_trylock_idle(bldev)) {
+		bldev->trigger = *trigger;
+		bldev->trigger.value &= trigger->mask;
+		mutex_unlock(&bldev->mutex);
+
+		return 0;
+	}
+	return -EBUSY;
+}
+
+int beaglelogic_set_window(struct device *dev,
+                           struct beaglelogic_window *window)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+
+	if (beaglelogic_trylock_idle(bldev)) {
+		bldev->window = *window;
+		mutex_unlock(&bldev->mutex);
+
+		return 0;
+	}
+	return -EBUSY;
+}
+
+uint32_t beaglelogic_get_coalesce(struct device *dev)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	return bldev->coalesce;
+}
+
+int beaglelogic_set_coalesce(struct device *dev, uint32_t coalesce)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	if (coalesce < 1 || coalesce > bldev->maxdesccount)
+		return -EINVAL;
+
+	if (beaglelogic_trylock_idle(bldev)) {
+		bldev->coalesce = coalesce;
+		mutex_unlock(&bldev->mutex);
+
+		return 0;
+	}
+	return -EBUSY;
+}
+
+uint32_t beaglelogic_get_coalesce_usecs(struct device *dev)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	return bldev->coalesce_usecs;
+}
+
+int beaglelogic_set_coalesce_usecs(struct device *dev, uint32_t usecs)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	if (usecs > USEC_PER_SEC)
+		return -EINVAL;
+
+	if (beaglelogic_trylock_idle(bldev)) {
+		bldev->coalesce_usecs = usecs;
+		mutex_unlock(&bldev->mutex);
+
+		return 0;
+	}
+	return -EBUSY;
+}
+
+/* End Device Attributes Configuration Section */
+
+/* Send a command to the PRU firmware through the polled handshake. Every
+ * firmware version answers it, so it is only used for CMD_GET_VERSION */
+static int beaglelogic_poll_cmd(struct beaglelogicdev *bldev, uint32_t cmd)
+{
+#define TIMEOUT     200
+	uint32_t timeout = TIMEOUT;
+
+	bldev->cxt_pru->cmd = cmd;
+
+	/* Wait for firmware to process the command */
+	while (--timeout && bldev->cxt_pru->cmd != 0)
+		cpu_relax();
+
+	if (timeout == 0)
+		return -1;
+
+	return bldev->cxt_pru->resp;
+}
+
+/* Take back the commands the firmware did not run in time, so it cannot
+ * run them later on. The ones it still gets to become no-ops (0 is not a
+ * command) and cmdhead follows cmdtail until the firmware stops [mutex held] */
+static void beaglelogic_withdraw_cmds(struct beaglelogicdev *bldev)
+{
+	struct capture_context *cxt = bldev->cxt_pru;
+	uint32_t tail;
+	int i;
+
+	for (i = 0; i < BL_CMDQ_LEN; i++)
+		WRITE_ONCE(cxt->cmdq[i].cmd, 0);
+	wmb();
+
+	do {
+		tail = READ_ONCE(cxt->cmdtail);
+		WRITE_ONCE(cxt->cmdhead, tail);
+		mb();
+	} while (READ_ONCE(cxt->cmdtail) != tail);
+
+	dev_warn(bldev->miscdev.this_device,
+			"PRU command timed out, withdrawn\n");
+}
+
+/* Queue commands to the PRU firmware and sleep until all of them are done,
+ * the firmware signals the batch with the from_bl_2 interrupt. Responses go
+ * to resp [mutex held, or from probe] */
+static int beaglelogic_queue_cmds(struct beaglelogicdev *bldev,
+		const uint32_t *cmds, int *resp, int count)
+{
+	struct capture_context *cxt = bldev->cxt_pru;
+	uint32_t head = READ_ONCE(cxt->cmdhead);
+	int i;
+
+	if (count > BL_CMDQ_LEN)
+		return -EINVAL;
+
+	/* A batch that timed out earlier is still pending */
+	if (READ_ONCE(cxt->cmdtail) != head)
+		return -EBUSY;
+
+	for (i = 0; i < count; i++)
+		cxt->cmdq[(head + i) % BL_CMDQ_LEN].cmd = cmds[i];
+	wmb();
+	WRITE_ONCE(cxt->cmdhead, head + count);
+
+	if (!wait_event_timeout(bldev->cmdwait,
+			READ_ONCE(cxt->cmdtail) == head + count,
+			msecs_to_jiffies(BL_CMD_TIMEOUT_MS))) {
+		beaglelogic_withdraw_cmds(bldev);
+		return -ETIMEDOUT;
+	}
+	rmb();
+
+	for (i = 0; i < count; i++)
+		resp[i] = cxt->cmdq[(head + i) % BL_CMDQ_LEN].resp;
+
+	return 0;
+}
+
+/* Send a command to the PRU firmware, returns its response or -1 */
+static int beaglelogic_send_cmd(struct beaglelogicdev *bldev, uint32_t cmd)
+{
+	int resp;
+
+	if (beaglelogic_queue_cmds(bldev, &cmd, &resp, 1))
+		return -1;
+
+	return resp;
+}
+
+/* Request the PRU firmware to stop capturing */
+static void beaglelogic_request_stop(struct beaglelogicdev *bldev)
+{
+	/* Trigger interrupt */
+	pruss_intc_trigger(bldev->to_bl_irq);
+}
+
+/* Locate the trigger window once a window capture is over, and hand all
+ * buffers back to the CPU: the window may span buffers still posted to the
+ * PRU [called from the ISR] */
+static void beaglelogic_window_complete(struct beaglelogicdev *bldev)
+{
+	struct device *dev = bldev->miscdev.this_device;
+	struct beaglelogic_triggerinfo *info = &bldev->triginfo;
+	uint32_t trigpos = bldev->cxt_pru->trigpos;
+	struct logic_buffer *buf, *first, *next;
+	uint32_t pos, covered;
+	int i;
+
+	spin_lock(&bldev->desclock);
+	for (i = 0; i < bldev->bufcount; i++)
+		beaglelogic_unmap_buffer(dev, &bldev->buffers[i],
+				bldev->buffers[i].size);
+	spin_unlock(&bldev->desclock);
+
+	if (trigpos == 0xFFFFFFFF) {
+		dev_info(dev, "capture stopped before the trigger\n");
+		return;
+	}
+
+	/* Stopped by the user, the window end is missing */
+	if (bldev->state == STATE_BL_REQUEST_STOP) {
+		dev_info(dev, "capture stopped before the window end\n");
+		return;
+	}
+
+	info->trigpos = trigpos;
+	info->start = trigpos > bldev->winpre ? trigpos - bldev->winpre : 0;
+	info->size = trigpos + bldev->winpost - info->start;
+
+	/* A PRU stall shifts the stream against the buffers, find the window
+	 * start in the stream offsets of the buffers written back */
+	for (i = 0; i < bldev->bufcount; i++) {
+		buf = &bldev->buffers[i];
+		if (buf->info.size && (uint32_t)(info->start -
+				(uint32_t)buf->info.offset) < buf->info.size)
+			break;
+	}
+	if (i == bldev->bufcount) {
+		dev_info(dev, "trigger window overwritten or lost\n");
+		return;
+	}
+	first = buf;
+	pos = info->start - (uint32_t)buf->info.offset;
+
+	/* The rest has to follow in the next buffers, without a gap */
+	covered = buf->info.size - pos;
+	while (covered < info->size) {
+		next = buf->next;
+		if (next == first || !next->info.size ||
+				buf->info.size != bldev->bufunitsize ||
+				next->info.offset !=
+					buf->info.offset + buf->info.size) {
+			dev_info(dev, "trigger window lost to a PRU stall\n");
+			return;
+		}
+		covered += next->info.size;
+		buf = next;
+	}
+
+	info->offset = first->index * bldev->bufunitsize + pos;
+	info->triggered = 1;
+
+	dev_info(dev, "triggered at byte %u, window of %u bytes\n",
+			info->trigpos, info->size);
+}
+
+/* Validate the sample unit against the sample rate (assume mutex is held) */
+static int beaglelogic_check_sampleunit(struct beaglelogicdev *bldev)
+{
+	struct device *dev = bldev->miscdev.this_device;
+
+	/* The test pattern takes the place of plain 8 or 16-bit samples.
+	 * Window captures check the trigger on its 16-bit halves */
+	if (bldev->testmode && (bldev->sampleunit == BL_SAMPLEUNIT_RLE ||
+			bldev->channelmask || bldev->clock.edge ||
+			(bldev->window.posttrigger &&
+			 bldev->sampleunit != BL_SAMPLEUNIT_16_BITS))) {
+		dev_err(dev, "the test pattern needs plain 8 or 16-bit "\
+				"samples, 16-bit for window captures\n");
+		return -EINVAL;
+	}
+
+	/* The sample rate does not matter with an external clock */
+	if (bldev->clock.edge) {
+		if (bldev->sampleunit == BL_SAMPLEUNIT_RLE ||
+				bldev->channelmask || bldev->window.posttrigger) {
+			dev_err(dev, "an external clock needs plain 8 or 16-bit "\
+					"samples\n");
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	if (bldev->samplerate > bldev->coreclockfreq / 2 &&
+			(bldev->sampleunit != BL_SAMPLEUNIT_8_BITS ||
+			 bldev->channelmask || bldev->window.posttrigger)) {
+		dev_err(dev, "sample rates above %d Hz need plain 8-bit "\
+				"samples\n", bldev->coreclockfreq / 2);
+		return -EINVAL;
+	}
+
+	if (bldev->sampleunit == BL_SAMPLEUNIT_RLE &&
+			(bldev->coreclockfreq / 2) / bldev->samplerate <
+			BL_RLE_MIN_SAMPLEDIV) {
+		dev_err(dev, "run length encoding needs a sample rate "\
+				"<= %d Hz\n",
+				(bldev->coreclockfreq / 2) /
+				BL_RLE_MIN_SAMPLEDIV);
+		return -EINVAL;
+	}
+
+	if (bldev->channelmask) {
+		if (bldev->sampleunit == BL_SAMPLEUNIT_RLE ||
+				bldev->window.posttrigger) {
+			dev_err(dev, "packed channels cannot be run length "\
+					"encoded or windowed\n");
+			return -EINVAL;
+		}
+
+		if ((bldev->coreclockfreq / 2) / bldev->samplerate <
+				BL_PACK_MIN_SAMPLEDIV) {
+			dev_err(dev, "packed channels need a sample rate "\
+					"<= %d Hz\n",
+					(bldev->coreclockfreq / 2) /
+					BL_PACK_MIN_SAMPLEDIV);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* Validate the trigger window configuration (assume mutex is held) */
+static int beaglelogic_setup_window(struct beaglelogicdev *bldev)
+{
+	struct device *dev = bldev->miscdev.this_device;
+	uint32_t width, channels;
+	uint64_t bytes;
+
+	memset(&bldev->triginfo, 0, sizeof(bldev->triginfo));
+	bldev->windowmode = false;
+	if (!bldev->window.posttrigger)
+		return 0;
+
+	width = bldev->sampleunit == BL_SAMPLEUNIT_8_BITS ? 1 : 2;
+	bytes = ((uint64_t)bldev->window.pretrigger +
+			bldev->window.posttrigger) * width;
+	channels = bldev->trigger.mask | bldev->trigger.rising |
+			bldev->trigger.falling;
+
+	if ((bldev->coreclockfreq / 2) / bldev->samplerate <
+			BL_WINDOW_MIN_SAMPLEDIV) {
+		dev_err(dev, "window captures need a sample rate <= %d Hz\n",
+				(bldev->coreclockfreq / 2) /
+				BL_WINDOW_MIN_SAMPLEDIV);
+		return -EINVAL;
+	}
+
+	if (!channels) {
+		dev_err(dev, "window captures need a trigger\n");
+		return -EINVAL;
+	}
+
+	if (bldev->sampleunit == BL_SAMPLEUNIT_RLE) {
+		dev_err(dev, "window captures cannot be run length encoded\n");
+		return -EINVAL;
+	}
+
+	if (width == 1 && (channels & ~0xFF)) {
+		dev_err(dev, "trigger on channels not being sampled\n");
+		return -EINVAL;
+	}
+
+	/* The buffer being filled last is partly stale */
+	if (bytes > (uint64_t)(bldev->bufcount - 1) * bldev->bufunitsize) {
+		dev_err(dev, "trigger window larger than the buffers\n");
+		return -EINVAL;
+	}
+
+	bldev->winpre = bldev->window.pretrigger * width;
+	bldev->winpost = bldev->window.posttrigger * width;
+	bldev->windowmode = true;
+
+	return 0;
+}
+
+/* Poll for the buffers completed since the last interrupt [hrtimer] */
+static enum hrtimer_restart beaglelogic_poll_timer(struct hrtimer *timer)
+{
+	struct beaglelogicdev *bldev = container_of(timer,
+			struct beaglelogicdev, polltimer);
+
+	if (READ_ONCE(bldev->cxt_pru->donecount) != bldev->retiredcount)
+		irq_wake_thread(bldev->from_bl_irq_1, bldev);
+
+	hrtimer_forward_now(timer, ns_to_ktime((u64)bldev->coalesce_usecs *
+			NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+/* Account for a run of the IRQ handler that began at 'start' */
+static void beaglelogic_account_irq(struct beaglelogicdev *bldev, u64 start)
+{
+	u64 time = ktime_get_ns() - start;
+
+	bldev->stats.irqs++;
+	bldev->stats.irqtime += time;
+	bldev->stats.irqmax = max(bldev->stats.irqmax, time);
+}
+
+/* Readers are about to be woken up for the last buffer completed */
+static void beaglelogic_trace_wakeup(struct beaglelogicdev *bldev)
+{
+	if (bldev->lastbufready)
+		trace_beaglelogic_wakeup(bldev->lastbufready->index,
+				bldev->filledseq - 1, bldev->starttime,
+				bldev->coreclockfreq);
+}
+
+/* This is called from a threaded IRQ handler, or woken up by the poll
+ * timer. Every buffer completed so far is retired in one pass */
+irqreturn_t beaglelogic_serve_irq(int irqno, void *data)
+{
+	struct beaglelogicdev *bldev = data;
+	struct device *dev = bldev->miscdev.this_device;
+	uint32_t state = bldev->state, retired;
+	u64 start = ktime_get_ns();
+
+	dev_dbg(dev, "Beaglelogic IRQ #%d\n", irqno);
+	if (irqno == bldev->from_bl_irq_1) {
+		/* Reading the PRU RAM is slow, only when tracing */
+		retired = bldev->retiredcount;
+		if (trace_beaglelogic_irq_entry_enabled() &&
+				bldev->bufbeingread)
+			trace_beaglelogic_irq_entry(irqno,
+					bldev->bufbeingread->index,
+					READ_ONCE(bldev->cxt_pru->donecount),
+					bldev->starttime,
+					bldev->coreclockfreq);
+
+		/* Manage the buffers */
+		beaglelogic_retire_buffers(bldev);
+		beaglelogic_trace_wakeup(bldev);
+		wake_up_interruptible(&bldev->wait);
+		beaglelogic_account_irq(bldev, start);
+
+		trace_beaglelogic_irq_exit(irqno, bldev->lastbufready ?
+				bldev->lastbufready->index : 0,
+				bldev->retiredcount - retired,
+				bldev->starttime, bldev->coreclockfreq);
+	} else if (irqno == bldev->from_bl_irq_2) {
+		/* Queued commands done, if that is what it was */
+		wake_up(&bldev->cmdwait);
+
+		/* It also signals:
+		 *  1. After a successful configuration of PRU capture
+		 *  2. After the last buffer transferred  */
+		state = bldev->state;
+		if (state <= STATE_BL_ARMED ||
+				READ_ONCE(bldev->cxt_pru->runs) == bldev->pruruns) {
+			dev_dbg(dev, "config written, BeagleLogic ready\n");
 			return IRQ_HANDLED;
 		}
-		else if (state != STATE_BL_REQUEST_STOP &&
+
+		/* Buffers completed since the last interrupt */
+		hrtimer_cancel(&bldev->polltimer);
+		beaglelogic_retire_buffers(bldev);
+
+		if (state != STATE_BL_REQUEST_STOP &&
 				state != STATE_BL_RUNNING) {
 			dev_err(dev, "Unexpected stop request \n");
+			spin_lock(&bldev->desclock);
 			bldev->state = STATE_BL_ERROR;
+			if (bldev->ring)
+				bldev->ring->state = STATE_BL_ERROR;
+			spin_unlock(&bldev->desclock);
+			wake_up_interruptible(&bldev->wait);
+			sysfs_notify(&dev->kobj, NULL, "state");
 			return IRQ_HANDLED;
 		}
+		if (bldev->windowmode)
+			beaglelogic_window_complete(bldev);
+
+		/* The session is over */
+		spin_lock(&bldev->desclock);
 		bldev->state = STATE_BL_INITIALIZED;
+		if (bldev->ring)
+			bldev->ring->state = STATE_BL_INITIALIZED;
+		spin_unlock(&bldev->desclock);
+		beaglelogic_trace_wakeup(bldev);
 		wake_up_interruptible(&bldev->wait);
+		sysfs_notify(&dev->kobj, NULL, "state");
+		beaglelogic_account_irq(bldev, start);
 	}
 
 	return IRQ_HANDLED;
@@ -492,65 +1776,240 @@ irqreturn_t beaglelogic_serve_irq(int irqno, void *data)
 int beaglelogic_write_configuration(struct device *dev)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
-	int ret;
+	struct capture_context *cxt = bldev->cxt_pru;
+	struct beaglelogic_pruconfig cfg;
+	uint32_t cmd = CMD_SET_CONFIG;
+	uint64_t period;
+	uint32_t edges;
+	int ret, resp;
+
+	/* Work out the settings */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.samplediv = (bldev->coreclockfreq / 2) / bldev->samplerate;
+	cfg.sampleunit = bldev->sampleunit;
+	if (bldev->samplerate > bldev->coreclockfreq / 2) {
+		cfg.samplediv = 1;
+		cfg.sampleunit = BL_PRU_SAMPLEUNIT_BURST;
+	}
+	cfg.channelmask = bldev->channelmask;
+	/* Odd or fractional periods need the fractional loop */
+	period = beaglelogic_sampleperiod(bldev);
+	if (bldev->samplerate <= bldev->coreclockfreq / 2 && (period & 0x1FFFF))
+		cfg.sampleperiod = period;
+
+	/* An external clock replaces the sample rate */
+	if (bldev->clock.edge) {
+		cfg.samplediv = 1;
+		cfg.sampleunit = bldev->sampleunit;
+		cfg.sampleperiod = 0;
+		cfg.extclock = bldev->clock.channel | (bldev->clock.edge << 8);
+	}
+
+	/* The test pattern comes at the byte rate of the settings */
+	if (bldev->testmode) {
+		cfg.samplediv = 2;
+		if (bldev->samplerate <= bldev->coreclockfreq / 2)
+			cfg.samplediv = ((bldev->coreclockfreq / 2) /
+				bldev->samplerate) * (bldev->sampleunit ==
+				BL_SAMPLEUNIT_8_BITS ? 4 : 2);
+		cfg.sampleunit = BL_PRU_SAMPLEUNIT_TEST;
+		cfg.sampleperiod = 0;
+	}
+
+	/* The PRU waits for the edge channels to be in their initial state,
+	 * then for the pattern with the edge channels in their final state.
+	 * For a pure pattern trigger the first stage always matches */
+	edges = bldev->trigger.rising | bldev->trigger.falling;
+	cfg.trigqmask = edges;
+	cfg.trigqval = bldev->trigger.falling;
+	cfg.trigfmask = bldev->trigger.mask | edges;
+	cfg.trigfval = (bldev->trigger.value & ~edges) | bldev->trigger.rising;
+
+	cfg.posttrigger = bldev->windowmode ? bldev->winpost : 0;
+
+	/* PRU0 reads these as the capture starts */
+	cxt->triggerflags = bldev->triggerflags;
+	cxt->syncstart = bldev->sync.mode ?
+			bldev->sync.pin | (bldev->sync.mode << 8) : 0;
+	cxt->trigpos = 0xFFFFFFFF;
+	cxt->coalesce = bldev->coalesce;
+	cxt->nextdiv = 0;
+
+	/* The firmware arms PRU1 again after every capture, skip the
+	 * handshake if it still has the same settings */
+	if (READ_ONCE(cxt->armed) &&
+			!memcmp(&cfg, &bldev->pruconfig, sizeof(cfg))) {
+		dev_dbg(dev, "PRU already armed with this configuration\n");
+		return 0;
+	}
 
 	/* Hand over the settings */
-	bldev->cxt_pru->samplediv =
-		(bldev->coreclockfreq / 2) / bldev->samplerate;
-	bldev->cxt_pru->sampleunit = bldev->sampleunit;
-	bldev->cxt_pru->triggerflags = bldev->triggerflags;
-	ret = beaglelogic_send_cmd(bldev, CMD_SET_CONFIG);
+	cxt->samplediv = cfg.samplediv;
+	cxt->sampleunit = cfg.sampleunit;
+	cxt->trigqmask = cfg.trigqmask;
+	cxt->trigqval = cfg.trigqval;
+	cxt->trigfmask = cfg.trigfmask;
+	cxt->trigfval = cfg.trigfval;
+	cxt->posttrigger = cfg.posttrigger;
+	cxt->channelmask = cfg.channelmask;
+	cxt->sampleperiod = cfg.sampleperiod;
+	cxt->extclock = cfg.extclock;
+
+	ret = beaglelogic_queue_cmds(bldev, &cmd, &resp, 1);
+	if (ret == 0 && resp != 0)
+		ret = -EIO;
+	if (ret == 0)
+		bldev->pruconfig = cfg;
 
 	dev_dbg(dev, "PRU Config written, err code = %d\n", ret);
-	return 0;
+	return ret;
 }
 
-/* Begin the sampling operation [This takes the mutex] */
+/* Begin the sampling operation [This takes the mutex]
+ *
+ * The mutex is only held while the capture is set up, the session then runs
+ * until the PRU signals its end (STATE_BL_RUNNING / STATE_BL_REQUEST_STOP).
+ * Returns -EBUSY if a session is already running */
 int beaglelogic_start(struct device *dev)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	unsigned long flags;
+	int i, ret;
+
+	if (mutex_lock_interruptible(&bldev->mutex))
+		return -ERESTARTSYS;
 
-	/* This mutex will be locked for the entire duration BeagleLogic runs */
-	mutex_lock(&bldev->mutex);
-	if (beaglelogic_write_configuration(dev)) {
+	if (beaglelogic_session_active(bldev)) {
 		mutex_unlock(&bldev->mutex);
-		return -1;
+		return -EBUSY;
 	}
-	bldev->bufbeingread = &bldev->buffers[0];
-	beaglelogic_send_cmd(bldev, CMD_START);
+
+	if (beaglelogic_check_sampleunit(bldev) ||
+			beaglelogic_setup_window(bldev)) {
+		mutex_unlock(&bldev->mutex);
+		return -EINVAL;
+	}
+
+	/* The PRU did not take the settings */
+	ret = beaglelogic_write_configuration(dev);
+	if (ret) {
+		mutex_unlock(&bldev->mutex);
+		return ret;
+	}
+
+	if (beaglelogic_map_and_submit_all_buffers(dev)) {
+		mutex_unlock(&bldev->mutex);
+		return -EINVAL;
+	}
+	beaglelogic_ring_reset(bldev);
+	bldev->caprate = bldev->clock.edge ? 0 : bldev->samplerate;
+	bldev->stagedrate = 0;
+	bldev->ratepending = false;
+	bldev->pruruns = READ_ONCE(bldev->cxt_pru->runs);
+	if (beaglelogic_send_cmd(bldev, CMD_START)) {
+		/* The PRU never started, hand the buffers back */
+		for (i = 0; i < bldev->bufcount; i++)
+			beaglelogic_unmap_buffer(dev, &bldev->buffers[i],
+					bldev->buffers[i].size);
+		spin_lock_irqsave(&bldev->desclock, flags);
+		bldev->state = STATE_BL_ERROR;
+		if (bldev->ring)
+			bldev->ring->state = STATE_BL_ERROR;
+		spin_unlock_irqrestore(&bldev->desclock, flags);
+		wake_up_interruptible(&bldev->wait);
+		mutex_unlock(&bldev->mutex);
+		dev_err(dev, "PRU did not take the start command\n");
+		return -EIO;
+	}
+	bldev->starttime = ktime_get_ns();
+	bldev->syncwait = bldev->sync.mode == BL_SYNC_SLAVE;
+
+	/* Pick up the buffers that do not end a batch of interrupts */
+	if (bldev->coalesce > 1 && bldev->coalesce_usecs)
+		hrtimer_start(&bldev->polltimer,
+				ns_to_ktime((u64)bldev->coalesce_usecs *
+					NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
 
 	/* All set now. Start the PRUs and wait for IRQs */
+	spin_lock_irqsave(&bldev->desclock, flags);
 	bldev->state = STATE_BL_RUNNING;
+	if (bldev->ring)
+		bldev->ring->state = STATE_BL_RUNNING;
+	spin_unlock_irqrestore(&bldev->desclock, flags);
 	bldev->lasterror = 0;
+	sysfs_notify(&dev->kobj, NULL, "state");
 
 	dev_info(dev, "capture started with sample rate=%d Hz, sampleunit=%d, "\
 			"triggerflags=%d",
 			bldev->samplerate,
 			bldev->sampleunit,
 			bldev->triggerflags);
+	if (bldev->testmode)
+		dev_info(dev, "sending the PRU test pattern\n");
+	if (bldev->sync.mode == BL_SYNC_SLAVE)
+		dev_info(dev, "waiting for the sync line on pin %d\n",
+				bldev->sync.pin);
+	else if (bldev->sync.mode == BL_SYNC_MASTER)
+		dev_info(dev, "driving the sync line on pin %d\n",
+				bldev->sync.pin);
+	if (bldev->clock.edge)
+		dev_info(dev, "sampling on %s edges of channel %d\n",
+				bldev->clock.edge == BL_CLOCK_RISING ?
+					"rising" : "falling",
+				bldev->clock.channel);
+	else if (bldev->samplerate > bldev->coreclockfreq / 2)
+		dev_info(dev, "bursts of %d samples every %d cycles\n",
+				BL_BURST_SAMPLES, BL_BURST_CYCLES);
+	if (bldev->cxt_pru->sampleperiod)
+		dev_info(dev, "fractional sample period of %u + %u/65536 "\
+				"cycles\n", bldev->cxt_pru->sampleperiod >> 16,
+				bldev->cxt_pru->sampleperiod & 0xFFFF);
+	if (bldev->channelmask)
+		dev_info(dev, "packing channels %04x\n", bldev->channelmask);
+	if (bldev->cxt_pru->trigfmask)
+		dev_info(dev, "waiting for trigger mask=%04x value=%04x "\
+				"rising=%04x falling=%04x\n",
+				bldev->trigger.mask, bldev->trigger.value,
+				bldev->trigger.rising, bldev->trigger.falling);
+	if (bldev->windowmode)
+		dev_info(dev, "trigger window of %d + %d samples\n",
+				bldev->window.pretrigger,
+				bldev->window.posttrigger);
+
+	mutex_unlock(&bldev->mutex);
 	return 0;
 }
 
-/* Request stop. Stop will effect only after the last buffer is written out */
+/* Request stop. Stop will effect only after the last buffer is written out
+ *
+ * Any task may stop the session, the interrupt handler ends it once the PRU
+ * is done. So it does even if the wait here is interrupted */
 void beaglelogic_stop(struct device *dev)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	unsigned long flags;
+	uint32_t state;
 
-	if (mutex_is_locked(&bldev->mutex)) {
-		if (bldev->state == STATE_BL_RUNNING)
-		{
-			beaglelogic_request_stop(bldev);
-			bldev->state = STATE_BL_REQUEST_STOP;
+	spin_lock_irqsave(&bldev->desclock, flags);
+	state = bldev->state;
+	if (state == STATE_BL_RUNNING)
+		bldev->state = STATE_BL_REQUEST_STOP;
+	spin_unlock_irqrestore(&bldev->desclock, flags);
 
-			/* Wait for the PRU to signal completion */
-			wait_event_interruptible(bldev->wait,
-					bldev->state == STATE_BL_INITIALIZED);
-		}
-		/* Release */
-		mutex_unlock(&bldev->mutex);
+	if (state != STATE_BL_RUNNING && state != STATE_BL_REQUEST_STOP)
+		return;
 
-		dev_info(dev, "capture session ended\n");
-	}
+	/* Only the first one to stop it signals the PRU */
+	if (state == STATE_BL_RUNNING)
+		beaglelogic_request_stop(bldev);
+
+	/* Wait for the PRU to signal completion */
+	if (wait_event_interruptible(bldev->wait,
+			bldev->state != STATE_BL_REQUEST_STOP))
+		return;
+
+	dev_info(dev, "capture session ended\n");
 }
 
 /* fops */
@@ -559,91 +2018,305 @@ static int beaglelogic_f_open(struct inode *inode, struct file *filp)
 	struct logic_buffer_reader *reader;
 	struct beaglelogicdev *bldev = to_beaglelogicdev(filp->private_data);
 	struct device *dev = bldev->miscdev.this_device;
+	unsigned long flags;
 
-	if (bldev->bufcount == 0)
+	/* Nothing to read without buffers, check before taking a user */
+	if (bldev->bufcount == 0 || !bldev->buffers)
 		return -ENOMEM;
 
 	reader = devm_kzalloc(dev, sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
 	reader->bldev = bldev;
 	reader->buf = NULL;
 	reader->pos = 0;
 	reader->remaining = 0;
+	INIT_LIST_HEAD(&reader->node);
 
 	filp->private_data = reader;
 
-	/* The buffers will be mapped/resubmitted at the time of allocation
-	 * Here, we just map the first buffer */
-	if (!bldev->buffers)
-		return -ENOMEM;
-
-	beaglelogic_map_buffer(dev, &bldev->buffers[0]);
+	/* The buffers are mapped and posted to the PRU as a capture starts,
+	 * they may belong to a running one: leave them alone here */
+	spin_lock_irqsave(&bldev->desclock, flags);
+	bldev->users++;
+	spin_unlock_irqrestore(&bldev->desclock, flags);
 
 	return 0;
 }
 
-/* Read the sample (ring) buffer. */
-ssize_t beaglelogic_f_read (struct file *filp, char __user *buf,
-                          size_t sz, loff_t *offset)
+/* Start consuming buffers through read(). A reader joining a running
+ * capture starts with the oldest buffer the other readers still hold */
+static void beaglelogic_reader_join(struct logic_buffer_reader *reader)
+{
+	struct beaglelogicdev *bldev = reader->bldev;
+	struct logic_buffer *buf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bldev->desclock, flags);
+	if (!reader->reading) {
+		reader->reading = true;
+		list_add_tail(&reader->node, &bldev->readers);
+	}
+
+	buf = &bldev->buffers[bldev->releasedseq % bldev->bufcount];
+	reader->seq = bldev->releasedseq;
+	reader->buf = buf;
+	reader->pos = 0;
+	reader->remaining = buf->size;
+	reader->offset = reader->seq == bldev->filledseq ? bldev->streampos :
+			buf->info.offset - buf->info.lost;
+	spin_unlock_irqrestore(&bldev->desclock, flags);
+}
+
+/* The buffer being read is consumed, move on to the next one */
+static void beaglelogic_reader_advance(struct logic_buffer_reader *reader)
+{
+	struct beaglelogicdev *bldev = reader->bldev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bldev->desclock, flags);
+	trace_beaglelogic_dequeue(reader->buf->index, reader->seq,
+			bldev->starttime, bldev->coreclockfreq);
+	reader->seq++;
+	reader->buf = reader->buf->next;
+	reader->pos = 0;
+	reader->remaining = reader->buf->size;
+	beaglelogic_release_buffers(bldev);
+	spin_unlock_irqrestore(&bldev->desclock, flags);
+}
+
+/* Data is available to the reader, or there will not be any more */
+static bool beaglelogic_reader_ready(struct logic_buffer_reader *reader)
+{
+	struct beaglelogicdev *bldev = reader->bldev;
+
+	return reader->seq != bldev->filledseq ||
+			(bldev->state != STATE_BL_RUNNING &&
+			 bldev->state != STATE_BL_REQUEST_STOP);
+}
+
+/* The reader is moving on to its next buffer. The stream offsets tell
+ * exactly how much data was overwritten before it could be read, not
+ * counting the bytes the PRU had to drop (already reported) */
+static void beaglelogic_reader_next_buffer(struct logic_buffer_reader *reader)
 {
-	int count;
-	struct logic_buffer_reader *reader = filp->private_data;
 	struct beaglelogicdev *bldev = reader->bldev;
 	struct device *dev = bldev->miscdev.this_device;
+	struct beaglelogic_bufinfo *info = &reader->buf->info;
 
-	if (bldev->state == STATE_BL_ERROR)
-		return -EIO;
+	if (info->offset > reader->offset)
+		reader->lost += info->offset - reader->offset;
 
-	if (reader->pos > 0)
-		goto perform_copy;
+	if (info->offset - info->lost > reader->offset) {
+		dev_warn_ratelimited(dev, "%llu bytes overwritten before " \
+				"buffer %d was read\n",
+				info->offset - info->lost - reader->offset,
+				reader->buf->index);
+		bldev->lasterror = 0x10000 | reader->buf->index;
+		bldev->stats.overwritten++;
+	}
+	reader->offset = info->offset + info->size;
+}
 
-	if (reader->buf == NULL) {
-		/* First time init */
-		reader->buf = &reader->bldev->buffers[0];
-		reader->remaining = reader->buf->size;
+/* Read the trigger window, once the capture is over */
+static ssize_t beaglelogic_read_window(struct file *filp, char __user *buf,
+                                       size_t sz)
+{
+	struct logic_buffer_reader *reader = filp->private_data;
+	struct beaglelogicdev *bldev = reader->bldev;
+	struct beaglelogic_triggerinfo *info = &bldev->triginfo;
+	struct logic_buffer *lbuf;
+	uint32_t pos, count;
 
-		if (bldev->state != STATE_BL_RUNNING) {
-			/* Start the capture */
-			if (beaglelogic_start(dev))
-				return -ENOEXEC;
-		}
+	if (filp->f_flags & O_NONBLOCK) {
+		if (bldev->state != STATE_BL_INITIALIZED)
+			return -EAGAIN;
 	} else {
-		/* EOF Condition, back to buffer 0 and stopped */
-		if (reader->buf == bldev->buffers &&
-				bldev->state == STATE_BL_INITIALIZED)
-			return 0;
+		if (wait_event_interruptible(bldev->wait,
+				bldev->state == STATE_BL_INITIALIZED))
+			return -ERESTARTSYS;
 	}
 
-	if (filp->f_flags & O_NONBLOCK) {
-		if (reader->buf->state != STATE_BL_BUF_UNMAPPED)
+	/* EOF Condition, window read or no trigger */
+	if (!info->triggered || reader->winpos >= info->size)
+		return 0;
+
+	pos = info->offset + reader->winpos;
+	lbuf = &bldev->buffers[(pos / bldev->bufunitsize) % bldev->bufcount];
+	pos %= bldev->bufunitsize;
+
+	count = min(info->size - reader->winpos, bldev->bufunitsize - pos);
+	count = min_t(size_t, count, sz);
+
+	if (copy_to_user(buf, lbuf->buf + pos, count))
+		return -EFAULT;
+
+	reader->winpos += count;
+
+	return count;
+}
+
+/* First read by this reader: join the capture, starting it if needed */
+static int beaglelogic_reader_begin(struct logic_buffer_reader *reader)
+{
+	struct beaglelogicdev *bldev = reader->bldev;
+	struct device *dev = bldev->miscdev.this_device;
+	int ret;
+
+	if (reader->buf != NULL)
+		return 0;
+
+	/* Buffers are now only reposted once we (and the other readers)
+	 * are done with them */
+	beaglelogic_reader_join(reader);
+	reader->winpos = 0;
+	reader->lost = 0;
+
+	/* Start the capture, unless another reader did */
+	if (!beaglelogic_session_active(bldev)) {
+		ret = beaglelogic_start(dev);
+		if (ret == -ERESTARTSYS)
+			return ret;
+		if (ret && ret != -EBUSY)
+			return -ENOEXEC;
+	}
+
+	return 0;
+}
+
+/* A reader was woken up for 'buf', how long after it was complete? */
+static void beaglelogic_account_latency(struct beaglelogicdev *bldev,
+                                        struct logic_buffer *buf)
+{
+	u64 now = beaglelogic_pru_now(bldev);
+	uint32_t usecs = 0;
+
+	if (now > buf->info.tend)
+		usecs = min_t(u64, div_u64(now - buf->info.tend,
+				bldev->coreclockfreq / 1000000), U32_MAX);
+
+	bldev->stats.latency[min(fls(usecs), BL_LATENCY_BUCKETS - 1)]++;
+}
+
+/* Wait for the next buffer of the reader. Returns 1 once there is data at
+ * reader->buf + reader->pos, 0 at the end of the capture */
+static int beaglelogic_reader_wait(struct logic_buffer_reader *reader,
+                                   bool nonblock)
+{
+	struct beaglelogicdev *bldev = reader->bldev;
+	bool slept = false;
+
+	if (reader->pos > 0)
+		return 1;
+
+	if (nonblock) {
+		if (!beaglelogic_reader_ready(reader))
 			return -EAGAIN;
 	} else {
+		slept = !beaglelogic_reader_ready(reader);
 		if (wait_event_interruptible(bldev->wait,
-				reader->buf->state == STATE_BL_BUF_UNMAPPED))
+				beaglelogic_reader_ready(reader)))
 			return -ERESTARTSYS;
 	}
-perform_copy:
+
+	/* EOF Condition, stopped and everything read */
+	if (reader->seq == bldev->filledseq)
+		return 0;
+
+	/* Read the buffer after its sequence number */
+	smp_rmb();
+	beaglelogic_reader_next_buffer(reader);
+	if (slept)
+		beaglelogic_account_latency(bldev, reader->buf);
+
+	return 1;
+}
+
+/* 'count' bytes of the current buffer have been handed out */
+static void beaglelogic_reader_consume(struct logic_buffer_reader *reader,
+                                       size_t count)
+{
+	reader->pos += count;
+	reader->remaining -= count;
+
+	/* Change the buffer, this one can be filled again */
+	if (reader->remaining == 0)
+		beaglelogic_reader_advance(reader);
+}
+
+/* Read the sample (ring) buffer. */
+ssize_t beaglelogic_f_read (struct file *filp, char __user *buf,
+                          size_t sz, loff_t *offset)
+{
+	int count, ret;
+	struct logic_buffer_reader *reader = filp->private_data;
+	struct beaglelogicdev *bldev = reader->bldev;
+
+	if (bldev->state == STATE_BL_ERROR)
+		return -EIO;
+
+	if (reader->pos == 0) {
+		ret = beaglelogic_reader_begin(reader);
+		if (ret)
+			return ret;
+
+		if (bldev->windowmode)
+			return beaglelogic_read_window(filp, buf, sz);
+	}
+
+	ret = beaglelogic_reader_wait(reader, filp->f_flags & O_NONBLOCK);
+	if (ret <= 0)
+		return ret;
+
 	count = min(reader->remaining, sz);
 
-	if (copy_to_user(buf, reader->buf->buf + reader->pos, count))
-		return -EFAULT;
+	if (copy_to_user(buf, reader->buf->buf + reader->pos, count))
+		return -EFAULT;
+
+	beaglelogic_reader_consume(reader, count);
+
+	return count;
+}
+
+/* splice() the sample buffers into a pipe, for sendfile() and splice() to
+ * sockets or files. The samples are copied once, into pages owned by the
+ * pipe, so that the buffer can be filled again right away: socket buffers
+ * may hold on to spliced pages long after the pipe let go of them */
+static ssize_t beaglelogic_f_splice_read(struct file *filp, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct logic_buffer_reader *reader = filp->private_data;
+	struct beaglelogicdev *bldev = reader->bldev;
+	struct iov_iter to;
+	size_t count;
+	int ret;
+
+	if (bldev->state == STATE_BL_ERROR)
+		return -EIO;
 
-	/* Detect buffer drop */
-	if (reader->buf->state == STATE_BL_BUF_MAPPED) {
-		dev_warn(dev, "buffer may be dropped at index %d \n",
-				reader->buf->index);
-		reader->buf->state = STATE_BL_BUF_DROPPED;
-		bldev->lasterror = 0x10000 | reader->buf->index;
+	if (reader->pos == 0) {
+		ret = beaglelogic_reader_begin(reader);
+		if (ret)
+			return ret;
+
+		/* Trigger windows are only read with read() */
+		if (bldev->windowmode)
+			return -EINVAL;
 	}
 
-	reader->pos += count;
-	reader->remaining -= count;
+	ret = beaglelogic_reader_wait(reader, (flags & SPLICE_F_NONBLOCK) ||
+			(filp->f_flags & O_NONBLOCK));
+	if (ret <= 0)
+		return ret;
 
-	if (reader->remaining == 0) {
-		/* Change the buffer */
-		reader->buf = reader->buf->next;
-		reader->pos = 0;
-		reader->remaining = reader->buf->size;
-	}
+	iov_iter_pipe(&to, READ, pipe, min(reader->remaining, len));
+	count = copy_to_iter(reader->buf->buf + reader->pos,
+			iov_iter_count(&to), &to);
+	if (count == 0)
+		return -EAGAIN;
+
+	beaglelogic_reader_consume(reader, count);
 
 	return count;
 }
@@ -654,17 +2327,51 @@ int beaglelogic_f_mmap(struct file *filp, struct vm_area_struct *vma)
 	int i, ret;
 	struct logic_buffer_reader *reader = filp->private_data;
 	struct beaglelogicdev *bldev = reader->bldev;
+	unsigned long flags;
 
 	unsigned long addr = vma->vm_start;
 
+	/* Ring control area for zero-copy consumers, read-only: it is shared
+	 * by all of them, and acknowledged through IOCTL_BL_RING_ACK */
+	if (vma->vm_pgoff == (BL_RING_MMAP_OFFSET >> PAGE_SHIFT)) {
+		if (!bldev->ring ||
+				vma->vm_end - vma->vm_start > bldev->ringsize)
+			return -EINVAL;
+
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vma->vm_flags &= ~VM_MAYWRITE;
+
+		ret = remap_vmalloc_range(vma, bldev->ring, 0);
+		if (ret)
+			return ret;
+
+		spin_lock_irqsave(&bldev->desclock, flags);
+		if (!reader->ring_mapped) {
+			/* The first zero-copy reader joins at the oldest
+			 * buffer still held */
+			if (!bldev->ring_users) {
+				bldev->ring_consumer = bldev->releasedseq;
+				bldev->ring->consumer = bldev->releasedseq;
+			}
+			reader->ring_mapped = true;
+			bldev->ring_users++;
+		}
+		spin_unlock_irqrestore(&bldev->desclock, flags);
+		return 0;
+	}
+
 	if (vma->vm_end - vma->vm_start > bldev->bufunitsize * bldev->bufcount)
 		return -EINVAL;
 
 	for (i = 0; i < bldev->bufcount; i++) {
+		/* Coherent buffers must not be cached in userspace either */
 		ret = remap_pfn_range(vma, addr,
 				(bldev->buffers[i].phys_addr) >> PAGE_SHIFT,
 				bldev->buffers[i].size,
-				vma->vm_page_prot);
+				bldev->buffers[i].coherent ?
+					pgprot_writecombine(vma->vm_page_prot) :
+					vma->vm_page_prot);
 
 		if (ret)
 			return -EINVAL;
@@ -681,6 +2388,14 @@ static long beaglelogic_f_ioctl(struct file *filp, unsigned int cmd,
 	struct logic_buffer_reader *reader = filp->private_data;
 	struct beaglelogicdev *bldev = reader->bldev;
 	struct device *dev = bldev->miscdev.this_device;
+	struct beaglelogic_trigger trigger;
+	struct beaglelogic_window window;
+	struct beaglelogic_rate rate;
+	struct beaglelogic_clock clock;
+	struct beaglelogic_sync sync;
+	struct beaglelogic_bufinfo bufinfo;
+	unsigned long flags;
+	int ret;
 
 	uint32_t val;
 
@@ -698,6 +2413,14 @@ static long beaglelogic_f_ioctl(struct file *filp, unsigned int cmd,
 				return -EFAULT;
 			return 0;
 
+		case IOCTL_BL_GET_ACTUAL_RATE:
+			beaglelogic_get_rate(dev, &rate);
+			if (copy_to_user((void * __user)arg,
+					&rate,
+					sizeof(rate)))
+				return -EFAULT;
+			return 0;
+
 		case IOCTL_BL_SET_SAMPLE_RATE:
 			if (beaglelogic_set_samplerate(dev, (uint32_t)arg))
 				return -EFAULT;
@@ -715,6 +2438,56 @@ static long beaglelogic_f_ioctl(struct file *filp, unsigned int cmd,
 				return -EFAULT;
 			return 0;
 
+		case IOCTL_BL_GET_CHANNEL_MASK:
+			if (copy_to_user((void * __user)arg,
+					&bldev->channelmask,
+					sizeof(bldev->channelmask)))
+				return -EFAULT;
+			return 0;
+
+		case IOCTL_BL_SET_CHANNEL_MASK:
+			return beaglelogic_set_channelmask(dev, (uint32_t)arg);
+
+		case IOCTL_BL_GET_EXT_CLOCK:
+			beaglelogic_get_clock(dev, &clock);
+			if (copy_to_user((void * __user)arg,
+					&clock,
+					sizeof(clock)))
+				return -EFAULT;
+			return 0;
+
+		case IOCTL_BL_SET_EXT_CLOCK:
+			if (copy_from_user(&clock,
+					(void * __user)arg,
+					sizeof(clock)))
+				return -EFAULT;
+			return beaglelogic_set_clock(dev, &clock);
+
+		case IOCTL_BL_GET_SYNC:
+			beaglelogic_get_sync(dev, &sync);
+			if (copy_to_user((void * __user)arg,
+					&sync,
+					sizeof(sync)))
+				return -EFAULT;
+			return 0;
+
+		case IOCTL_BL_SET_SYNC:
+			if (copy_from_user(&sync,
+					(void * __user)arg,
+					sizeof(sync)))
+				return -EFAULT;
+			return beaglelogic_set_sync(dev, &sync);
+
+		case IOCTL_BL_GET_TEST_MODE:
+			if (copy_to_user((void * __user)arg,
+					&bldev->testmode,
+					sizeof(bldev->testmode)))
+				return -EFAULT;
+			return 0;
+
+		case IOCTL_BL_SET_TEST_MODE:
+			return beaglelogic_set_testmode(dev, (uint32_t)arg);
+
 		case IOCTL_BL_GET_TRIGGER_FLAGS:
 			if (copy_to_user((void * __user)arg,
 					&bldev->triggerflags,
@@ -735,9 +2508,17 @@ static long beaglelogic_f_ioctl(struct file *filp, unsigned int cmd,
 			return 0;
 
 		case IOCTL_BL_CACHE_INVALIDATE:
+			/* Completed buffers are handed over to the CPU as they
+			 * come in. Only the ones the PRU still held when the
+			 * capture ended need it, never touch them while running */
+			if (bldev->state == STATE_BL_RUNNING ||
+					bldev->state == STATE_BL_REQUEST_STOP)
+				return 0;
+
 			for (val = 0; val < bldev->bufcount; val++) {
 				beaglelogic_unmap_buffer(dev,
-						&bldev->buffers[val]);
+						&bldev->buffers[val],
+						bldev->buffers[val].size);
 			}
 			return 0;
 
@@ -750,11 +2531,13 @@ static long beaglelogic_f_ioctl(struct file *filp, unsigned int cmd,
 			return 0;
 
 		case IOCTL_BL_SET_BUFFER_SIZE:
-			beaglelogic_memfree(dev);
-			val = beaglelogic_memalloc(dev, arg);
-			if (!val)
+			ret = beaglelogic_memfree(dev);
+			if (ret)
+				return ret;
+			ret = beaglelogic_memalloc(dev, arg);
+			if (!ret)
 				return beaglelogic_map_and_submit_all_buffers(dev);
-			return val;
+			return ret;
 
 		case IOCTL_BL_GET_BUFUNIT_SIZE:
 			if (copy_to_user((void * __user)arg,
@@ -766,168 +2549,504 @@ static long beaglelogic_f_ioctl(struct file *filp, unsigned int cmd,
 		case IOCTL_BL_SET_BUFUNIT_SIZE:
 			if ((uint32_t)arg < 32)
 				return -EINVAL;
+			ret = beaglelogic_memfree(dev);
+			if (ret)
+				return ret;
 			bldev->bufunitsize = round_up(arg, 32);
-			beaglelogic_memfree(dev);
 			return 0;
 
 		case IOCTL_BL_FILL_TEST_PATTERN:
-			beaglelogic_fill_buffer_testpattern(dev);
-			return 0;
+			return beaglelogic_fill_buffer_testpattern(dev);
+
+		case IOCTL_BL_REARM:
+			/* Only once the last one-shot capture is over */
+			if (beaglelogic_session_active(bldev))
+				return -EBUSY;
+			/* fall through */
 
 		case IOCTL_BL_START:
-			/* Reset and reconfigure the reader object and then start */
-			reader->buf = &bldev->buffers[0];
-			reader->pos = 0;
-			reader->remaining = reader->buf->size;
+			if (!bldev->buffers)
+				return -ENOMEM;
 
-			beaglelogic_start(dev);
-			return 0;
+			/* Join the readers the buffers wait for, as read() does.
+			 * The start rewinds all of them under desclock. A
+			 * zero-copy reader is only held by ring_consumer */
+			if (!reader->ring_mapped)
+				beaglelogic_reader_join(reader);
+			reader->winpos = 0;
+			reader->lost = 0;
+
+			/* Follow the capture another reader started */
+			if (beaglelogic_session_active(bldev))
+				return 0;
+
+			ret = beaglelogic_start(dev);
+			return ret == -EBUSY ? 0 : ret;
 
 		case IOCTL_BL_STOP:
 			beaglelogic_stop(dev);
 			return 0;
 
+		case IOCTL_BL_RING_ACK:
+			if (!bldev->ring)
+				return -ENOMEM;
+
+			/* Cannot consume buffers that have not been filled yet */
+			spin_lock_irqsave(&bldev->desclock, flags);
+			if ((int32_t)((uint32_t)arg - bldev->filledseq) > 0) {
+				spin_unlock_irqrestore(&bldev->desclock, flags);
+				return -EINVAL;
+			}
+
+			/* Acknowledged buffers can be filled again */
+			if ((int32_t)((uint32_t)arg - bldev->ring_consumer) > 0) {
+				trace_beaglelogic_ring_ack(
+					((uint32_t)arg - 1) % bldev->bufcount,
+					(uint32_t)arg - 1, bldev->starttime,
+					bldev->coreclockfreq);
+				bldev->ring_consumer = (uint32_t)arg;
+				beaglelogic_release_buffers(bldev);
+			}
+			bldev->ring->consumer = bldev->ring_consumer;
+			spin_unlock_irqrestore(&bldev->desclock, flags);
+			return 0;
+
+		case IOCTL_BL_GET_LOST_BYTES:
+			if (copy_to_user((void * __user)arg,
+					&reader->lost,
+					sizeof(reader->lost)))
+				return -EFAULT;
+			return 0;
+
+		case IOCTL_BL_GET_TRIGGER:
+			beaglelogic_get_trigger(dev, &trigger);
+			if (copy_to_user((void * __user)arg,
+					&trigger,
+					sizeof(trigger)))
+				return -EFAULT;
+			return 0;
+
+		case IOCTL_BL_SET_TRIGGER:
+			if (copy_from_user(&trigger,
+					(void * __user)arg,
+					sizeof(trigger)))
+				return -EFAULT;
+			return beaglelogic_set_trigger(dev, &trigger);
+
+		case IOCTL_BL_GET_WINDOW:
+			if (copy_to_user((void * __user)arg,
+					&bldev->window,
+					sizeof(bldev->window)))
+				return -EFAULT;
+			return 0;
+
+		case IOCTL_BL_SET_WINDOW:
+			if (copy_from_user(&window,
+					(void * __user)arg,
+					sizeof(window)))
+				return -EFAULT;
+			return beaglelogic_set_window(dev, &window);
+
+		case IOCTL_BL_GET_TRIGGER_INFO:
+			if (copy_to_user((void * __user)arg,
+					&bldev->triginfo,
+					sizeof(bldev->triginfo)))
+				return -EFAULT;
+			return 0;
+
+		case IOCTL_BL_GET_BUFINFO:
+			if (copy_from_user(&val, (void * __user)arg,
+					sizeof(val)))
+				return -EFAULT;
+			/* The interrupt thread rewrites it as buffers retire,
+			 * take a consistent copy */
+			spin_lock_irqsave(&bldev->desclock, flags);
+			if (!bldev->buffers || val >= bldev->bufcount) {
+				spin_unlock_irqrestore(&bldev->desclock, flags);
+				return -EINVAL;
+			}
+			bufinfo = bldev->buffers[val].info;
+			spin_unlock_irqrestore(&bldev->desclock, flags);
+
+			if (copy_to_user((void * __user)arg, &bufinfo,
+					sizeof(bufinfo)))
+				return -EFAULT;
+			return 0;
+
 	}
 	return -ENOTTY;
 }
 
-/* llseek to offset zero resets the LA */
+/* llseek to offset zero rewinds the reader, and resets the LA if it is
+ * the only user */
 static loff_t beaglelogic_f_llseek(struct file *filp, loff_t offset, int whence)
 {
 	struct logic_buffer_reader *reader = filp->private_data;
 	struct beaglelogicdev *bldev = reader->bldev;
 	struct device *dev = bldev->miscdev.this_device;
+	unsigned long flags;
+	bool last;
+	int ret;
 
 	loff_t i = offset;
 	uint32_t j;
 
+	/* Skip samples the way read() goes through them: join the capture
+	 * first, and never past the buffers the PRU has filled */
 	if (whence == SEEK_CUR) {
+		if (offset < 0)
+			return -EINVAL;
+
+		if (bldev->state == STATE_BL_ERROR)
+			return -EIO;
+
 		while (i > 0) {
-			if (reader->buf->state == STATE_BL_BUF_MAPPED) {
-				dev_warn(dev, "buffer may be dropped at index %d \n",
-						reader->buf->index);
-				reader->buf->state = STATE_BL_BUF_DROPPED;
-				bldev->lasterror = 0x10000 | reader->buf->index;
+			if (reader->pos == 0) {
+				ret = beaglelogic_reader_begin(reader);
+				if (ret)
+					return ret;
+
+				if (bldev->windowmode)
+					return -EINVAL;
 			}
 
-			j = min((uint32_t)i, reader->remaining);
-			reader->pos += j;
+			ret = beaglelogic_reader_wait(reader,
+					filp->f_flags & O_NONBLOCK);
+			if (ret < 0)
+				return i == offset ? ret : offset - i;
+			if (ret == 0)
+				break;
+
+			j = min_t(loff_t, i, reader->remaining);
+			beaglelogic_reader_consume(reader, j);
+			i -= j;
+		}
+		return offset - i;
+	}
+
+	if (whence == SEEK_SET && offset == 0) {
+		/* The next read joins the capture again, or triggers the LA.
+		 * Until then our cursor no longer holds back the others */
+		spin_lock_irqsave(&bldev->desclock, flags);
+		if (reader->reading) {
+			list_del_init(&reader->node);
+			reader->reading = false;
+			beaglelogic_release_buffers(bldev);
+		}
+		reader->buf = NULL;
+		reader->pos = 0;
+		reader->remaining = 0;
+		last = bldev->users == 1;
+		spin_unlock_irqrestore(&bldev->desclock, flags);
+
+		/* Nobody else reads the capture, stop it */
+		if (last)
+			beaglelogic_stop(dev);
+
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/* Poll the file descriptor */
+unsigned int beaglelogic_f_poll(struct file *filp,
+		struct poll_table_struct *tbl)
+{
+	struct logic_buffer_reader *reader = filp->private_data;
+	struct beaglelogicdev *bldev = reader->bldev;
+
+	/* Zero-copy readers wait for the producer index to move */
+	if (reader->ring_mapped) {
+		poll_wait(filp, &bldev->wait, tbl);
+
+		if (READ_ONCE(bldev->filledseq) !=
+				READ_ONCE(bldev->ring_consumer))
+			return (POLLIN | POLLRDNORM);
+
+		if (bldev->state == STATE_BL_ERROR)
+			return POLLERR;
+
+		/* Session over and everything consumed */
+		if (bldev->filledseq && bldev->state == STATE_BL_INITIALIZED)
+			return POLLHUP;
+
+		return 0;
+	}
+
+	/* Always register on the wait queue, epoll only does it once */
+	poll_wait(filp, &bldev->wait, tbl);
+
+	/* read() fails with -EIO until the next start */
+	if (bldev->state == STATE_BL_ERROR)
+		return (POLLIN | POLLRDNORM | POLLERR);
+
+	/* The trigger window is readable once the capture is over */
+	if (bldev->windowmode) {
+		if (bldev->state == STATE_BL_INITIALIZED)
+			return (POLLIN | POLLRDNORM);
+
+		return 0;
+	}
+
+	/* The next read() joins the running capture, or starts one */
+	if (reader->buf == NULL)
+		return (POLLIN | POLLRDNORM);
+
+	if (beaglelogic_reader_ready(reader))
+		return (POLLIN | POLLRDNORM);
+
+	return 0;
+}
+
+/* Device file close handler */
+static int beaglelogic_f_release(struct inode *inode, struct file *filp)
+{
+	struct logic_buffer_reader *reader = filp->private_data;
+	struct beaglelogicdev *bldev = reader->bldev;
+	struct device *dev = bldev->miscdev.this_device;
+	unsigned long flags;
+	uint32_t users;
+
+	/* Our cursors no longer hold back the other readers */
+	spin_lock_irqsave(&bldev->desclock, flags);
+	if (reader->ring_mapped)
+		bldev->ring_users--;
+	if (reader->reading)
+		list_del(&reader->node);
+	beaglelogic_release_buffers(bldev);
+	users = --bldev->users;
+	spin_unlock_irqrestore(&bldev->desclock, flags);
+
+	/* Stop & Release when the last reader goes away */
+	if (users == 0)
+		beaglelogic_stop(dev);
+
+	devm_kfree(dev, reader);
+
+	return 0;
+}
+
+/* File operations struct */
+static const struct file_operations pru_beaglelogic_fops = {
+	.owner = THIS_MODULE,
+	.open = beaglelogic_f_open,
+	.unlocked_ioctl = beaglelogic_f_ioctl,
+	.read = beaglelogic_f_read,
+	.splice_read = beaglelogic_f_splice_read,
+	.llseek = beaglelogic_f_llseek,
+	.mmap = beaglelogic_f_mmap,
+	.poll = beaglelogic_f_poll,
+	.release = beaglelogic_f_release,
+};
+/* fops */
+
+/* begin sysfs attrs */
+static ssize_t bl_bufunitsize_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", bldev->bufunitsize);
+}
+
+static ssize_t bl_bufunitsize_store(struct device *dev,
+        struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	uint32_t val;
+	int ret;
+
+	if (kstrtouint(buf, 10, &val))
+		return -EINVAL;
+
+	if (val < 32)
+		return -EINVAL;
+
+	/* Free up previously allocated buffers */
+	ret = beaglelogic_memfree(dev);
+	if (ret)
+		return ret;
+
+	bldev->bufunitsize = round_up(val, 32);
+
+	return count;
+}
+
+static ssize_t bl_memalloc_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+			bldev->bufcount * bldev->bufunitsize);
+}
+
+static ssize_t bl_memalloc_store(struct device *dev,
+        struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	uint32_t val;
+	int ret;
+
+	if (kstrtouint(buf, 10, &val))
+		return -EINVAL;
+
+	/* Check value of memory to reserve */
+	if (DIV_ROUND_UP(val, bldev->bufunitsize) > bldev->maxbufcount)
+		return -EINVAL;
+
+	/* Free buffers and reallocate */
+	ret = beaglelogic_memfree(dev);
+	if (ret)
+		return ret;
+	ret = beaglelogic_memalloc(dev, val);
+
+	if (!ret)
+		beaglelogic_map_and_submit_all_buffers(dev);
+	else
+		return ret;
+
+	return count;
+}
+
+static ssize_t bl_trigger_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+	struct beaglelogic_trigger trigger;
+
+	beaglelogic_get_trigger(dev, &trigger);
+	return scnprintf(buf, PAGE_SIZE, "0x%04x 0x%04x 0x%04x 0x%04x\n",
+			trigger.mask, trigger.value,
+			trigger.rising, trigger.falling);
+}
+
+static ssize_t bl_trigger_store(struct device *dev,
+        struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct beaglelogic_trigger trigger;
+	int ret;
+
+	/* mask value rising falling */
+	if (sscanf(buf, "%x %x %x %x", &trigger.mask, &trigger.value,
+			&trigger.rising, &trigger.falling) != 4)
+		return -EINVAL;
+
+	if ((ret = beaglelogic_set_trigger(dev, &trigger)))
+		return ret;
+
+	return count;
+}
 
-			if ((reader->remaining -= j) == 0) {
-				/* Change the buffer */
-				reader->buf = reader->buf->next;
-				reader->pos = 0;
-				reader->remaining = reader->buf->size;
-			}
+static ssize_t bl_pretrigger_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%d\n", bldev->window.pretrigger);
+}
 
-			i -= j;
-		}
-		return offset;
-	}
+static ssize_t bl_pretrigger_store(struct device *dev,
+        struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	struct beaglelogic_window window = bldev->window;
+	int ret;
 
-	if (whence == SEEK_SET && offset == 0) {
-		/* The next read triggers the LA */
-		reader->buf = NULL;
-		reader->pos = 0;
-		reader->remaining = 0;
+	if (kstrtouint(buf, 10, &window.pretrigger))
+		return -EINVAL;
 
-		/* Stop and map the first buffer */
-		beaglelogic_stop(dev);
-		beaglelogic_map_buffer(dev, &reader->bldev->buffers[0]);
+	if ((ret = beaglelogic_set_window(dev, &window)))
+		return ret;
 
-		return 0;
-	}
+	return count;
+}
 
-	return -EINVAL;
+static ssize_t bl_posttrigger_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	return scnprintf(buf, PAGE_SIZE, "%d\n", bldev->window.posttrigger);
 }
 
-/* Poll the file descriptor */
-unsigned int beaglelogic_f_poll(struct file *filp,
-		struct poll_table_struct *tbl)
+static ssize_t bl_posttrigger_store(struct device *dev,
+        struct device_attribute *attr, const char *buf, size_t count)
 {
-	struct logic_buffer_reader *reader = filp->private_data;
-	struct beaglelogicdev *bldev = reader->bldev;
-	struct logic_buffer *buf;
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	struct beaglelogic_window window = bldev->window;
+	int ret;
 
-	/* Raise an error if polled without starting the LA first */
-	if (reader->buf == NULL && bldev->state != STATE_BL_RUNNING)
-		return -ENOEXEC;
+	if (kstrtouint(buf, 10, &window.posttrigger))
+		return -EINVAL;
 
-	buf = reader->buf;
-	if (buf->state == STATE_BL_BUF_UNMAPPED)
-		return (POLLIN | POLLRDNORM);
+	if ((ret = beaglelogic_set_window(dev, &window)))
+		return ret;
 
-	poll_wait(filp, &bldev->wait, tbl);
+	return count;
+}
 
-	return 0;
+static ssize_t bl_coalesce_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+			beaglelogic_get_coalesce(dev));
 }
 
-/* Device file close handler */
-static int beaglelogic_f_release(struct inode *inode, struct file *filp)
+static ssize_t bl_coalesce_store(struct device *dev,
+        struct device_attribute *attr, const char *buf, size_t count)
 {
-	struct logic_buffer_reader *reader = filp->private_data;
-	struct beaglelogicdev *bldev = reader->bldev;
-	struct device *dev = bldev->miscdev.this_device;
+	uint32_t val;
+	int ret;
 
-	/* Stop & Release */
-	beaglelogic_stop(dev);
-	devm_kfree(dev, reader);
+	if (kstrtouint(buf, 10, &val))
+		return -EINVAL;
 
-	return 0;
-}
+	if ((ret = beaglelogic_set_coalesce(dev, val)))
+		return ret;
 
-/* File operations struct */
-static const struct file_operations pru_beaglelogic_fops = {
-	.owner = THIS_MODULE,
-	.open = beaglelogic_f_open,
-	.unlocked_ioctl = beaglelogic_f_ioctl,
-	.read = beaglelogic_f_read,
-	.llseek = beaglelogic_f_llseek,
-	.mmap = beaglelogic_f_mmap,
-	.poll = beaglelogic_f_poll,
-	.release = beaglelogic_f_release,
-};
-/* fops */
+	return count;
+}
 
-/* begin sysfs attrs */
-static ssize_t bl_bufunitsize_show(struct device *dev,
+static ssize_t bl_coalesce_usecs_show(struct device *dev,
         struct device_attribute *attr, char *buf)
 {
-	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
-
-	return scnprintf(buf, PAGE_SIZE, "%d\n", bldev->bufunitsize);
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+			beaglelogic_get_coalesce_usecs(dev));
 }
 
-static ssize_t bl_bufunitsize_store(struct device *dev,
+static ssize_t bl_coalesce_usecs_store(struct device *dev,
         struct device_attribute *attr, const char *buf, size_t count)
 {
-	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
 	uint32_t val;
+	int ret;
 
 	if (kstrtouint(buf, 10, &val))
 		return -EINVAL;
 
-	if (val < 32)
-		return -EINVAL;
-
-	bldev->bufunitsize = round_up(val, 32);
-
-	/* Free up previously allocated buffers */
-	beaglelogic_memfree(dev);
+	if ((ret = beaglelogic_set_coalesce_usecs(dev, val)))
+		return ret;
 
 	return count;
 }
 
-static ssize_t bl_memalloc_show(struct device *dev,
+static ssize_t bl_allocmode_show(struct device *dev,
         struct device_attribute *attr, char *buf)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
 
-	return scnprintf(buf, PAGE_SIZE, "%d\n",
-			bldev->bufcount * bldev->bufunitsize);
+	switch (bldev->allocmode) {
+		case BL_ALLOCMODE_KMALLOC:
+			return scnprintf(buf, PAGE_SIZE, "0:kmalloc\n");
+
+		case BL_ALLOCMODE_COHERENT:
+			return scnprintf(buf, PAGE_SIZE, "1:coherent\n");
+
+		case BL_ALLOCMODE_STREAMING:
+			return scnprintf(buf, PAGE_SIZE, "2:streaming\n");
+	}
+	return 0;
 }
 
-static ssize_t bl_memalloc_store(struct device *dev,
+static ssize_t bl_allocmode_store(struct device *dev,
         struct device_attribute *attr, const char *buf, size_t count)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
@@ -937,19 +3056,16 @@ static ssize_t bl_memalloc_store(struct device *dev,
 	if (kstrtouint(buf, 10, &val))
 		return -EINVAL;
 
-	/* Check value of memory to reserve */
-	if (val > bldev->maxbufcount * bldev->bufunitsize)
+	if (val > BL_ALLOCMODE_STREAMING)
 		return -EINVAL;
 
-	/* Free buffers and reallocate */
-	beaglelogic_memfree(dev);
-	ret = beaglelogic_memalloc(dev, val);
-
-	if (!ret)
-		beaglelogic_map_and_submit_all_buffers(dev);
-	else
+	/* Free up previously allocated buffers */
+	ret = beaglelogic_memfree(dev);
+	if (ret)
 		return ret;
 
+	bldev->allocmode = val;
+
 	return count;
 }
 
@@ -975,6 +3091,94 @@ static ssize_t bl_samplerate_store(struct device *dev,
 	return count;
 }
 
+static ssize_t bl_extclock_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct beaglelogic_clock clock;
+
+	beaglelogic_get_clock(dev, &clock);
+	switch (clock.edge) {
+		case BL_CLOCK_RISING:
+			return scnprintf(buf, PAGE_SIZE, "%d rising\n",
+					clock.channel);
+
+		case BL_CLOCK_FALLING:
+			return scnprintf(buf, PAGE_SIZE, "%d falling\n",
+					clock.channel);
+	}
+	return scnprintf(buf, PAGE_SIZE, "off\n");
+}
+
+static ssize_t bl_extclock_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct beaglelogic_clock clock = { 0, BL_CLOCK_OFF };
+	char edge[8];
+	int ret;
+
+	/* "off" or "channel rising|falling" */
+	if (!sysfs_streq(buf, "off")) {
+		if (sscanf(buf, "%u %7s", &clock.channel, edge) != 2)
+			return -EINVAL;
+
+		if (!strcmp(edge, "rising"))
+			clock.edge = BL_CLOCK_RISING;
+		else if (!strcmp(edge, "falling"))
+			clock.edge = BL_CLOCK_FALLING;
+		else
+			return -EINVAL;
+	}
+
+	if ((ret = beaglelogic_set_clock(dev, &clock)))
+		return ret;
+
+	return count;
+}
+
+static ssize_t bl_syncstart_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct beaglelogic_sync sync;
+
+	beaglelogic_get_sync(dev, &sync);
+	switch (sync.mode) {
+		case BL_SYNC_MASTER:
+			return scnprintf(buf, PAGE_SIZE, "master %d\n",
+					sync.pin);
+
+		case BL_SYNC_SLAVE:
+			return scnprintf(buf, PAGE_SIZE, "slave %d\n",
+					sync.pin);
+	}
+	return scnprintf(buf, PAGE_SIZE, "off\n");
+}
+
+static ssize_t bl_syncstart_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct beaglelogic_sync sync = { BL_SYNC_OFF, 0 };
+	char mode[8];
+	int ret;
+
+	/* "off" or "master|slave pin" */
+	if (!sysfs_streq(buf, "off")) {
+		if (sscanf(buf, "%7s %u", mode, &sync.pin) != 2)
+			return -EINVAL;
+
+		if (!strcmp(mode, "master"))
+			sync.mode = BL_SYNC_MASTER;
+		else if (!strcmp(mode, "slave"))
+			sync.mode = BL_SYNC_SLAVE;
+		else
+			return -EINVAL;
+	}
+
+	if ((ret = beaglelogic_set_sync(dev, &sync)))
+		return ret;
+
+	return count;
+}
+
 static ssize_t bl_sampleunit_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -984,11 +3188,15 @@ static ssize_t bl_sampleunit_show(struct device *dev,
 	switch (ret)
 	{
 		case BL_SAMPLEUNIT_16_BITS:
-			cnt += scnprintf(buf, PAGE_SIZE, "16bit\n");
+			cnt += scnprintf(buf + cnt, PAGE_SIZE - cnt, "16bit\n");
 			break;
 
 		case BL_SAMPLEUNIT_8_BITS:
-			cnt += scnprintf(buf, PAGE_SIZE, "8bit\n");
+			cnt += scnprintf(buf + cnt, PAGE_SIZE - cnt, "8bit\n");
+			break;
+
+		case BL_SAMPLEUNIT_RLE:
+			cnt += scnprintf(buf + cnt, PAGE_SIZE - cnt, "rle\n");
 			break;
 	}
 	return cnt;
@@ -1003,13 +3211,57 @@ static ssize_t bl_sampleunit_store(struct device *dev,
 	if (kstrtouint(buf, 10, &val))
 		return -EINVAL;
 
-	/* Check value of sample unit - only 0 or 1 currently */
+	/* Check value of sample unit - 0, 1 or 2 currently */
 	if ((err = beaglelogic_set_sampleunit(dev, val)))
 		return err;
 
 	return count;
 }
 
+static ssize_t bl_channelmask_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "0x%04x\n",
+			beaglelogic_get_channelmask(dev));
+}
+
+static ssize_t bl_channelmask_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	uint32_t val;
+	int ret;
+
+	if (kstrtouint(buf, 0, &val))
+		return -EINVAL;
+
+	if ((ret = beaglelogic_set_channelmask(dev, val)))
+		return ret;
+
+	return count;
+}
+
+static ssize_t bl_testmode_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+			beaglelogic_get_testmode(dev));
+}
+
+static ssize_t bl_testmode_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	uint32_t val;
+	int ret;
+
+	if (kstrtouint(buf, 10, &val))
+		return -EINVAL;
+
+	if ((ret = beaglelogic_set_testmode(dev, val)))
+		return ret;
+
+	return count;
+}
+
 static ssize_t bl_triggerflags_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -1053,7 +3305,7 @@ static ssize_t bl_state_show(struct device *dev,
 	}
 
 	/* Identify non-buffer debug states with a -ve value */
-	return scnprintf(buf, PAGE_SIZE, "-%d\n", -bldev->state);
+	return scnprintf(buf, PAGE_SIZE, "%d\n", -(int)state);
 }
 
 static ssize_t bl_state_store(struct device *dev,
@@ -1080,19 +3332,55 @@ static ssize_t bl_buffers_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
-	int i, c, cnt;
+	int i, cnt;
 
-	for (i = 0, c = 0, cnt = 0; i < bldev->bufcount; i++) {
-		c = scnprintf(buf, PAGE_SIZE, "%08x,%u\n",
+	/* Large pools do not fit in the page, list the first buffers */
+	for (i = 0, cnt = 0; i < bldev->bufcount &&
+			cnt < PAGE_SIZE - 1; i++)
+		cnt += scnprintf(buf + cnt, PAGE_SIZE - cnt, "%08x,%u\n",
 				(uint32_t)bldev->buffers[i].phys_addr,
 				bldev->buffers[i].size);
-		cnt += c;
-		buf += c;
-	}
 
 	return cnt;
 }
 
+static ssize_t bl_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	struct beaglelogic_stats *stats = &bldev->stats;
+
+	return scnprintf(buf, PAGE_SIZE,
+			"bytes %llu\n"
+			"buffers %llu\n"
+			"gaps %llu\n"
+			"lostbytes %llu\n"
+			"overwritten %llu\n"
+			"irqs %llu\n"
+			"irqtime_ns %llu\n"
+			"irqmax_ns %llu\n"
+			"maxlag %u/%u\n",
+			stats->bytes, stats->buffers, stats->gaps,
+			stats->lostbytes, stats->overwritten, stats->irqs,
+			stats->irqtime, stats->irqmax,
+			stats->maxlag, bldev->bufcount);
+}
+
+static ssize_t bl_stats_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct beaglelogicdev *bldev = dev_get_drvdata(dev);
+	uint32_t val;
+
+	/* Writing 0 resets the statistics */
+	if (kstrtouint(buf, 0, &val) || val)
+		return -EINVAL;
+
+	memset(&bldev->stats, 0, sizeof(bldev->stats));
+
+	return count;
+}
+
 static ssize_t bl_lasterror_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -1109,13 +3397,17 @@ static ssize_t bl_testpattern_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
 	uint32_t val;
+	int ret;
 
 	if (kstrtouint(buf, 10, &val))
 		return -EINVAL;
 
 	/* Only if we get the magic number, trigger the test pattern */
-	if (val == 12345678)
-		beaglelogic_fill_buffer_testpattern(dev);
+	if (val == 12345678) {
+		ret = beaglelogic_fill_buffer_testpattern(dev);
+		if (ret)
+			return ret;
+	}
 
 	return count;
 }
@@ -1126,12 +3418,42 @@ static DEVICE_ATTR(bufunitsize, S_IWUSR | S_IRUGO,
 static DEVICE_ATTR(memalloc, S_IWUSR | S_IRUGO,
 		bl_memalloc_show, bl_memalloc_store);
 
+static DEVICE_ATTR(allocmode, S_IWUSR | S_IRUGO,
+		bl_allocmode_show, bl_allocmode_store);
+
+static DEVICE_ATTR(trigger, S_IWUSR | S_IRUGO,
+		bl_trigger_show, bl_trigger_store);
+
+static DEVICE_ATTR(pretrigger, S_IWUSR | S_IRUGO,
+		bl_pretrigger_show, bl_pretrigger_store);
+
+static DEVICE_ATTR(posttrigger, S_IWUSR | S_IRUGO,
+		bl_posttrigger_show, bl_posttrigger_store);
+
+static DEVICE_ATTR(coalesce, S_IWUSR | S_IRUGO,
+		bl_coalesce_show, bl_coalesce_store);
+
+static DEVICE_ATTR(coalesce_usecs, S_IWUSR | S_IRUGO,
+		bl_coalesce_usecs_show, bl_coalesce_usecs_store);
+
 static DEVICE_ATTR(samplerate, S_IWUSR | S_IRUGO,
 		bl_samplerate_show, bl_samplerate_store);
 
+static DEVICE_ATTR(testmode, S_IWUSR | S_IRUGO,
+		bl_testmode_show, bl_testmode_store);
+
+static DEVICE_ATTR(extclock, S_IWUSR | S_IRUGO,
+		bl_extclock_show, bl_extclock_store);
+
+static DEVICE_ATTR(syncstart, S_IWUSR | S_IRUGO,
+		bl_syncstart_show, bl_syncstart_store);
+
 static DEVICE_ATTR(sampleunit, S_IWUSR | S_IRUGO,
 		bl_sampleunit_show, bl_sampleunit_store);
 
+static DEVICE_ATTR(channelmask, S_IWUSR | S_IRUGO,
+		bl_channelmask_show, bl_channelmask_store);
+
 static DEVICE_ATTR(triggerflags, S_IWUSR | S_IRUGO,
 		bl_triggerflags_show, bl_triggerflags_store);
 
@@ -1144,18 +3466,32 @@ static DEVICE_ATTR(buffers, S_IRUGO,
 static DEVICE_ATTR(lasterror, S_IRUGO,
 		bl_lasterror_show, NULL);
 
+static DEVICE_ATTR(stats, S_IWUSR | S_IRUGO,
+		bl_stats_show, bl_stats_store);
+
 static DEVICE_ATTR(filltestpattern, S_IWUSR,
 		NULL, bl_testpattern_store);
 
 static struct attribute *beaglelogic_attributes[] = {
 	&dev_attr_bufunitsize.attr,
 	&dev_attr_memalloc.attr,
+	&dev_attr_allocmode.attr,
+	&dev_attr_trigger.attr,
+	&dev_attr_pretrigger.attr,
+	&dev_attr_posttrigger.attr,
+	&dev_attr_coalesce.attr,
+	&dev_attr_coalesce_usecs.attr,
 	&dev_attr_samplerate.attr,
+	&dev_attr_extclock.attr,
+	&dev_attr_testmode.attr,
+	&dev_attr_syncstart.attr,
 	&dev_attr_sampleunit.attr,
+	&dev_attr_channelmask.attr,
 	&dev_attr_triggerflags.attr,
 	&dev_attr_state.attr,
 	&dev_attr_buffers.attr,
 	&dev_attr_lasterror.attr,
+	&dev_attr_stats.attr,
 	&dev_attr_filltestpattern.attr,
 	NULL
 };
@@ -1165,6 +3501,35 @@ static struct attribute_group beaglelogic_attr_group = {
 };
 /* end sysfs attrs */
 
+/* debugfs: histogram of the reader wakeup latencies */
+static int beaglelogic_latency_show(struct seq_file *s, void *unused)
+{
+	struct beaglelogicdev *bldev = s->private;
+	int i;
+
+	seq_printf(s, "       < 1 us: %u\n", bldev->stats.latency[0]);
+	for (i = 1; i < BL_LATENCY_BUCKETS - 1; i++)
+		seq_printf(s, "%6u-%u us: %u\n", 1 << (i - 1), 1 << i,
+				bldev->stats.latency[i]);
+	seq_printf(s, "  >= %u us: %u\n", 1 << (i - 1),
+			bldev->stats.latency[i]);
+
+	return 0;
+}
+
+static int beaglelogic_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, beaglelogic_latency_show, inode->i_private);
+}
+
+static const struct file_operations beaglelogic_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = beaglelogic_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static const struct of_device_id beaglelogic_dt_ids[];
 
 static int beaglelogic_probe(struct platform_device *pdev)
@@ -1281,12 +3646,24 @@ static int beaglelogic_probe(struct platform_device *pdev)
 		goto fail_shutdown_pru0;
 	}
 
-	ret = request_irq(bldev->from_bl_irq_1, beaglelogic_serve_irq,
-		IRQF_ONESHOT, dev_name(dev), bldev);
+	/* Set up locks, the interrupts and open() may come right away */
+	mutex_init(&bldev->mutex);
+	spin_lock_init(&bldev->desclock);
+	INIT_LIST_HEAD(&bldev->readers);
+	hrtimer_init(&bldev->polltimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	bldev->polltimer.function = beaglelogic_poll_timer;
+	init_waitqueue_head(&bldev->wait);
+	init_waitqueue_head(&bldev->cmdwait);
+
+	/* Capture context structure is at location 0000h in PRU0 SRAM */
+	bldev->cxt_pru = bldev->pru0sram.va + 0;
+
+	ret = request_threaded_irq(bldev->from_bl_irq_1, NULL,
+		beaglelogic_serve_irq, IRQF_ONESHOT, dev_name(dev), bldev);
 	if (ret) goto fail_shutdown_prus;
 
-	ret = request_irq(bldev->from_bl_irq_2, beaglelogic_serve_irq,
-		IRQF_ONESHOT, dev_name(dev), bldev);
+	ret = request_threaded_irq(bldev->from_bl_irq_2, NULL,
+		beaglelogic_serve_irq, IRQF_ONESHOT, dev_name(dev), bldev);
 	if (ret) goto fail_free_irq1;
 
 	printk("BeagleLogic loaded and initializing\n");
@@ -1298,19 +3675,12 @@ static int beaglelogic_probe(struct platform_device *pdev)
 	dev = bldev->miscdev.this_device;
 	dev_set_drvdata(dev, bldev);
 
-	/* Set up locks */
-	mutex_init(&bldev->mutex);
-	init_waitqueue_head(&bldev->wait);
-
 	/* Core clock frequency is 200 MHz */
 	bldev->coreclockfreq = 200000000;
 
 	/* Power on in disabled state */
 	bldev->state = STATE_BL_DISABLED;
 
-	/* Capture context structure is at location 0000h in PRU0 SRAM */
-	bldev->cxt_pru = bldev->pru0sram.va + 0;
-
 	if (bldev->cxt_pru->magic == BL_FW_MAGIC)
 		dev_info(dev, "Valid PRU capture context structure "\
 				"found at offset %04X\n", 0);
@@ -1320,7 +3690,7 @@ static int beaglelogic_probe(struct platform_device *pdev)
 	}
 
 	/* Get firmware properties */
-	ret = beaglelogic_send_cmd(bldev, CMD_GET_VERSION);
+	ret = beaglelogic_poll_cmd(bldev, CMD_GET_VERSION);
 	if (ret != 0) {
 		dev_info(dev, "BeagleLogic PRU Firmware version: %d.%d\n",
 				ret >> 8, ret & 0xFF);
@@ -1329,10 +3699,18 @@ static int beaglelogic_probe(struct platform_device *pdev)
 		goto faildereg;
 	}
 
+	if (ret < BL_FW_MIN_VERSION) {
+		dev_err(dev, "Firmware too old, need at least %d.%d\n",
+				BL_FW_MIN_VERSION >> 8,
+				BL_FW_MIN_VERSION & 0xFF);
+		goto faildereg;
+	}
+
 	ret = beaglelogic_send_cmd(bldev, CMD_GET_MAX_SG);
 	if (ret > 0 && ret < 256) { /* Let's be reasonable here */
-		dev_info(dev, "Device supports max %d vector transfers\n", ret);
-		bldev->maxbufcount = ret;
+		dev_info(dev, "Device supports %d ring descriptors\n", ret);
+		bldev->maxdesccount = ret;
+		bldev->maxbufcount = BL_MAX_BUFCOUNT;
 	} else {
 		dev_err(dev, "Firmware error!\n");
 		goto faildereg;
@@ -1343,6 +3721,9 @@ static int beaglelogic_probe(struct platform_device *pdev)
 	bldev->sampleunit = 1;
 	bldev->bufunitsize = 4 * 1024 * 1024;
 	bldev->triggerflags = 0;
+	bldev->coalesce = 1;
+	bldev->coalesce_usecs = 1000;
+	bldev->allocmode = BL_ALLOCMODE_KMALLOC;
 
 	/* Override defaults with the device tree */
 	if (!of_property_read_u32(node, "samplerate", &val))
@@ -1357,6 +3738,20 @@ static int beaglelogic_probe(struct platform_device *pdev)
 		if (beaglelogic_set_triggerflags(dev, val))
 			dev_warn(dev, "Invalid default triggerflags\n");
 
+	if (!of_property_read_u32(node, "allocmode", &val)) {
+		if (val > BL_ALLOCMODE_STREAMING)
+			dev_warn(dev, "Invalid default allocmode\n");
+		else
+			bldev->allocmode = val;
+	}
+
+	if (!of_property_read_u32(node, "bufunitsize", &val)) {
+		if (val < 32)
+			dev_warn(dev, "Invalid default bufunitsize\n");
+		else
+			bldev->bufunitsize = round_up(val, 32);
+	}
+
 	/* We got configuration from PRUs, now mark device init'd */
 	bldev->state = STATE_BL_INITIALIZED;
 
@@ -1375,6 +3770,11 @@ static int beaglelogic_probe(struct platform_device *pdev)
 		goto faildereg;
 	}
 
+	/* The latency histogram is optional, no error checking */
+	bldev->debugfs = debugfs_create_dir(DRV_NAME, NULL);
+	debugfs_create_file("latency", S_IRUGO, bldev->debugfs, bldev,
+			&beaglelogic_latency_fops);
+
 	return 0;
 faildereg:
 	misc_deregister(&bldev->miscdev);
@@ -1405,6 +3805,11 @@ static int beaglelogic_remove(struct platform_device *pdev)
 	struct beaglelogicdev *bldev = platform_get_drvdata(pdev);
 	struct device *dev = bldev->miscdev.this_device;
 
+	/* The buffers are only freed once the capture is over */
+	beaglelogic_stop(dev);
+	hrtimer_cancel(&bldev->polltimer);
+	debugfs_remove_recursive(bldev->debugfs);
+
 	/* Free all buffers */
 	beaglelogic_memfree(dev);
 
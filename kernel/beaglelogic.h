@@ -30,7 +30,167 @@ enum beaglelogic_triggerflags {
 
 enum beaglelogic_sampleunit {
 	BL_SAMPLEUNIT_16_BITS = 0,
-	BL_SAMPLEUNIT_8_BITS
+	BL_SAMPLEUNIT_8_BITS,
+	BL_SAMPLEUNIT_RLE		/* 32-bit run length records, see below */
+};
+
+/* External clock: one sample per rising or falling edge of a channel
+ * instead of the sample rate, for 8 and 16-bit samples */
+enum beaglelogic_clockedge {
+	BL_CLOCK_OFF = 0,		/* Sample at the sample rate */
+	BL_CLOCK_RISING,
+	BL_CLOCK_FALLING
+};
+
+struct beaglelogic_clock {
+	uint32_t channel;	/* Clock input, 0 - 15 */
+	uint32_t edge;		/* From enum beaglelogic_clockedge */
+};
+
+/* Synchronized start of several boards: the master raises a PRU0 output
+ * (R30 bit 'pin') as its capture starts, the slaves wait for a rising edge
+ * on a PRU0 input (R31 bit 'pin') before starting theirs. Buffer timestamps
+ * then count PRU cycles from the same instant on every board */
+enum beaglelogic_syncmode {
+	BL_SYNC_OFF = 0,
+	BL_SYNC_MASTER,			/* Drive the sync line */
+	BL_SYNC_SLAVE			/* Wait for the sync line */
+};
+
+struct beaglelogic_sync {
+	uint32_t mode;		/* From enum beaglelogic_syncmode */
+	uint32_t pin;		/* PRU0 R30 / R31 bit, 0 - 15 */
+};
+
+/* Test mode: PRU1 sends a 32-bit little-endian counter instead of samples,
+ * at the byte rate of the sample rate and unit. The word at stream offset
+ * o (including the bytes dropped for lack of a buffer) is o / 4 */
+#define BL_TEST_WORD(offset)	((uint32_t)((offset) / 4))
+
+/* Packed channels (channelmask): only a group of 1, 2, 4 or 8 neighbouring
+ * channels is stored, 32 / width samples per 32-bit little-endian word with
+ * the first sample in the lowest bits. The group starts at a multiple of
+ * its width, e.g. 0x0003, 0x00F0 or 0xFF00 */
+
+/* Run length records: a 16-bit sample value held for 1 to 65536 samples.
+ * A new record is emitted when the inputs change or the count overflows */
+#define BL_RLE_VALUE(rec)	((rec) & 0xFFFF)
+#define BL_RLE_COUNT(rec)	(((rec) >> 16) + 1)
+
+enum beaglelogic_allocmode {
+	BL_ALLOCMODE_KMALLOC = 0,	/* One kmalloc() per buffer unit */
+	BL_ALLOCMODE_COHERENT,		/* Contiguous CMA / coherent chunks */
+	BL_ALLOCMODE_STREAMING		/* kmalloc(), DMA-mapped only once */
+};
+
+/* Zero-copy streaming: ring control area shared with userspace
+ *
+ * mmap() /dev/beaglelogic at BL_RING_MMAP_OFFSET to map this structure,
+ * read-only (PROT_READ) as it is shared by all the zero-copy readers.
+ * Sample buffers are mapped as usual at offset 0, buffer n starting at
+ * n * bufunitsize. Every completed buffer is given a sequence number; the
+ * data with sequence number s lives in buffer (s % bufcount), and desc[n].seq
+ * tells which sequence number buffer n currently holds.
+ *
+ * Userspace consumes buffers [consumer, producer) in place and acknowledges
+ * them with IOCTL_BL_RING_ACK. Sequence s has been lost if
+ * desc[s % bufcount].seq != s after it has been processed */
+#define BL_RING_MMAP_OFFSET	0x40000000
+#define BL_RING_MAGIC		0xBEA6121C
+#define BL_RING_SEQ_INVALID	0xFFFFFFFF
+
+struct beaglelogic_ring_desc {
+	uint32_t seq;		/* Sequence number of the data in this buffer */
+	uint32_t size;		/* Valid bytes in this buffer */
+	uint32_t flags;		/* Buffer flags, see below */
+	uint32_t lost;		/* Bytes lost right before this buffer */
+	uint64_t offset;	/* Stream offset of the first byte */
+	uint64_t tstart;	/* Timestamps of the first and last 32 bytes */
+	uint64_t tend;
+	uint32_t samplerate;	/* Sample rate of this buffer, 0 if clocked */
+	uint32_t reserved;
+};
+
+struct beaglelogic_ring {
+	uint32_t magic;		/* BL_RING_MAGIC */
+	uint32_t bufcount;	/* Number of entries in desc[] */
+	uint32_t bufunitsize;	/* Size of one buffer, in bytes */
+	uint32_t state;		/* Device state, from enum beaglelogic_states */
+
+	uint32_t producer;	/* Sequence number of the next buffer to fill */
+	uint32_t consumer;	/* Sequence number of the next buffer to use */
+	uint32_t dropped;	/* Buffers overwritten before being consumed */
+	uint32_t reserved;
+
+	struct beaglelogic_ring_desc desc[];
+};
+
+/* Buffer metadata, recorded by the PRU as every buffer completes
+ *
+ * 'offset' counts the bytes sampled since the start of the capture, including
+ * the ones that had to be dropped while no buffer was free: 'lost' bytes were
+ * dropped right before the buffer, which is then flagged BL_BUF_OVERRUN.
+ * Timestamps are in PRU cycles (200 MHz) since the start of the capture and
+ * mark the arrival of the first and the last 32 bytes of the buffer.
+ * tstart is only exact for buffers filled within 21 s (2^32 cycles) */
+#define BL_BUF_OVERRUN		(1 << 0)
+#define BL_BUF_RATECHANGE	(1 << 1)	/* First at a new samplerate */
+
+struct beaglelogic_bufinfo {
+	uint32_t index;		/* Buffer to query, set by the caller */
+	uint32_t size;		/* Valid bytes in this buffer */
+	uint32_t flags;		/* BL_BUF_* */
+	uint32_t lost;		/* Bytes lost right before this buffer */
+	uint64_t offset;	/* Stream offset of the first byte */
+	uint64_t tstart;	/* Timestamps of the first and last 32 bytes */
+	uint64_t tend;
+	uint32_t samplerate;	/* Sample rate of this buffer, 0 if clocked */
+	uint32_t reserved;
+};
+
+/* Hardware trigger, evaluated by the PRU before any sample is stored
+ *
+ * The capture starts at the first sample where (input & mask) equals
+ * (value & mask) and where every channel in 'rising' ('falling') has just
+ * gone from low to high (high to low). Several edge channels have to change
+ * in the same sample. Set everything to zero to disable the trigger */
+struct beaglelogic_trigger {
+	uint32_t mask;		/* Channels that have to match 'value' */
+	uint32_t value;
+	uint32_t rising;	/* Channels that have to rise */
+	uint32_t falling;	/* Channels that have to fall */
+};
+
+/* Trigger window capture: 'pretrigger' samples before the trigger and
+ * 'posttrigger' samples from the trigger on. The ring of buffers is
+ * overwritten until the trigger fires, then the capture ends 'posttrigger'
+ * samples later. A zero posttrigger disables window captures */
+struct beaglelogic_window {
+	uint32_t pretrigger;	/* Samples to keep before the trigger */
+	uint32_t posttrigger;	/* Samples to capture after the trigger */
+};
+
+/* Location of the trigger window after a capture. Byte offsets are counted
+ * from the start of the capture, 'offset' is the window start within the
+ * buffers mmap()ed at offset 0 (wrapping at the end of the mapping) */
+struct beaglelogic_triggerinfo {
+	uint32_t triggered;	/* 1 if the window is valid */
+	uint32_t trigpos;	/* Byte offset of the trigger sample */
+	uint32_t start;		/* Byte offset of the window start */
+	uint32_t size;		/* Window size, in bytes */
+	uint32_t offset;	/* Window start in the mapped buffers */
+};
+
+/* Sample rate actually generated by the PRU: clock * 65536 / period Hz.
+ * Rates that are not (100 / n) MHz use a period with a fraction of a cycle:
+ * every sample is then taken within one PRU cycle of its ideal time. In
+ * burst mode this is the rate within a burst, the period and the rate are
+ * 0 with an external clock */
+struct beaglelogic_rate {
+	uint32_t clock;		/* PRU clock, Hz */
+	uint32_t reserved;
+	uint64_t period;	/* PRU cycles per sample, in 1/65536 */
+	uint64_t millihz;	/* Sample rate, in mHz (rounded) */
 };
 
 /* ioctl calls that can be issued on /dev/beaglelogic */
@@ -60,4 +220,36 @@ enum beaglelogic_sampleunit {
 #define IOCTL_BL_START               _IO('k', 0x29)
 #define IOCTL_BL_STOP                _IO('k', 0x2A)
 
+#define IOCTL_BL_RING_ACK           _IOW('k', 0x2B, u32)
+
+#define IOCTL_BL_GET_TRIGGER        _IOR('k', 0x2C, struct beaglelogic_trigger)
+#define IOCTL_BL_SET_TRIGGER        _IOW('k', 0x2C, struct beaglelogic_trigger)
+
+#define IOCTL_BL_GET_WINDOW         _IOR('k', 0x2D, struct beaglelogic_window)
+#define IOCTL_BL_SET_WINDOW         _IOW('k', 0x2D, struct beaglelogic_window)
+#define IOCTL_BL_GET_TRIGGER_INFO   _IOR('k', 0x2E, struct beaglelogic_triggerinfo)
+
+#define IOCTL_BL_GET_BUFINFO        _IOWR('k', 0x2F, struct beaglelogic_bufinfo)
+
+/* Bytes the calling reader missed since it started reading */
+#define IOCTL_BL_GET_LOST_BYTES     _IOR('k', 0x30, u64)
+
+#define IOCTL_BL_GET_CHANNEL_MASK   _IOR('k', 0x31, u32)
+#define IOCTL_BL_SET_CHANNEL_MASK   _IOW('k', 0x31, u32)
+
+#define IOCTL_BL_GET_ACTUAL_RATE    _IOR('k', 0x32, struct beaglelogic_rate)
+
+#define IOCTL_BL_GET_EXT_CLOCK      _IOR('k', 0x33, struct beaglelogic_clock)
+#define IOCTL_BL_SET_EXT_CLOCK      _IOW('k', 0x33, struct beaglelogic_clock)
+
+#define IOCTL_BL_GET_SYNC           _IOR('k', 0x34, struct beaglelogic_sync)
+#define IOCTL_BL_SET_SYNC           _IOW('k', 0x34, struct beaglelogic_sync)
+
+/* PRU test pattern [1] instead of samples [0], see BL_TEST_WORD */
+#define IOCTL_BL_GET_TEST_MODE      _IOR('k', 0x35, u32)
+#define IOCTL_BL_SET_TEST_MODE      _IOW('k', 0x35, u32)
+
+/* Ends a finished one-shot capture and starts the next one right away */
+#define IOCTL_BL_REARM              _IO('k', 0x36)
+
 #endif /* BEAGLELOGIC_H_ */
@@ -0,0 +1,174 @@
+/*
+ * Tracepoints of the BeagleLogic capture pipeline
+ *
+ * A buffer goes through: written back by the PRU (buffer_done, from the
+ * interrupt handler between irq_entry and irq_exit), readers woken up
+ * (wakeup), consumed by read() or acknowledged on the ring (dequeue,
+ * ring_ack), and handed to the PRU again (repost). Every event carries the
+ * buffer index and the PRU cycle count since the start of the capture, the
+ * clock of the tstart / tend timestamps, so that for example:
+ *
+ *     trace-cmd record -e beaglelogic
+ *
+ * breaks the latency from the PRU writing a buffer back down to its reuse.
+ *
+ * Copyright (C) 2014-20 Kumar Abhishek <abhishek@theembeddedkitchen.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM beaglelogic
+
+#if !defined(BEAGLELOGIC_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define BEAGLELOGIC_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#ifndef BL_TRACE_CYCLES
+/* PRU cycles since 'start' (in ns), only taken when the event is enabled */
+#define BL_TRACE_CYCLES(start, clockfreq) \
+	div_u64((ktime_get_ns() - (start)) * ((clockfreq) / 1000000), 1000)
+#endif
+
+TRACE_EVENT(beaglelogic_irq_entry,
+
+	TP_PROTO(int irqno, u32 index, u32 done, u64 start, u32 clockfreq),
+
+	TP_ARGS(irqno, index, done, start, clockfreq),
+
+	TP_STRUCT__entry(
+		__field(int, irqno)
+		__field(u32, index)
+		__field(u32, done)
+		__field(u64, cycles)
+	),
+
+	TP_fast_assign(
+		__entry->irqno = irqno;
+		__entry->index = index;
+		__entry->done = done;
+		__entry->cycles = BL_TRACE_CYCLES(start, clockfreq);
+	),
+
+	TP_printk("irq=%d index=%u done=%u cycles=%llu", __entry->irqno,
+		__entry->index, __entry->done, __entry->cycles)
+);
+
+TRACE_EVENT(beaglelogic_irq_exit,
+
+	TP_PROTO(int irqno, u32 index, u32 retired, u64 start, u32 clockfreq),
+
+	TP_ARGS(irqno, index, retired, start, clockfreq),
+
+	TP_STRUCT__entry(
+		__field(int, irqno)
+		__field(u32, index)
+		__field(u32, retired)
+		__field(u64, cycles)
+	),
+
+	TP_fast_assign(
+		__entry->irqno = irqno;
+		__entry->index = index;
+		__entry->retired = retired;
+		__entry->cycles = BL_TRACE_CYCLES(start, clockfreq);
+	),
+
+	TP_printk("irq=%d index=%u retired=%u cycles=%llu", __entry->irqno,
+		__entry->index, __entry->retired, __entry->cycles)
+);
+
+/* tend is when the PRU wrote the last block, cycles when we got to it */
+TRACE_EVENT(beaglelogic_buffer_done,
+
+	TP_PROTO(u32 index, u64 offset, u32 size, u32 lost, u64 tstart,
+		u64 tend, u64 cycles),
+
+	TP_ARGS(index, offset, size, lost, tstart, tend, cycles),
+
+	TP_STRUCT__entry(
+		__field(u32, index)
+		__field(u64, offset)
+		__field(u32, size)
+		__field(u32, lost)
+		__field(u64, tstart)
+		__field(u64, tend)
+		__field(u64, cycles)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->offset = offset;
+		__entry->size = size;
+		__entry->lost = lost;
+		__entry->tstart = tstart;
+		__entry->tend = tend;
+		__entry->cycles = cycles;
+	),
+
+	TP_printk("index=%u offset=%llu size=%u lost=%u tstart=%llu tend=%llu "
+		"cycles=%llu", __entry->index, __entry->offset,
+		__entry->size, __entry->lost, __entry->tstart,
+		__entry->tend, __entry->cycles)
+);
+
+DECLARE_EVENT_CLASS(beaglelogic_buffer,
+
+	TP_PROTO(u32 index, u32 seq, u64 start, u32 clockfreq),
+
+	TP_ARGS(index, seq, start, clockfreq),
+
+	TP_STRUCT__entry(
+		__field(u32, index)
+		__field(u32, seq)
+		__field(u64, cycles)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->seq = seq;
+		__entry->cycles = BL_TRACE_CYCLES(start, clockfreq);
+	),
+
+	TP_printk("index=%u seq=%u cycles=%llu", __entry->index,
+		__entry->seq, __entry->cycles)
+);
+
+/* Readers woken up, index is the last buffer completed */
+DEFINE_EVENT(beaglelogic_buffer, beaglelogic_wakeup,
+	TP_PROTO(u32 index, u32 seq, u64 start, u32 clockfreq),
+	TP_ARGS(index, seq, start, clockfreq)
+);
+
+/* A read() consumer is done with a buffer */
+DEFINE_EVENT(beaglelogic_buffer, beaglelogic_dequeue,
+	TP_PROTO(u32 index, u32 seq, u64 start, u32 clockfreq),
+	TP_ARGS(index, seq, start, clockfreq)
+);
+
+/* Zero-copy consumers acknowledged every buffer up to this one */
+DEFINE_EVENT(beaglelogic_buffer, beaglelogic_ring_ack,
+	TP_PROTO(u32 index, u32 seq, u64 start, u32 clockfreq),
+	TP_ARGS(index, seq, start, clockfreq)
+);
+
+/* A buffer is handed to the PRU, seq counts the postings of the capture */
+DEFINE_EVENT(beaglelogic_buffer, beaglelogic_repost,
+	TP_PROTO(u32 index, u32 seq, u64 start, u32 clockfreq),
+	TP_ARGS(index, seq, start, clockfreq)
+);
+
+#endif /* BEAGLELOGIC_TRACE_H_ */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE beaglelogic_trace
+#include <trace/define_trace.h>
@@ -25,6 +25,69 @@ server.listen(app.get('port'), function(){
 io = require('socket.io')(server, { pingInterval: 60000, pingTimeout: 120000});
 io.on('connection', connectionHandler);
 
+// Reads little-endian 64-bit fields, exact up to 2^53
+function readU64(buf, pos) {
+	return buf.readUInt32LE(pos) + buf.readUInt32LE(pos + 4) * 4294967296;
+}
+
+function readAt(fd, size, pos) {
+	var buf = new Buffer(size);
+
+	if (fs.readSync(fd, buf, 0, size, pos) != size)
+		throw new Error('truncated recording');
+	return buf;
+}
+
+function readOverview(file, level, start, count) {
+	var fd = fs.openSync(file, 'r'),
+		CHUNK_ALIGN = 4096,
+		end = fs.fstatSync(fd).size,
+		trailer, chunk, header, base, lvl, buf, i, out;
+
+	try {
+		// struct beaglelogic_trailer, in the last 16 bytes
+		trailer = readAt(fd, 16, end - 16);
+		if (trailer.readUInt32LE(8) != 0xBEA61DC5)
+			throw new Error('no index');
+
+		// struct beaglelogic_chunk of type BL_CHUNK_INDEX
+		chunk = readAt(fd, 40, readU64(trailer, 0));
+		if (chunk.readUInt32LE(0) != 0xBEA6C4C4 ||
+				chunk.readUInt32LE(36) != 1)
+			throw new Error('bad index');
+
+		base = readU64(trailer, 0) + CHUNK_ALIGN;
+		header = readAt(fd, 24 + 8 * 24, base);
+		if (level >= header.readUInt32LE(8))
+			throw new Error('no such level');
+
+		lvl = 24 + level * 24;
+		out = {
+			samplesize: header.readUInt32LE(0),
+			samples: readU64(header, 16),
+			level: level,
+			levelsamples: readU64(header, lvl),
+			levelcount: readU64(header, lvl + 8),
+			start: start,
+			summaries: []
+		};
+
+		count = Math.max(0, Math.min(count, out.levelcount - start));
+		if (count) {
+			buf = readAt(fd, count * 12,
+					base + readU64(header, lvl + 16) + start * 12);
+			for (i = 0; i < count; i++)
+				out.summaries.push([buf.readUInt32LE(i * 12),
+						buf.readUInt32LE(i * 12 + 4),
+						buf.readUInt32LE(i * 12 + 8)]);
+		}
+	} finally {
+		fs.closeSync(fd);
+	}
+
+	return out;
+}
+
 function connectionHandler(socket) {
 	console.log('Socket.IO connected');
 
@@ -75,6 +138,23 @@ function connectionHandler(socket) {
 		});
 	});
 
+	// Overview of a recording made by testapp/beaglelogic-record, from
+	// its index (struct beaglelogic_index in testapp/libbeaglelogic.h):
+	// 'count' summaries of overview 'level' from summary 'start' on, as
+	// [any, all, changed] channel masks
+	socket.on('recording-overview', function(data) {
+		var index;
+
+		try {
+			index = readOverview(data.file, data.level || 0,
+					data.start || 0, data.count || 1024);
+		} catch (e) {
+			socket.emit('recording-overview', { error: e.message });
+			return;
+		}
+		socket.emit('recording-overview', index);
+	});
+
 	// Reserved functions
 	
 	// Sending a buffer over a socket is "terrible"
@@ -0,0 +1,835 @@
+/*
+ * server.c
+ *
+ * BeagleLogic TCP streaming server, speaking the same line protocol as
+ * tcp-server-go and tcp-server-node (used by the sigrok beaglelogic driver
+ * in TCP mode). All the clients are served from a single epoll loop, and
+ * the samples are moved to the sockets with splice() so that they never
+ * go through userspace. Clients on slow links can have the stream run
+ * length encoded instead ('compress rle', see struct beaglelogic_block), or
+ * decoded on the board so only the bus transactions are sent ('decode').
+ *
+ * Commands, one per line (replies end in \r\n):
+ *     <attr> [value]     get or set samplerate, sampleunit, triggerflags,
+ *                        bufunitsize, memalloc or state
+ *     limit [samples]    samples per capture, -1 for no limit
+ *     compress [rle|none]  block encoding of the next captures
+ *     decode [spec|none] send the next captures as struct beaglelogic_event
+ *                        records of a UART, SPI or I2C bus, e.g.
+ *                        'decode uart:rx=0,baud=115200' (see
+ *                        beaglelogic_decoder_parse)
+ *     throughput         bytes per second of the last capture
+ *     version, get, close, exit
+ *
+ * Build with:
+ *     gcc -O2 -Wall -I../testapp -o server server.c ../testapp/beaglelogic.c
+ *
+ * Copyright (C) 2014 Kumar Abhishek
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "libbeaglelogic.h"
+
+#define BEAGLELOGIC_SYSFS_DIR	"/sys/devices/virtual/misc/beaglelogic/"
+
+#define MAX_CLIENTS		8
+#define MAX_EVENTS		16
+#define LINE_MAX_LEN		256
+
+/* Bytes moved per splice() / read(), and chunks moved per wakeup so that
+ * one client does not starve the others */
+#define CHUNK_SIZE		(1024 * 1024)
+#define CHUNKS_PER_WAKEUP	16
+
+/* epoll event sources, in the upper half of epoll_data.u64 */
+enum source {
+	SRC_LISTEN,
+	SRC_TIMER,
+	SRC_SOCKET,
+	SRC_DEVICE
+};
+
+struct client {
+	int sock;			/* -1 if the slot is free */
+	int stream;			/* /dev/beaglelogic while streaming */
+	int pipe[2];			/* splice stage, -1 for read()/send() */
+	uint8_t *buf;			/* read()/send() stage */
+	uint8_t *zbuf;			/* Encoded blocks, when compressing */
+	uint8_t *out;			/* Data to send, buf or zbuf */
+	int compress;			/* 'compress rle' given */
+	int samplesize;			/* Bytes per sample of the capture */
+
+	int decode;			/* 'decode <spec>' given */
+	char decodespec[128];
+	struct beaglelogic_decoder decoder;
+	size_t rawpos, rawlen;		/* Samples in buf not decoded yet */
+	size_t decoded;			/* Bytes of events in zbuf */
+
+	uint32_t events;		/* epoll events of sock and stream */
+	uint32_t devevents;
+
+	size_t pending;			/* Bytes staged but not yet sent */
+	size_t bufpos;
+
+	int64_t limit;			/* Samples per capture, -1 for none */
+	uint64_t remaining;		/* Bytes left to send in this capture */
+
+	uint64_t sent;			/* Bytes sent in this capture */
+	uint64_t lastsent;		/* ... at the previous report */
+	struct timespec start, last;
+	double rate;			/* Sustained rate, bytes per second */
+
+	char line[LINE_MAX_LEN];
+	size_t linelen;
+};
+
+static struct client clients[MAX_CLIENTS];
+static int epfd;
+
+/* Options */
+static int sndbuf = 4 * 1024 * 1024;
+static int64_t default_limit = -1;
+static int report_interval = 5;
+static int use_splice = 1;
+
+static double elapsed(struct timespec *t1, struct timespec *t2)
+{
+	return (t2->tv_sec - t1->tv_sec) + (t2->tv_nsec - t1->tv_nsec) / 1e9;
+}
+
+static uint64_t source_id(enum source src, int slot)
+{
+	return ((uint64_t)src << 32) | (uint32_t)slot;
+}
+
+static int epoll_set(int fd, uint32_t *cur, uint32_t events, uint64_t id)
+{
+	struct epoll_event ev = { .events = events, .data.u64 = id };
+	int op = *cur ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	if (*cur == events)
+		return 0;
+
+	if (events == 0)
+		op = EPOLL_CTL_DEL;
+
+	*cur = events;
+	return epoll_ctl(epfd, op, fd, &ev);
+}
+
+/* Device fd for the configuration commands. While streaming, the stream
+ * is used, otherwise the device is opened for the command only: an idle
+ * server must not keep a capture going once the last reader is gone */
+static int ctl_open(struct client *c)
+{
+	return c->stream >= 0 ? c->stream : beaglelogic_open_nonblock();
+}
+
+static void ctl_close(struct client *c, int fd)
+{
+	if (fd >= 0 && fd != c->stream)
+		beaglelogic_close(fd);
+}
+
+static int sysfs_read(const char *attr, char *buf, size_t len)
+{
+	char path[128];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), BEAGLELOGIC_SYSFS_DIR "%s", attr);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+
+	buf[n] = '\0';
+	buf[strcspn(buf, "\r\n")] = '\0';
+	return 0;
+}
+
+static int sysfs_write(const char *attr, const char *value)
+{
+	char path[128];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), BEAGLELOGIC_SYSFS_DIR "%s", attr);
+	if ((fd = open(path, O_WRONLY)) < 0)
+		return -1;
+
+	n = write(fd, value, strlen(value));
+	close(fd);
+
+	return n < 0 ? -1 : 0;
+}
+
+static void reply(struct client *c, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void reply(struct client *c, const char *fmt, ...)
+{
+	char buf[LINE_MAX_LEN];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf) - 2, fmt, ap);
+	va_end(ap);
+
+	/* Replies are tiny, and sent before any sample data */
+	strcpy(buf + n, "\r\n");
+	send(c->sock, buf, n + 2, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/* Bytes per sample for the sample limit. RLE captures count records */
+static int bytes_per_sample(int fd)
+{
+	enum beaglelogic_sampleunit unit = BL_SAMPLEUNIT_16_BITS;
+
+	beaglelogic_get_sampleunit(fd, &unit);
+
+	switch (unit) {
+	case BL_SAMPLEUNIT_8_BITS: return 1;
+	case BL_SAMPLEUNIT_RLE: return 4;
+	default: return 2;
+	}
+}
+
+static void report(struct client *c, const char *what)
+{
+	struct timespec now;
+	double t;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = elapsed(&c->start, &now);
+	if (t > 0)
+		c->rate = c->sent / t;
+
+	printf("[%d] %s: %llu bytes in %.2f s, %.2f MB/s\n", c->sock, what,
+			(unsigned long long)c->sent, t, c->rate / 1e6);
+	fflush(stdout);
+}
+
+static void stream_end(struct client *c)
+{
+	uint64_t lost = 0;
+
+	if (c->stream < 0)
+		return;
+
+	beaglelogic_get_lostbytes(c->stream, &lost);
+	report(c, "capture done");
+	if (lost)
+		printf("[%d] %llu bytes lost\n", c->sock,
+				(unsigned long long)lost);
+
+	epoll_set(c->stream, &c->devevents, 0, 0);
+	beaglelogic_close(c->stream);
+	c->stream = -1;
+
+	/* Whatever did not reach the socket yet is dropped */
+	if (c->pipe[0] >= 0) {
+		close(c->pipe[0]);
+		close(c->pipe[1]);
+		c->pipe[0] = c->pipe[1] = -1;
+	}
+	c->pending = 0;
+}
+
+static void client_close(struct client *c)
+{
+	stream_end(c);
+	free(c->buf);
+	free(c->zbuf);
+	c->buf = c->zbuf = NULL;
+
+	epoll_set(c->sock, &c->events, 0, 0);
+	close(c->sock);
+	printf("[%d] Session ended\n", c->sock);
+	c->sock = -1;
+}
+
+/* Sends the staged data. Returns 1 when everything went out, 0 if the
+ * socket is full and -1 on errors */
+static int stream_flush(struct client *c)
+{
+	ssize_t n;
+
+	while (c->pending) {
+		if (c->pipe[0] >= 0)
+			n = splice(c->pipe[0], NULL, c->sock, NULL, c->pending,
+					SPLICE_F_MOVE | SPLICE_F_MORE |
+					SPLICE_F_NONBLOCK);
+		else
+			n = send(c->sock, c->out + c->bufpos, c->pending,
+					MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (n < 0)
+			return errno == EAGAIN ? 0 : -1;
+
+		c->pending -= n;
+		c->bufpos += n;
+		c->sent += n;
+	}
+
+	return 1;
+}
+
+/* Stages the next chunk of samples */
+static ssize_t stream_fill(struct client *c)
+{
+	size_t len = CHUNK_SIZE;
+
+	if (c->remaining < len)
+		len = c->remaining;
+
+	c->bufpos = 0;
+	if (c->pipe[0] >= 0)
+		return splice(c->stream, NULL, c->pipe[1], NULL, len,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	return read(c->stream, c->buf, len);
+}
+
+/* Decodes the next samples into events. Returns the bytes of samples
+ * decoded, read() sets how many more are pulled from the device */
+static ssize_t stream_decode(struct client *c)
+{
+	size_t len = CHUNK_SIZE, consumed;
+	ssize_t n;
+
+	if (!c->rawlen) {
+		if (c->remaining < len)
+			len = c->remaining;
+		if ((n = read(c->stream, c->buf, len)) <= 0)
+			return n;
+		c->rawpos = 0;
+		c->rawlen = n - n % c->samplesize;
+	}
+
+	c->decoded = beaglelogic_decode(&c->decoder, c->buf + c->rawpos,
+			c->rawlen / c->samplesize,
+			(struct beaglelogic_event *)c->zbuf,
+			CHUNK_SIZE / sizeof(struct beaglelogic_event),
+			&consumed) * sizeof(struct beaglelogic_event);
+
+	consumed *= c->samplesize;
+	c->rawpos += consumed;
+	c->rawlen -= consumed;
+	c->bufpos = 0;
+
+	return consumed;
+}
+
+/* Moves samples from the device to the socket until either side blocks */
+static void stream_pump(struct client *c, int slot)
+{
+	int i, ret;
+	ssize_t n;
+
+	for (i = 0; i < CHUNKS_PER_WAKEUP && c->stream >= 0; i++) {
+		ret = stream_flush(c);
+		if (ret < 0) {
+			client_close(c);
+			return;
+		}
+
+		/* Socket full, wait for it to drain before reading on */
+		if (ret == 0) {
+			epoll_set(c->stream, &c->devevents, 0, 0);
+			epoll_set(c->sock, &c->events, EPOLLIN | EPOLLOUT,
+					source_id(SRC_SOCKET, slot));
+			return;
+		}
+
+		if (c->remaining == 0) {
+			stream_end(c);
+			break;
+		}
+
+		n = c->decode ? stream_decode(c) : stream_fill(c);
+		if (n < 0 && errno == EAGAIN) {
+			epoll_set(c->stream, &c->devevents, EPOLLIN,
+					source_id(SRC_DEVICE, slot));
+			break;
+		}
+
+		/* Drivers without splice support, go through a buffer */
+		if (n < 0 && errno == EINVAL && c->pipe[0] >= 0 && !c->sent) {
+			close(c->pipe[0]);
+			close(c->pipe[1]);
+			c->pipe[0] = c->pipe[1] = -1;
+			if (!c->buf && !(c->buf = malloc(CHUNK_SIZE))) {
+				stream_end(c);
+				break;
+			}
+			continue;
+		}
+
+		/* End of the capture, or an error */
+		if (n <= 0) {
+			stream_end(c);
+			break;
+		}
+
+		c->remaining -= n;
+		c->pending = n;
+		c->out = c->buf;
+		if (c->decode) {
+			c->pending = c->decoded;
+			c->out = c->zbuf;
+		} else if (c->compress) {
+			c->pending = beaglelogic_block_encode(c->buf, n,
+					c->samplesize, c->zbuf);
+			c->out = c->zbuf;
+		}
+	}
+
+	epoll_set(c->sock, &c->events, EPOLLIN, source_id(SRC_SOCKET, slot));
+}
+
+static void stream_start(struct client *c, int slot)
+{
+	uint32_t mask = 0, rate;
+
+	if (c->stream >= 0)
+		return;
+
+	if ((c->stream = beaglelogic_open_nonblock()) < 0) {
+		perror("open /dev/beaglelogic");
+		return;
+	}
+
+	/* Encoding needs the samples in userspace, no splice then */
+	c->pipe[0] = c->pipe[1] = -1;
+	if (use_splice && !c->compress && !c->decode &&
+			pipe2(c->pipe, O_NONBLOCK) == 0)
+		fcntl(c->pipe[1], F_SETPIPE_SZ, CHUNK_SIZE);
+	else if ((!c->buf && !(c->buf = malloc(CHUNK_SIZE))) ||
+			((c->compress || c->decode) && !c->zbuf &&
+			 !(c->zbuf = malloc(
+				CHUNK_SIZE + sizeof(struct beaglelogic_block))))) {
+		stream_end(c);
+		return;
+	}
+
+	c->samplesize = bytes_per_sample(c->stream);
+	c->remaining = UINT64_MAX;
+	if (c->limit >= 0)
+		c->remaining = c->limit * c->samplesize;
+
+	/* Packed channels are encoded and limited byte by byte */
+	if (beaglelogic_get_channelmask(c->stream, &mask) == 0 && mask) {
+		c->samplesize = 1;
+		if (c->limit >= 0)
+			c->remaining = (c->limit * __builtin_popcount(mask) + 7) / 8;
+	}
+
+	/* Decoders take plain 8 or 16-bit samples */
+	c->rawlen = 0;
+	if (c->decode && (mask || beaglelogic_get_samplerate(c->stream,
+				&rate) || beaglelogic_decoder_start(&c->decoder,
+				rate, c->samplesize))) {
+		printf("[%d] Cannot decode %s from this capture\n", c->sock,
+				c->decodespec);
+		stream_end(c);
+		return;
+	}
+
+	c->pending = 0;
+	c->sent = c->lastsent = 0;
+	c->rate = 0;
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+	c->last = c->start;
+
+	/* The first read starts (or joins) the capture; the device only
+	 * signals data once that happened */
+	stream_pump(c, slot);
+}
+
+/* Configuration through the driver: attributes with an ioctl use it,
+ * the others go through sysfs */
+static void command_attr(struct client *c, char *attr, char *value)
+{
+	enum beaglelogic_sampleunit unit;
+	enum beaglelogic_triggerflags flags;
+	uint32_t val;
+	char buf[64];
+	int fd, ret = -1;
+
+	if (!strcmp(attr, "state") || (!strcmp(attr, "bufunitsize") && value)) {
+		if (value)
+			ret = sysfs_write(attr, value);
+		else if ((ret = sysfs_read(attr, buf, sizeof(buf))) == 0)
+			reply(c, "%s", buf);
+		goto out;
+	}
+
+	if ((fd = ctl_open(c)) < 0)
+		goto out;
+
+	if (value) {
+		val = strtoul(value, NULL, 0);
+		if (!strcmp(attr, "samplerate"))
+			ret = beaglelogic_set_samplerate(fd, val);
+		else if (!strcmp(attr, "sampleunit"))
+			ret = beaglelogic_set_sampleunit(fd, val);
+		else if (!strcmp(attr, "triggerflags"))
+			ret = beaglelogic_set_triggerflags(fd, val);
+		else if (!strcmp(attr, "memalloc"))
+			ret = beaglelogic_set_buffersize(fd, val);
+	} else {
+		if (!strcmp(attr, "samplerate")) {
+			if ((ret = beaglelogic_get_samplerate(fd, &val)) == 0)
+				reply(c, "%u", val);
+		} else if (!strcmp(attr, "sampleunit")) {
+			/* 1 for 8-bit samples, 0 otherwise, like the other
+			 * servers */
+			if ((ret = beaglelogic_get_sampleunit(fd, &unit)) == 0)
+				reply(c, "%d", unit == BL_SAMPLEUNIT_8_BITS);
+		} else if (!strcmp(attr, "triggerflags")) {
+			if ((ret = beaglelogic_get_triggerflags(fd, &flags)) == 0)
+				reply(c, "%d", flags);
+		} else if (!strcmp(attr, "memalloc")) {
+			if ((ret = beaglelogic_get_buffersize(fd, &val)) == 0)
+				reply(c, "%u", val);
+		} else if (!strcmp(attr, "bufunitsize")) {
+			reply(c, "%d", beaglelogic_getbufunitsize(fd));
+			ret = 0;
+		}
+	}
+	ctl_close(c, fd);
+
+out:
+	if (value)
+		reply(c, ret ? "ERR" : "OK");
+	else if (ret)
+		reply(c, "ERR");
+}
+
+static void command(struct client *c, int slot, char *line)
+{
+	static const char *attrs[] = { "samplerate", "sampleunit",
+		"triggerflags", "bufunitsize", "memalloc", "state" };
+	char *cmd, *arg, *save;
+	unsigned int i;
+	char model[64];
+
+	if (!(cmd = strtok_r(line, " \t\r", &save)))
+		return;
+	arg = strtok_r(NULL, " \t\r", &save);
+
+	printf("[%d] Received command: %s%s%s\n", c->sock, cmd,
+			arg ? " " : "", arg ? arg : "");
+
+	for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+		if (!strcmp(cmd, attrs[i])) {
+			command_attr(c, cmd, arg);
+			return;
+		}
+	}
+
+	if (!strcmp(cmd, "limit")) {
+		if (arg) {
+			c->limit = strtoll(arg, NULL, 0);
+			reply(c, "OK");
+		} else {
+			reply(c, "%lld", (long long)c->limit);
+		}
+	} else if (!strcmp(cmd, "compress")) {
+		/* Takes effect on the next 'get' */
+		if (!arg)
+			reply(c, c->compress ? "rle" : "none");
+		else if (!strcmp(arg, "rle") || !strcmp(arg, "none")) {
+			c->compress = !strcmp(arg, "rle");
+			reply(c, "OK");
+		} else {
+			reply(c, "ERR");
+		}
+	} else if (!strcmp(cmd, "decode")) {
+		struct beaglelogic_decoder decoder;
+
+		/* Takes effect on the next 'get' */
+		if (!arg) {
+			reply(c, "%s", c->decode ? c->decodespec : "none");
+		} else if (!strcmp(arg, "none")) {
+			c->decode = 0;
+			reply(c, "OK");
+		} else if (strlen(arg) < sizeof(c->decodespec) &&
+				!beaglelogic_decoder_parse(&decoder, arg)) {
+			c->decoder = decoder;
+			c->decode = 1;
+			strcpy(c->decodespec, arg);
+			reply(c, "OK");
+		} else {
+			reply(c, "ERR");
+		}
+	} else if (!strcmp(cmd, "throughput")) {
+		/* Bytes per second of the current or last capture */
+		reply(c, "%.0f", c->rate);
+	} else if (!strcmp(cmd, "version")) {
+		int fd = open("/proc/device-tree/model", O_RDONLY);
+		ssize_t n = fd >= 0 ? read(fd, model, sizeof(model) - 1) : -1;
+
+		if (fd >= 0)
+			close(fd);
+		model[n > 0 ? n : 0] = '\0';
+		if (!strcmp(model, "TI AM335x BeagleLogic Standalone"))
+			reply(c, "BeagleLogic Standalone 1.0");
+		else
+			reply(c, "BeagleLogic 1.0");
+	} else if (!strcmp(cmd, "get")) {
+		stream_start(c, slot);
+	} else if (!strcmp(cmd, "close")) {
+		stream_end(c);
+	} else if (!strcmp(cmd, "exit")) {
+		client_close(c);
+	}
+}
+
+static void client_input(struct client *c, int slot)
+{
+	char *nl;
+	ssize_t n;
+
+	n = recv(c->sock, c->line + c->linelen,
+			sizeof(c->line) - c->linelen - 1, MSG_DONTWAIT);
+	if (n <= 0) {
+		if (n == 0 || errno != EAGAIN)
+			client_close(c);
+		return;
+	}
+
+	c->linelen += n;
+	c->line[c->linelen] = '\0';
+
+	while (c->sock >= 0 && (nl = strchr(c->line, '\n'))) {
+		*nl = '\0';
+		command(c, slot, c->line);
+
+		if (c->sock < 0)
+			return;
+		c->linelen -= nl + 1 - c->line;
+		memmove(c->line, nl + 1, c->linelen + 1);
+	}
+
+	/* Overlong line, drop it */
+	if (c->linelen == sizeof(c->line) - 1)
+		c->linelen = 0;
+}
+
+static void client_accept(int lfd)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	struct client *c = NULL;
+	int fd, i, one = 1;
+
+	if ((fd = accept4(lfd, (struct sockaddr *)&addr, &len,
+					SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].sock < 0) {
+			c = &clients[i];
+			break;
+		}
+	}
+	if (!c) {
+		close(fd);
+		return;
+	}
+
+	/* Small replies go out at once, samples in large segments */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (sndbuf)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	memset(c, 0, sizeof(*c));
+	c->sock = fd;
+	c->stream = -1;
+	c->pipe[0] = c->pipe[1] = -1;
+	c->limit = default_limit;
+	epoll_set(fd, &c->events, EPOLLIN, source_id(SRC_SOCKET, i));
+
+	printf("[%d] Accepted connection from: %s:%d\n", fd,
+			inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	fflush(stdout);
+}
+
+/* Periodic throughput report of the running captures */
+static void report_tick(int tfd)
+{
+	struct timespec now;
+	uint64_t expirations;
+	double t;
+	int i;
+
+	if (read(tfd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		struct client *c = &clients[i];
+
+		if (c->sock < 0 || c->stream < 0)
+			continue;
+
+		t = elapsed(&c->last, &now);
+		printf("[%d] %.2f MB/s, %llu bytes in total\n", c->sock,
+				t > 0 ? (c->sent - c->lastsent) / t / 1e6 : 0,
+				(unsigned long long)c->sent);
+		c->lastsent = c->sent;
+		c->last = now;
+	}
+	fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p port] [-s sndbuf] [-l limit] "
+			"[-r seconds] [-n]\n"
+			"  -p  TCP port (default $PORT or 5555)\n"
+			"  -s  socket send buffer in bytes, 0 for the system "
+			"default (default 4 MiB)\n"
+			"  -l  samples per capture, -1 for no limit (default). "
+			"Clients can change it\n"
+			"      with the 'limit' command\n"
+			"  -r  throughput report interval, 0 to disable "
+			"(default 5 s)\n"
+			"  -n  use read() and send() instead of splice()\n",
+			prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct sockaddr_in addr;
+	const char *port = getenv("PORT");
+	uint32_t levents = 0, tevents = 0;
+	int lfd, tfd = -1, i, n, opt, one = 1;
+
+	while ((opt = getopt(argc, argv, "p:s:l:r:n")) != -1) {
+		switch (opt) {
+		case 'p': port = optarg; break;
+		case 's': sndbuf = atoi(optarg); break;
+		case 'l': default_limit = strtoll(optarg, NULL, 0); break;
+		case 'r': report_interval = atoi(optarg); break;
+		case 'n': use_splice = 0; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (!port || !*port)
+		port = "5555";
+
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].sock = -1;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(atoi(port));
+
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(lfd, MAX_CLIENTS)) {
+		perror("bind");
+		return 1;
+	}
+	epoll_set(lfd, &levents, EPOLLIN, source_id(SRC_LISTEN, 0));
+
+	if (report_interval > 0) {
+		struct itimerspec its = {
+			.it_interval = { .tv_sec = report_interval },
+			.it_value = { .tv_sec = report_interval },
+		};
+
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		timerfd_settime(tfd, 0, &its, NULL);
+		epoll_set(tfd, &tevents, EPOLLIN, source_id(SRC_TIMER, 0));
+	}
+
+	printf("Listening on port %s\n", port);
+	fflush(stdout);
+
+	for (;;) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			return 1;
+		}
+
+		for (i = 0; i < n; i++) {
+			uint32_t ev = events[i].events;
+			int slot = (uint32_t)events[i].data.u64;
+			struct client *c = &clients[slot];
+
+			switch (events[i].data.u64 >> 32) {
+			case SRC_LISTEN:
+				client_accept(lfd);
+				break;
+
+			case SRC_TIMER:
+				report_tick(tfd);
+				break;
+
+			case SRC_SOCKET:
+				if (c->sock < 0)
+					break;
+				if (ev & (EPOLLHUP | EPOLLERR)) {
+					client_close(c);
+					break;
+				}
+				if (ev & EPOLLOUT)
+					stream_pump(c, slot);
+				if ((ev & EPOLLIN) && c->sock >= 0)
+					client_input(c, slot);
+				break;
+
+			case SRC_DEVICE:
+				/* The stream may be gone, stale event */
+				if (c->sock >= 0 && c->stream >= 0)
+					stream_pump(c, slot);
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
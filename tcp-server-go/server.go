@@ -8,6 +8,7 @@ import (
 	"os"
 	"path/filepath"
 	"strings"
+	"syscall"
 )
 
 func beaglelogicSysfsAttr(attr string) string {
@@ -40,6 +41,61 @@ func beagleLogicIsStandalone() bool {
 var abort = false
 var localBuf = make([]byte, 1024*1024)
 
+// Set SPLICE=1 to have the kernel move the samples to the socket through a
+// pipe, instead of reading them into localBuf and writing them out again
+var useSplice = os.Getenv("SPLICE") == "1"
+
+const (
+	spliceFMove = 0x01
+	spliceFMore = 0x04
+)
+
+// Stream the capture with splice(), device -> pipe -> socket. Returns false
+// if nothing could be sent this way, e.g. on older drivers without splice
+func beaglelogicSplice(f *os.File, conn net.Conn) bool {
+	tcp, ok := conn.(*net.TCPConn)
+	if !ok {
+		return false
+	}
+	raw, err := tcp.SyscallConn()
+	if err != nil {
+		return false
+	}
+
+	var p [2]int
+	if syscall.Pipe(p[:]) != nil {
+		return false
+	}
+	defer syscall.Close(p[0])
+	defer syscall.Close(p[1])
+
+	fd := int(f.Fd())
+	sent := false
+	for !abort {
+		in, err := syscall.Splice(fd, nil, p[1], nil, len(localBuf), spliceFMove)
+		if err != nil || in == 0 {
+			break
+		}
+		sent = true
+
+		for n := int(in); n > 0; {
+			var m int
+			var werr error
+			err = raw.Write(func(s uintptr) bool {
+				out, e := syscall.Splice(p[0], nil, int(s), nil, n,
+					spliceFMove|spliceFMore)
+				m, werr = int(out), e
+				return werr != syscall.EAGAIN
+			})
+			if err != nil || werr != nil {
+				return true
+			}
+			n -= m
+		}
+	}
+	return sent
+}
+
 func beaglelogicRun(conn net.Conn) {
 	f, err := os.Open("/dev/beaglelogic")
 
@@ -48,6 +104,9 @@ func beaglelogicRun(conn net.Conn) {
 	if err != nil {
 		return
 	}
+	if useSplice && beaglelogicSplice(f, conn) {
+		return
+	}
 	for {
 		if abort {
 			break
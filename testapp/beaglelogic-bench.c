@@ -0,0 +1,633 @@
+/*
+ * beaglelogic-bench.c
+ *
+ * Throughput and loss benchmark for BeagleLogic. Every run captures the
+ * test pattern of the PRU (see BL_TEST_WORD) for a few seconds with one
+ * combination of sample rate, sample unit, buffer unit size, read size and
+ * consumer API, checks every word of the stream and reports:
+ *
+ *     rate,unit,bufunitsize,readsize,api,seconds,bytes,mbps,cpu,irq,
+ *     lostbytes,errors,lossfree
+ *
+ * as one CSV line on stdout. 'cpu' is the load of this process and 'irq'
+ * the time spent in the BeagleLogic interrupt handlers, in percent of the
+ * run time. 'lostbytes' are the bytes the driver reported as dropped,
+ * 'errors' the words that were neither the expected count nor explained by
+ * a reported loss. The sweep ends with one "max" line per combination of
+ * unit, buffer unit size, read size and API, giving the fastest rate that
+ * ran without loss or error:
+ *
+ *     beaglelogic-bench -r 10M,50M,100M -u 8,16 -a read,mmap -t 5
+ *
+ * Lists are comma separated, sizes and rates take k / M suffixes.
+ *
+ * With -T, every combination of rate and unit is instead auto-tuned (see
+ * beaglelogic_autotune) with the pattern check as the consumer, and the
+ * layout chosen reported as:
+ *
+ *     tune,rate,unit,bufunitsize,bufcount,mbps,irqrate,maxlag,stall,
+ *     lostbytes,errors,sustainable
+ *
+ * The last layout is left applied.
+ *
+ * With -W, a trigger window of the 16-bit test pattern is captured at each
+ * rate instead, triggering on channel 0 high: twice in every 32-byte block.
+ * Each line tells whether the trigger reported is the first match of its
+ * block and whether the window holds the pattern:
+ *
+ *     window,rate,trigpos,ok
+ *
+ * Build with:
+ *     gcc -O2 -Wall -o beaglelogic-bench beaglelogic-bench.c beaglelogic.c
+ *
+ * Copyright (C) 2014 Kumar Abhishek
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libbeaglelogic.h"
+
+#define MAX_LIST	16
+#define STATS_ATTR	"/sys/devices/virtual/misc/beaglelogic/stats"
+
+enum api {
+	API_READ,	/* Blocking read() */
+	API_POLL,	/* Nonblocking read() woken up by poll() */
+	API_MMAP,	/* Zero-copy ring, see beaglelogic_mmap_ring */
+	API_COUNT
+};
+
+static const char *api_names[API_COUNT] = { "read", "poll", "mmap" };
+
+struct list {
+	uint32_t v[MAX_LIST];
+	int n;
+};
+
+/* Checks the test pattern of a stream, carrying state across chunks */
+struct verifier {
+	uint32_t expected;	/* Next word, BL_TEST_WORD of the stream offset */
+	uint64_t skipped;	/* Bytes skipped over by forward jumps */
+	uint64_t errors;	/* Words out of sequence */
+};
+
+struct result {
+	uint32_t bufunitsize;
+	double seconds;
+	uint64_t bytes;
+	uint64_t lostbytes;
+	uint64_t errors;
+	double cpu;
+	double irq;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-r rates] [-u units] [-b bufunitsizes] "\
+			"[-s readsizes] [-a apis] [-m memalloc] [-t seconds] [-T] [-W]\n"
+			"    -r  sample rates (default 1M,10M,25M,50M,100M)\n"
+			"    -u  sample units, 8 or 16 (default 8,16)\n"
+			"    -b  buffer unit sizes (default current)\n"
+			"    -s  read sizes, not used by mmap (default 64k,1M)\n"
+			"    -a  read, poll and / or mmap (default all)\n"
+			"    -m  capture buffer size (default current)\n"
+			"    -t  seconds per run (default 5)\n"
+			"    -T  auto-tune each rate and unit instead, up to\n"
+			"        'memalloc' bytes of buffers\n"
+			"    -W  check the trigger position of window captures\n"
+			"        at each rate instead\n", prog);
+	exit(1);
+}
+
+static uint32_t parse_size(const char *s)
+{
+	char *end;
+	double v = strtod(s, &end);
+
+	if (*end == 'k' || *end == 'K')
+		v *= 1000;
+	else if (*end == 'M')
+		v *= 1000000;
+
+	return (v < 0 || v > UINT32_MAX) ? 0 : (uint32_t)v;
+}
+
+/* Parses a comma separated list of sizes, or of API names */
+static void parse_list(struct list *l, char *arg, int apis)
+{
+	char *tok;
+	int i;
+
+	l->n = 0;
+	for (tok = strtok(arg, ","); tok && l->n < MAX_LIST;
+			tok = strtok(NULL, ",")) {
+		if (!apis) {
+			l->v[l->n++] = parse_size(tok);
+			continue;
+		}
+
+		for (i = 0; i < API_COUNT; i++)
+			if (!strcmp(tok, api_names[i]))
+				break;
+		if (i == API_COUNT) {
+			fprintf(stderr, "Unknown API %s\n", tok);
+			exit(1);
+		}
+		l->v[l->n++] = i;
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cputime(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Time spent in the interrupt handlers so far, from the stats attribute */
+static double irqtime(void)
+{
+	unsigned long long ns = 0;
+	char line[64];
+	FILE *f = fopen(STATS_ATTR, "r");
+
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "irqtime_ns %llu", &ns) == 1)
+			break;
+
+	fclose(f);
+	return ns / 1e9;
+}
+
+/* Checks a chunk of a stream, which may have gaps where bytes were lost */
+static void verify_stream(struct verifier *v, const uint32_t *w, size_t n)
+{
+	size_t i;
+	int32_t diff;
+
+	for (i = 0; i < n; i++) {
+		if (w[i] != v->expected) {
+			diff = (int32_t)(w[i] - v->expected);
+			if (diff > 0)
+				v->skipped += (uint64_t)diff * 4;
+			else
+				v->errors++;
+		}
+		v->expected = w[i] + 1;
+	}
+}
+
+/* Checks a buffer whose stream offset is known, no gap is allowed */
+static uint64_t verify_offset(const uint32_t *w, size_t n, uint64_t offset)
+{
+	uint32_t expected = BL_TEST_WORD(offset);
+	uint64_t errors = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (w[i] != expected + i)
+			errors++;
+
+	return errors;
+}
+
+static int run_read(int fd, enum api api, uint32_t readsize, double end,
+		struct result *res)
+{
+	struct verifier v = { 0, 0, 0 };
+	struct pollfd pollfd = { fd, POLLIN | POLLRDNORM, 0 };
+	uint8_t *buf;
+	size_t carry = 0;
+	ssize_t sz;
+
+	/* A whole number of words per read keeps the chunks aligned */
+	readsize &= ~3;
+	if (!readsize || !(buf = malloc(readsize)))
+		return -1;
+
+	while (now() < end) {
+		if (api == API_POLL && poll(&pollfd, 1, 500) <= 0)
+			continue;
+
+		sz = read(fd, buf + carry, readsize - carry);
+		if (sz < 0) {
+			if (errno == EAGAIN)
+				continue;
+			break;
+		}
+		if (sz == 0)
+			break;
+
+		res->bytes += sz;
+		sz += carry;
+		verify_stream(&v, (uint32_t *)buf, sz / 4);
+
+		/* Keep a partial word for the next read */
+		carry = sz & 3;
+		memmove(buf, buf + sz - carry, carry);
+	}
+
+	beaglelogic_get_lostbytes(fd, &res->lostbytes);
+	res->errors = v.errors;
+	if (v.skipped != res->lostbytes)
+		res->errors++;
+
+	free(buf);
+	return 0;
+}
+
+static int run_mmap(int fd, double end, struct result *res)
+{
+	struct pollfd pollfd = { fd, POLLIN | POLLRDNORM, 0 };
+	struct beaglelogic_ring *ring;
+	struct beaglelogic_ring_desc *desc;
+	uint64_t expected = 0, offset, errors;
+	uint32_t seq, size;
+	void *mem;
+	void *buf;
+
+	mem = beaglelogic_mmap(fd);
+	if (mem == MAP_FAILED)
+		return -1;
+
+	ring = beaglelogic_mmap_ring(fd);
+	if (ring == MAP_FAILED) {
+		beaglelogic_munmap(fd, mem);
+		return -1;
+	}
+
+	beaglelogic_start(fd);
+	seq = ring->consumer;
+
+	while (now() < end) {
+		if (poll(&pollfd, 1, 500) <= 0)
+			continue;
+
+		for (; seq != ring->producer; seq++) {
+			desc = &ring->desc[seq % ring->bufcount];
+			size = desc->size;
+			offset = desc->offset;
+			buf = beaglelogic_ring_buffer(mem, ring, seq);
+
+			errors = verify_offset(buf, size / 4, offset);
+
+			/* Overwritten while we were checking it: counted as
+			 * lost by the offset of the next buffer */
+			if (desc->seq != seq)
+				continue;
+
+			res->errors += errors;
+			res->lostbytes += offset - expected;
+			res->bytes += size;
+			expected = offset + size;
+		}
+		beaglelogic_ring_ack(fd, seq);
+	}
+
+	beaglelogic_stop(fd);
+	beaglelogic_munmap_ring(ring);
+	beaglelogic_munmap(fd, mem);
+
+	return 0;
+}
+
+static int tune_check(struct beaglelogic_stream *s,
+		const struct beaglelogic_buffer *buf, void *arg)
+{
+	struct result *res = arg;
+
+	(void)s;
+
+	res->errors += verify_offset(buf->data, buf->size / 4, buf->offset);
+	return 0;
+}
+
+/* Auto-tunes the buffers for one rate and unit, calibrating for 'seconds' */
+static int tune(uint32_t rate, uint32_t unit, uint32_t memalloc,
+		double seconds)
+{
+	struct beaglelogic_tune t;
+	struct result res;
+	int fd, ret = -1;
+
+	memset(&t, 0, sizeof(t));
+	memset(&res, 0, sizeof(res));
+	t.maxmem = memalloc;
+	t.calibration = seconds * 1000;
+
+	fd = beaglelogic_open_nonblock();
+	if (fd < 0) {
+		perror("/dev/beaglelogic");
+		return -1;
+	}
+
+	if (beaglelogic_set_samplerate(fd, rate) ||
+			beaglelogic_set_sampleunit(fd, unit == 8 ?
+				BL_SAMPLEUNIT_8_BITS : BL_SAMPLEUNIT_16_BITS) ||
+			beaglelogic_set_testmode(fd, 1))
+		goto out;
+
+	ret = beaglelogic_autotune(fd, &t, tune_check, &res);
+	beaglelogic_set_testmode(fd, 0);
+	if (ret)
+		goto out;
+
+	printf("tune,%u,%u,%u,%u,%.3f,%u,%u,%u,%llu,%llu,%d\n", rate, unit,
+			t.bufunitsize, t.bufcount, t.byterate / 1e6,
+			t.irqrate, t.maxlag, t.stall,
+			(unsigned long long)t.lostbytes,
+			(unsigned long long)res.errors, t.sustainable);
+	fflush(stdout);
+out:
+	if (ret)
+		fprintf(stderr, "Cannot tune %u Hz, %u bits: %s\n", rate,
+				unit, strerror(errno));
+	beaglelogic_close(fd);
+	return ret;
+}
+
+/* 16-bit sample of the test pattern at a byte offset */
+static uint16_t test_sample(uint32_t pos)
+{
+	return BL_TEST_WORD(pos) >> ((pos & 2) * 8);
+}
+
+/* Window capture of the test pattern, triggering on channel 0 high. It is
+ * high on every odd word, so twice in each block of 8 words: the trigger
+ * has to be the first of them. Returns 1 if it is, 0 if not, -1 on error */
+static int check_window(uint32_t rate)
+{
+	struct beaglelogic_trigger trigger = { 1, 1, 0, 0 };
+	struct beaglelogic_window window = { 64, 64 };
+	struct beaglelogic_triggerinfo info;
+	uint16_t samples[128];
+	uint32_t pos;
+	size_t got = 0;
+	ssize_t n;
+	int fd, ok = -1;
+
+	fd = beaglelogic_open();
+	if (fd < 0) {
+		perror("/dev/beaglelogic");
+		return -1;
+	}
+
+	if (beaglelogic_set_samplerate(fd, rate) ||
+			beaglelogic_set_sampleunit(fd,
+				BL_SAMPLEUNIT_16_BITS) ||
+			beaglelogic_set_trigger(fd, &trigger) ||
+			beaglelogic_set_window(fd, &window) ||
+			beaglelogic_set_testmode(fd, 1))
+		goto out;
+
+	/* The first read starts the capture and returns once it is over */
+	while ((n = read(fd, (uint8_t *)samples + got,
+			sizeof(samples) - got)) > 0)
+		got += n;
+
+	if (n < 0 || beaglelogic_get_triggerinfo(fd, &info))
+		goto out;
+
+	if (!info.triggered) {
+		fprintf(stderr, "%u Hz: no trigger\n", rate);
+		goto out;
+	}
+
+	/* No match in the block before the trigger, one at it */
+	ok = (test_sample(info.trigpos) & 1) && got == info.size;
+	for (pos = info.trigpos & ~31; pos < info.trigpos; pos += 2)
+		if (test_sample(pos) & 1)
+			ok = 0;
+
+	for (pos = 0; pos < got / 2; pos++)
+		if (samples[pos] != test_sample(info.start + 2 * pos))
+			ok = 0;
+
+	printf("window,%u,%u,%d\n", rate, info.trigpos, ok);
+	fflush(stdout);
+out:
+	if (ok < 0)
+		fprintf(stderr, "Cannot check the window at %u Hz: %s\n",
+				rate, strerror(errno));
+	memset(&window, 0, sizeof(window));
+	memset(&trigger, 0, sizeof(trigger));
+	beaglelogic_set_testmode(fd, 0);
+	beaglelogic_set_window(fd, &window);
+	beaglelogic_set_trigger(fd, &trigger);
+	beaglelogic_close(fd);
+	return ok;
+}
+
+/* Configures the device and runs one capture, -1 if it could not start */
+static int run(uint32_t rate, uint32_t unit, uint32_t bufunitsize,
+		uint32_t memalloc, uint32_t readsize, enum api api,
+		double seconds, struct result *res)
+{
+	double t0, c0, i0;
+	int fd, ret = -1;
+
+	memset(res, 0, sizeof(*res));
+
+	fd = (api == API_READ) ? beaglelogic_open() :
+		beaglelogic_open_nonblock();
+	if (fd < 0) {
+		perror("/dev/beaglelogic");
+		return -1;
+	}
+
+	/* Freeing the buffers on a unit size change needs a new memalloc */
+	if (bufunitsize && (uint32_t)beaglelogic_getbufunitsize(fd) !=
+			bufunitsize) {
+		if (!memalloc)
+			beaglelogic_get_buffersize(fd, &memalloc);
+		if (beaglelogic_set_bufunitsize(fd, bufunitsize))
+			goto out;
+	}
+	if (memalloc && beaglelogic_set_buffersize(fd, memalloc))
+		goto out;
+	res->bufunitsize = beaglelogic_getbufunitsize(fd);
+
+	if (beaglelogic_set_samplerate(fd, rate) ||
+			beaglelogic_set_sampleunit(fd, unit == 8 ?
+				BL_SAMPLEUNIT_8_BITS : BL_SAMPLEUNIT_16_BITS) ||
+			beaglelogic_set_triggerflags(fd,
+				BL_TRIGGERFLAGS_CONTINUOUS) ||
+			beaglelogic_set_testmode(fd, 1))
+		goto out;
+
+	t0 = now();
+	c0 = cputime();
+	i0 = irqtime();
+
+	if (api == API_MMAP)
+		ret = run_mmap(fd, t0 + seconds, res);
+	else
+		ret = run_read(fd, api, readsize, t0 + seconds, res);
+
+	res->seconds = now() - t0;
+	res->cpu = 100 * (cputime() - c0) / res->seconds;
+	res->irq = 100 * (irqtime() - i0) / res->seconds;
+
+	beaglelogic_set_testmode(fd, 0);
+out:
+	if (ret)
+		fprintf(stderr, "Cannot run %u Hz, %u bits, %s: %s\n", rate,
+				unit, api_names[api], strerror(errno));
+	beaglelogic_close(fd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct list rates, units, bufunits, readsizes, apis;
+	char defrates[] = "1M,10M,25M,50M,100M", defunits[] = "8,16";
+	char defreads[] = "64k,1M", defapis[] = "read,poll,mmap";
+	uint32_t memalloc = 0, maxrate;
+	int nreads;
+	struct result res;
+	double seconds = 5;
+	int r, u, b, s, a, opt, lossfree, tuning = 0, windows = 0;
+
+	parse_list(&rates, defrates, 0);
+	parse_list(&units, defunits, 0);
+	parse_list(&readsizes, defreads, 0);
+	parse_list(&apis, defapis, 1);
+	bufunits.n = 1;
+	bufunits.v[0] = 0;
+
+	while ((opt = getopt(argc, argv, "r:u:b:s:a:m:t:TW")) != -1) {
+		switch (opt) {
+			case 'r':
+				parse_list(&rates, optarg, 0);
+				break;
+
+			case 'u':
+				parse_list(&units, optarg, 0);
+				break;
+
+			case 'b':
+				parse_list(&bufunits, optarg, 0);
+				break;
+
+			case 's':
+				parse_list(&readsizes, optarg, 0);
+				break;
+
+			case 'a':
+				parse_list(&apis, optarg, 1);
+				break;
+
+			case 'm':
+				memalloc = parse_size(optarg);
+				break;
+
+			case 't':
+				seconds = atof(optarg);
+				break;
+
+			case 'T':
+				tuning = 1;
+				break;
+
+			case 'W':
+				windows = 1;
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (!rates.n || !units.n || !readsizes.n || !apis.n || seconds <= 0)
+		usage(argv[0]);
+
+	if (windows) {
+		printf("window,rate,trigpos,ok\n");
+		for (r = 0; r < rates.n; r++)
+			if (check_window(rates.v[r]) != 1)
+				windows = 2;
+		return windows == 2;
+	}
+
+	if (tuning) {
+		printf("tune,rate,unit,bufunitsize,bufcount,mbps,irqrate,"\
+				"maxlag,stall,lostbytes,errors,sustainable\n");
+		for (u = 0; u < units.n; u++)
+			for (r = 0; r < rates.n; r++)
+				tune(rates.v[r], units.v[u], memalloc, seconds);
+		return 0;
+	}
+
+	printf("rate,unit,bufunitsize,readsize,api,seconds,bytes,mbps,cpu,"\
+			"irq,lostbytes,errors,lossfree\n");
+
+	for (u = 0; u < units.n; u++)
+	for (b = 0; b < bufunits.n; b++)
+	for (a = 0; a < apis.n; a++) {
+		/* The read size means nothing to the ring */
+		nreads = (apis.v[a] == API_MMAP) ? 1 : readsizes.n;
+
+		for (s = 0; s < nreads; s++) {
+			uint32_t readsize = (apis.v[a] == API_MMAP) ? 0 :
+				readsizes.v[s];
+
+			maxrate = 0;
+			for (r = 0; r < rates.n; r++) {
+				if (run(rates.v[r], units.v[u], bufunits.v[b],
+						memalloc, readsize, apis.v[a],
+						seconds, &res))
+					continue;
+
+				lossfree = !res.lostbytes && !res.errors;
+				if (lossfree && rates.v[r] > maxrate)
+					maxrate = rates.v[r];
+
+				printf("%u,%u,%u,%u,%s,%.3f,%llu,%.3f,%.1f,"\
+					"%.1f,%llu,%llu,%d\n",
+					rates.v[r], units.v[u],
+					res.bufunitsize, readsize, api_names[apis.v[a]],
+					res.seconds,
+					(unsigned long long)res.bytes,
+					res.bytes / res.seconds / 1e6,
+					res.cpu, res.irq,
+					(unsigned long long)res.lostbytes,
+					(unsigned long long)res.errors,
+					lossfree);
+				fflush(stdout);
+			}
+
+			printf("max,%u,%u,%u,%s,%u\n", units.v[u],
+					res.bufunitsize, readsize,
+					api_names[apis.v[a]], maxrate);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * beaglelogic-kernelbench.c
+ *
+ * Checks the sample to channel kernels of libbeaglelogic (transpose, edges
+ * and high counts) against plain bit by bit code and measures their speed,
+ * in millions of samples per second:
+ *
+ *     beaglelogic-kernelbench -n 4M -u 8,16 -i 10
+ *
+ * In the test signal, channel 0 toggles about every 64 samples (-p) and
+ * every other channel half as often as the one below it. Build for NEON
+ * on the BeagleBone with:
+ *     gcc -O2 -Wall -mfpu=neon -mfloat-abi=hard -o beaglelogic-kernelbench \
+ *         beaglelogic-kernelbench.c beaglelogic.c
+ *
+ * Copyright (C) 2014 Kumar Abhishek
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libbeaglelogic.h"
+
+#define EDGE_BATCH	4096
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t sample(const uint8_t *p, size_t i, int samplesize)
+{
+	return samplesize == 1 ? p[i] : p[2 * i] | (p[2 * i + 1] << 8);
+}
+
+/* Channel c toggles at random, on average every 'period << c' samples */
+static void fill(uint8_t *p, size_t n, int samplesize, uint32_t period)
+{
+	uint32_t v = 0;
+	size_t i;
+	int c;
+
+	srand(1);
+	for (i = 0; i < n; i++) {
+		for (c = 0; c < samplesize * 8; c++)
+			if (rand() % (period << c) == 0)
+				v ^= 1 << c;
+
+		p[i * samplesize] = v;
+		if (samplesize == 2)
+			p[i * 2 + 1] = v >> 8;
+	}
+}
+
+static int check_transpose(const uint8_t *p, size_t n, int samplesize,
+		const uint8_t *planes, size_t stride)
+{
+	size_t i;
+	int c;
+
+	for (i = 0; i < n; i++)
+		for (c = 0; c < samplesize * 8; c++)
+			if (((planes[c * stride + i / 8] >> (i % 8)) & 1) !=
+					((sample(p, i, samplesize) >> c) & 1)) {
+				fprintf(stderr, "transpose: channel %d, sample "\
+						"%zu\n", c, i);
+				return -1;
+			}
+
+	return 0;
+}
+
+/* Runs the edge kernel in batches, and checks every edge if asked to */
+static size_t run_edges(const uint8_t *p, size_t n, int samplesize,
+		struct beaglelogic_edge *edges, int check)
+{
+	size_t i = 0, j, k, ne, consumed, total = 0;
+	uint32_t last = sample(p, 0, samplesize), prev = last;
+	size_t expected = 0;
+
+	while (i < n) {
+		ne = beaglelogic_edges(p + i * samplesize, n - i, samplesize,
+				&last, edges, EDGE_BATCH, &consumed);
+
+		for (j = 0; check && j < ne; j++) {
+			for (k = expected; k < i + edges[j].pos; k++)
+				if (sample(p, k, samplesize) != prev)
+					goto bad;
+			k = i + edges[j].pos;
+			if (edges[j].value != sample(p, k, samplesize) ||
+					edges[j].changed != (edges[j].value ^
+						prev))
+				goto bad;
+			prev = edges[j].value;
+			expected = k + 1;
+		}
+
+		total += ne;
+		i += consumed;
+	}
+
+	for (k = expected; check && k < n; k++)
+		if (sample(p, k, samplesize) != prev)
+			goto bad;
+
+	return total;
+bad:
+	fprintf(stderr, "edges: wrong around sample %zu\n", k);
+	return (size_t)-1;
+}
+
+static int check_highcount(const uint8_t *p, size_t n, int samplesize,
+		const uint64_t *counts)
+{
+	uint64_t expected;
+	size_t i;
+	int c;
+
+	for (c = 0; c < samplesize * 8; c++) {
+		for (expected = 0, i = 0; i < n; i++)
+			expected += (sample(p, i, samplesize) >> c) & 1;
+		if (counts[c] != expected) {
+			fprintf(stderr, "highcount: channel %d\n", c);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void report(const char *kernel, int samplesize, size_t n, int iter,
+		double t)
+{
+	printf("%-10s %2d bits  %8.1f MS/s  %8.1f MB/s\n", kernel,
+			samplesize * 8, n * (double)iter / t / 1e6,
+			n * (double)iter * samplesize / t / 1e6);
+}
+
+static int bench(size_t n, int samplesize, int iter, uint32_t period)
+{
+	size_t stride = (n + 7) / 8, edgecount;
+	struct beaglelogic_edge *edges;
+	uint64_t counts[16];
+	uint8_t *p, *planes;
+	double t;
+	int i;
+
+	p = malloc(n * samplesize);
+	planes = malloc(stride * samplesize * 8);
+	edges = malloc(EDGE_BATCH * sizeof(*edges));
+	if (!p || !planes || !edges)
+		return -1;
+
+	fill(p, n, samplesize, period);
+
+	/* Results first, on an awkward length for the tails */
+	beaglelogic_transpose(p, n - 13, samplesize, planes, stride);
+	memset(counts, 0, sizeof(counts));
+	beaglelogic_highcount(p, n - 13, samplesize, counts);
+	if (check_transpose(p, n - 13, samplesize, planes, stride) ||
+			check_highcount(p, n - 13, samplesize, counts) ||
+			run_edges(p, n - 13, samplesize, edges, 1) ==
+			(size_t)-1)
+		return -1;
+
+	t = now();
+	for (i = 0; i < iter; i++)
+		beaglelogic_transpose(p, n, samplesize, planes, stride);
+	report("transpose", samplesize, n, iter, now() - t);
+
+	t = now();
+	for (i = 0; i < iter; i++)
+		edgecount = run_edges(p, n, samplesize, edges, 0);
+	report("edges", samplesize, n, iter, now() - t);
+	printf("           %zu edges, one every %.1f samples\n", edgecount,
+			(double)n / edgecount);
+
+	t = now();
+	for (i = 0; i < iter; i++)
+		beaglelogic_highcount(p, n, samplesize, counts);
+	report("highcount", samplesize, n, iter, now() - t);
+
+	free(p);
+	free(planes);
+	free(edges);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = 4 << 20;
+	uint32_t period = 64;
+	int iter = 10, units[2] = { 1, 2 }, nunits = 2, opt;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "n:u:i:p:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, &end, 0);
+				if (*end == 'k')
+					n <<= 10;
+				else if (*end == 'M')
+					n <<= 20;
+				break;
+
+			case 'u':
+				nunits = 0;
+				if (strstr(optarg, "8"))
+					units[nunits++] = 1;
+				if (strstr(optarg, "16"))
+					units[nunits++] = 2;
+				break;
+
+			case 'i':
+				iter = atoi(optarg);
+				break;
+
+			case 'p':
+				period = strtoul(optarg, NULL, 0);
+				break;
+
+			default:
+				fprintf(stderr, "Usage: %s [-n samples] "\
+						"[-u 8,16] [-i iterations] "\
+						"[-p clock period]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (n < 64 || iter < 1 || !nunits || !period)
+		return 1;
+
+	for (opt = 0; opt < nunits; opt++)
+		if (bench(n, units[opt], iter, period))
+			return 1;
+
+	return 0;
+}
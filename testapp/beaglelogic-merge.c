@@ -0,0 +1,152 @@
+/*
+ * beaglelogic-merge.c
+ *
+ * Merges the captures of several BeagleLogic boards started together with
+ * the syncstart attribute (one master, the others slaves) into one stream.
+ * All boards take sample k at the same instant, so the merged sample k is
+ * the sample k of every input, first input in the lowest bits:
+ *
+ *     beaglelogic-merge -w 2 -o merged.bin board0.bin board1.bin
+ *
+ * turns two 16-bit captures into 32-bit samples, channel 16 + n being
+ * channel n of board1. An input can be given as file@skip to drop its first
+ * skip samples, e.g. to line it up with a board started later. Merging
+ * stops at the end of the shortest input.
+ *
+ * Build with:
+ *     gcc -O2 -Wall -o beaglelogic-merge beaglelogic-merge.c
+ *
+ * Copyright (C) 2014 Kumar Abhishek
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_INPUTS	8
+#define BLOCK_SAMPLES	65536
+
+struct input {
+	const char *name;
+	FILE *f;
+	uint8_t *buf;
+	size_t count;		/* Samples in buf */
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-w samplesize] [-o output] "\
+			"file[@skip] file[@skip] ...\n"
+			"    -w  bytes per sample of the inputs, 1 or 2 "\
+			"(default 1)\n"
+			"    -o  output file (default stdout)\n", prog);
+	exit(1);
+}
+
+/* Opens an input given as file[@skip] and drops the skipped samples */
+static int open_input(struct input *in, char *arg, int size)
+{
+	char *at = strrchr(arg, '@');
+	unsigned long long skip = 0;
+
+	if (at) {
+		*at = 0;
+		skip = strtoull(at + 1, NULL, 0);
+	}
+
+	in->name = arg;
+	if (!(in->f = fopen(arg, "rb"))) {
+		fprintf(stderr, "%s: %s\n", arg, strerror(errno));
+		return -1;
+	}
+
+	if (fseeko(in->f, (off_t)(skip * size), SEEK_SET)) {
+		fprintf(stderr, "%s: cannot skip %llu samples\n", arg, skip);
+		return -1;
+	}
+
+	in->buf = malloc(BLOCK_SAMPLES * size);
+	return in->buf ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct input in[MAX_INPUTS];
+	FILE *out = stdout;
+	uint8_t *merged;
+	size_t count, j;
+	uint64_t total = 0;
+	int size = 1, n = 0, i, opt;
+
+	while ((opt = getopt(argc, argv, "w:o:")) != -1) {
+		switch (opt) {
+			case 'w':
+				size = atoi(optarg);
+				break;
+
+			case 'o':
+				if (!(out = fopen(optarg, "wb"))) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if ((size != 1 && size != 2) || argc - optind < 2 ||
+			argc - optind > MAX_INPUTS)
+		usage(argv[0]);
+
+	for (; optind < argc; optind++, n++)
+		if (open_input(&in[n], argv[optind], size))
+			return 1;
+
+	merged = malloc(BLOCK_SAMPLES * size * n);
+	if (!merged)
+		return 1;
+
+	for (;;) {
+		/* Take as many samples as the shortest input has left */
+		count = BLOCK_SAMPLES;
+		for (i = 0; i < n; i++) {
+			in[i].count = fread(in[i].buf, size, count, in[i].f);
+			if (in[i].count < count)
+				count = in[i].count;
+		}
+		if (!count)
+			break;
+
+		for (j = 0; j < count; j++)
+			for (i = 0; i < n; i++)
+				memcpy(merged + (j * n + i) * size,
+						in[i].buf + j * size, size);
+
+		if (fwrite(merged, size * n, count, out) != count) {
+			perror("write");
+			return 1;
+		}
+		total += count;
+
+		if (count < BLOCK_SAMPLES)
+			break;
+	}
+
+	fprintf(stderr, "%llu samples of %d bytes merged\n",
+			(unsigned long long)total, size * n);
+
+	for (i = 0; i < n; i++)
+		fclose(in[i].f);
+	fclose(out);
+
+	return 0;
+}
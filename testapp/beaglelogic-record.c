@@ -0,0 +1,527 @@
+/*
+ * beaglelogic-record.c
+ *
+ * Records a continuous capture straight to storage, e.g. an SD card or a
+ * USB disk, for as long as the storage keeps up:
+ *
+ *     beaglelogic-record -r 10M -u 16 -t 3600 -o /media/usb/capture.blr
+ *
+ * Buffers are taken from the mmap()ed ring as they complete and copied into
+ * a few aligned slots, which a writer thread writes out with O_DIRECT so
+ * the page cache is not filled with the recording (and does not push the
+ * capture buffers out of memory). Where O_DIRECT is not supported, writes
+ * are flushed and dropped from the page cache as they go. The recording is
+ * a sequence of chunks (see struct beaglelogic_chunk), one per buffer, and
+ * keeps the position and timestamps of every buffer. -x turns it back into
+ * raw samples, reporting the gaps:
+ *
+ *     beaglelogic-record -x /media/usb/capture.blr > capture.bin
+ *
+ * The recording ends with an index (see struct beaglelogic_index): where
+ * every chunk is, which channels changed in it, and overviews of the
+ * activity of every channel at decimations of -d samples and 16, 256...
+ * times more, for viewers to seek and zoom out without reading all the
+ * samples. -d 0 leaves the index out, -i prints it.
+ *
+ * Build with:
+ *     gcc -O2 -Wall -pthread -o beaglelogic-record beaglelogic-record.c \
+ *         beaglelogic.c
+ *
+ * Copyright (C) 2014 Kumar Abhishek
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libbeaglelogic.h"
+
+#define DEFAULT_SLOTS	4
+#define DEFAULT_DECIMATION	65536
+
+/* Chunks handed from the capture loop to the writer thread: slots
+ * [written, filled) wait to be written, the others are free */
+struct writer {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct beaglelogic_chunk **slots;
+	uint32_t nslots;
+	uint32_t filled;
+	uint32_t written;
+	int done;
+	int error;		/* errno of a failed write */
+
+	int out;
+	int direct;		/* out was opened with O_DIRECT */
+	uint64_t pos;
+
+	struct beaglelogic_indexer ix;
+	int indexed;
+};
+
+static volatile sig_atomic_t stop;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s -o file [-r samplerate] [-u 8|16] "\
+			"[-t seconds] [-n slots] [-d decimation]\n"
+			"       %s -x file | -i file\n"
+			"    -o  recording to write\n"
+			"    -r  sample rate (default current)\n"
+			"    -u  sample unit (default current)\n"
+			"    -t  seconds to record (default until Ctrl-C)\n"
+			"    -n  buffers queued for the writer (default %d)\n"
+			"    -d  samples per finest overview summary, a power "\
+			"of two, 0 for no index (default %d)\n"
+			"    -x  write the samples of a recording to stdout\n"
+			"    -i  print the index of a recording\n",
+			prog, prog, DEFAULT_SLOTS, DEFAULT_DECIMATION);
+	exit(1);
+}
+
+static void stophandler(int x)
+{
+	(void)x;
+	stop = 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = arg;
+	struct beaglelogic_chunk *chunk;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (w->written == w->filled && !w->done)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->written == w->filled) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		chunk = w->slots[w->written % w->nslots];
+		pthread_mutex_unlock(&w->lock);
+
+		if (write_all(w->out, chunk, chunk->chunksize)) {
+			pthread_mutex_lock(&w->lock);
+			w->error = errno ? errno : EIO;
+			pthread_cond_broadcast(&w->cond);
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+
+		/* Without O_DIRECT, keep the recording out of the page cache */
+		if (!w->direct) {
+			sync_file_range(w->out, w->pos, chunk->chunksize,
+					SYNC_FILE_RANGE_WAIT_BEFORE |
+					SYNC_FILE_RANGE_WRITE |
+					SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(w->out, w->pos, chunk->chunksize,
+					POSIX_FADV_DONTNEED);
+		}
+
+		/* Out of memory for the index: record without it */
+		if (w->indexed && beaglelogic_index_add(&w->ix, w->pos,
+				chunk)) {
+			fprintf(stderr, "Out of memory, no index\n");
+			beaglelogic_index_free(&w->ix);
+			w->indexed = 0;
+		}
+		w->pos += chunk->chunksize;
+
+		pthread_mutex_lock(&w->lock);
+		w->written++;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return NULL;
+}
+
+/* Waits for a free slot, NULL if the writer failed */
+static struct beaglelogic_chunk *writer_get(struct writer *w)
+{
+	struct beaglelogic_chunk *chunk = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->filled - w->written == w->nslots && !w->error)
+		pthread_cond_wait(&w->cond, &w->lock);
+	if (!w->error)
+		chunk = w->slots[w->filled % w->nslots];
+	pthread_mutex_unlock(&w->lock);
+
+	return chunk;
+}
+
+static void writer_put(struct writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->filled++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int record(const char *path, uint32_t samplerate, int unit,
+		double seconds, uint32_t nslots, uint32_t decimation)
+{
+	struct pollfd pollfd;
+	struct beaglelogic_ring *ring;
+	struct beaglelogic_ring_desc *desc;
+	struct beaglelogic_chunk *chunk;
+	struct writer w;
+	enum beaglelogic_sampleunit sampleunit;
+	uint64_t bytes = 0, lost = 0, expected = 0;
+	uint32_t seq, i, size, mask = 0;
+	pthread_t thread;
+	double start, end;
+	void *mem;
+	int fd;
+
+	if ((fd = beaglelogic_open_nonblock()) < 0) {
+		perror("/dev/beaglelogic");
+		return 1;
+	}
+
+	if ((samplerate && beaglelogic_set_samplerate(fd, samplerate)) ||
+			(unit && beaglelogic_set_sampleunit(fd, unit == 8 ?
+				BL_SAMPLEUNIT_8_BITS : BL_SAMPLEUNIT_16_BITS)) ||
+			beaglelogic_set_triggerflags(fd,
+				BL_TRIGGERFLAGS_CONTINUOUS)) {
+		perror("Cannot configure BeagleLogic");
+		return 1;
+	}
+	beaglelogic_get_samplerate(fd, &samplerate);
+	beaglelogic_get_sampleunit(fd, &sampleunit);
+	beaglelogic_get_channelmask(fd, &mask);
+
+	mem = beaglelogic_mmap(fd);
+	ring = beaglelogic_mmap_ring(fd);
+	if (mem == MAP_FAILED || ring == MAP_FAILED) {
+		perror("Cannot map the BeagleLogic buffers");
+		return 1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.nslots = nslots;
+
+	/* Only plain samples can be summarized */
+	if (decimation && sampleunit != BL_SAMPLEUNIT_RLE && !mask)
+		w.indexed = !beaglelogic_index_init(&w.ix, sampleunit ==
+				BL_SAMPLEUNIT_8_BITS ? 1 : 2, decimation);
+	else if (decimation)
+		fprintf(stderr, "Packed or run length encoded samples, "\
+				"no index\n");
+
+	/* The slots are aligned, and so are all the writes */
+	w.slots = calloc(nslots, sizeof(*w.slots));
+	for (i = 0; w.slots && i < nslots; i++) {
+		if (posix_memalign((void **)&w.slots[i], BL_CHUNK_ALIGN,
+				BL_CHUNK_SIZE(ring->bufunitsize)))
+			w.slots[i] = NULL;
+		if (!w.slots[i])
+			break;
+		memset(w.slots[i], 0, BL_CHUNK_SIZE(ring->bufunitsize));
+	}
+	if (!w.slots || i < nslots) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	w.direct = 1;
+	w.out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (w.out < 0 && errno == EINVAL) {
+		fprintf(stderr, "%s: no O_DIRECT, going through the page "\
+				"cache\n", path);
+		w.direct = 0;
+		w.out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (w.out < 0) {
+		perror(path);
+		return 1;
+	}
+
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	if (pthread_create(&thread, NULL, writer_thread, &w)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	signal(SIGINT, stophandler);
+	signal(SIGTERM, stophandler);
+
+	pollfd.fd = fd;
+	pollfd.events = POLLIN | POLLRDNORM;
+
+	beaglelogic_start(fd);
+	seq = ring->consumer;
+	start = now();
+	end = start + seconds;
+
+	while (!stop && (seconds <= 0 || now() < end) && !w.error) {
+		if (poll(&pollfd, 1, 500) <= 0)
+			continue;
+
+		for (; seq != ring->producer; seq++) {
+			if (!(chunk = writer_get(&w)))
+				break;
+
+			desc = &ring->desc[seq % ring->bufcount];
+			size = desc->size;
+			chunk->offset = desc->offset;
+			chunk->tstart = desc->tstart;
+			chunk->tend = desc->tend;
+			chunk->flags = desc->flags;
+			chunk->lost = desc->lost;
+			chunk->samplerate = desc->samplerate ?
+					desc->samplerate : samplerate;
+			memcpy((uint8_t *)chunk + BL_CHUNK_ALIGN,
+					beaglelogic_ring_buffer(mem, ring, seq),
+					size);
+
+			/* Overwritten while being copied: the gap in the
+			 * offsets tells it */
+			if (desc->seq != seq)
+				continue;
+
+			chunk->magic = BL_CHUNK_MAGIC;
+			chunk->chunksize = BL_CHUNK_SIZE(size);
+			chunk->seq = seq;
+			chunk->index = seq % ring->bufcount;
+			chunk->size = size;
+			chunk->sampleunit = sampleunit;
+
+			/* Clear what a longer buffer left in the padding */
+			memset((uint8_t *)chunk + BL_CHUNK_ALIGN + size, 0,
+					chunk->chunksize - BL_CHUNK_ALIGN - size);
+			writer_put(&w);
+
+			lost += chunk->offset - expected;
+			expected = chunk->offset + size;
+			bytes += size;
+		}
+		beaglelogic_ring_ack(fd, seq);
+	}
+
+	beaglelogic_stop(fd);
+
+	pthread_mutex_lock(&w.lock);
+	w.done = 1;
+	pthread_cond_broadcast(&w.cond);
+	pthread_mutex_unlock(&w.lock);
+	pthread_join(thread, NULL);
+
+	if (!w.error && w.indexed && beaglelogic_index_write(&w.ix, w.out,
+			w.pos))
+		w.error = errno ? errno : EIO;
+	if (w.indexed)
+		beaglelogic_index_free(&w.ix);
+
+	if (w.error)
+		fprintf(stderr, "%s: %s\n", path, strerror(w.error));
+
+	fprintf(stderr, "%llu bytes recorded in %.1f s (%.2f MB/s), "\
+			"%llu bytes lost\n", (unsigned long long)bytes,
+			now() - start, bytes / (now() - start) / 1e6,
+			(unsigned long long)lost);
+
+	close(w.out);
+	beaglelogic_munmap_ring(ring);
+	beaglelogic_munmap(fd, mem);
+	beaglelogic_close(fd);
+
+	return w.error ? 1 : 0;
+}
+
+/* Prints the index of a recording */
+static int print_index(const char *path)
+{
+	struct beaglelogic_index *ix;
+	struct beaglelogic_chunkinfo *ci;
+	uint32_t i, k;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return 1;
+	}
+
+	if (!(ix = beaglelogic_index_read(fd))) {
+		fprintf(stderr, "%s: no index\n", path);
+		return 1;
+	}
+
+	printf("%llu samples of %u bytes, %u chunks\n",
+			(unsigned long long)ix->samples, ix->samplesize,
+			ix->chunks);
+	for (k = 0; k < ix->levels; k++)
+		printf("level %u: %llu summaries of %llu samples\n", k,
+				(unsigned long long)ix->level[k].count,
+				(unsigned long long)ix->level[k].samples);
+
+	ci = BL_INDEX_CHUNKS(ix);
+	for (i = 0; i < ix->chunks; i++)
+		printf("chunk %u at %llu: offset %llu, %u bytes, "\
+				"changed %04X\n", i,
+				(unsigned long long)ci[i].filepos,
+				(unsigned long long)ci[i].offset, ci[i].size,
+				ci[i].summary.changed);
+
+	free(ix);
+	close(fd);
+	return 0;
+}
+
+/* Writes the samples of a recording to stdout */
+static int extract(const char *path)
+{
+	struct beaglelogic_chunk chunk;
+	uint8_t *buf = NULL;
+	size_t bufsize = 0;
+	uint64_t expected = 0;
+	FILE *in;
+
+	if (!(in = fopen(path, "rb"))) {
+		perror(path);
+		return 1;
+	}
+
+	while (fread(&chunk, sizeof(chunk), 1, in) == 1) {
+		if (chunk.magic != BL_CHUNK_MAGIC ||
+				chunk.chunksize < BL_CHUNK_SIZE(chunk.size)) {
+			fprintf(stderr, "%s: bad chunk\n", path);
+			return 1;
+		}
+
+		if (chunk.chunksize - sizeof(chunk) > bufsize) {
+			bufsize = chunk.chunksize - sizeof(chunk);
+			if (!(buf = realloc(buf, bufsize)))
+				return 1;
+		}
+		if (fread(buf, chunk.chunksize - sizeof(chunk), 1, in) != 1) {
+			fprintf(stderr, "%s: truncated chunk\n", path);
+			return 1;
+		}
+
+		if (chunk.type != BL_CHUNK_DATA)
+			continue;
+
+		if (chunk.offset != expected)
+			fprintf(stderr, "%llu bytes missing at %llu\n",
+					(unsigned long long)(chunk.offset -
+						expected),
+					(unsigned long long)expected);
+		expected = chunk.offset + chunk.size;
+
+		if (fwrite(buf + BL_CHUNK_ALIGN - sizeof(chunk), chunk.size,
+				1, stdout) != 1) {
+			perror("write");
+			return 1;
+		}
+	}
+
+	free(buf);
+	fclose(in);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = NULL, *in = NULL;
+	uint32_t samplerate = 0, nslots = DEFAULT_SLOTS;
+	uint32_t decimation = DEFAULT_DECIMATION;
+	int info = 0;
+	double seconds = 0;
+	int unit = 0, opt;
+
+	while ((opt = getopt(argc, argv, "o:r:u:t:n:d:x:i:")) != -1) {
+		switch (opt) {
+			case 'o':
+				out = optarg;
+				break;
+
+			case 'r':
+				samplerate = strtod(optarg, NULL) *
+					(strchr(optarg, 'M') ? 1000000 :
+					 strchr(optarg, 'k') ? 1000 : 1);
+				break;
+
+			case 'u':
+				unit = atoi(optarg);
+				break;
+
+			case 't':
+				seconds = atof(optarg);
+				break;
+
+			case 'n':
+				nslots = atoi(optarg);
+				break;
+
+			case 'd':
+				decimation = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'x':
+				in = optarg;
+				break;
+
+			case 'i':
+				in = optarg;
+				info = 1;
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (in)
+		return info ? print_index(in) : extract(in);
+
+	if (!out || nslots < 2 || (unit && unit != 8 && unit != 16) ||
+			(decimation && (decimation < 32 ||
+				(decimation & (decimation - 1)))))
+		usage(argv[0]);
+
+	return record(out, samplerate, unit, seconds, nslots, decimation);
+}
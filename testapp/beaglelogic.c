@@ -36,15 +36,24 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/poll.h>
 #include <sys/types.h>
 
+#include <errno.h>
 #include <unistd.h>
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "libbeaglelogic.h"
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BL_NEON
+#endif
+
 /* BeagleLogic device node name */
 #define BEAGLELOGIC_DEV_NODE        "/dev/beaglelogic"
 #define BEAGLELOGIC_SYSFS_ATTR(a)   "/sys/devices/virtual/misc/beaglelogic/"\
@@ -68,12 +77,48 @@
 #define IOCTL_BL_SET_BUFFER_SIZE    _IOW('k', 0x26, uint32_t)
 
 #define IOCTL_BL_GET_BUFUNIT_SIZE   _IOR('k', 0x27, uint32_t)
+#define IOCTL_BL_SET_BUFUNIT_SIZE   _IOW('k', 0x27, uint32_t)
 
 #define IOCTL_BL_FILL_TEST_PATTERN   _IO('k', 0x28)
 
 #define IOCTL_BL_START               _IO('k', 0x29)
 #define IOCTL_BL_STOP                _IO('k', 0x2A)
 
+#define IOCTL_BL_RING_ACK           _IOW('k', 0x2B, uint32_t)
+
+#define IOCTL_BL_GET_TRIGGER        _IOR('k', 0x2C, struct beaglelogic_trigger)
+#define IOCTL_BL_SET_TRIGGER        _IOW('k', 0x2C, struct beaglelogic_trigger)
+
+#define IOCTL_BL_GET_WINDOW         _IOR('k', 0x2D, struct beaglelogic_window)
+#define IOCTL_BL_SET_WINDOW         _IOW('k', 0x2D, struct beaglelogic_window)
+#define IOCTL_BL_GET_TRIGGER_INFO   _IOR('k', 0x2E, struct beaglelogic_triggerinfo)
+
+#define IOCTL_BL_GET_BUFINFO        _IOWR('k', 0x2F, struct beaglelogic_bufinfo)
+#define IOCTL_BL_GET_LOST_BYTES     _IOR('k', 0x30, uint64_t)
+
+#define IOCTL_BL_GET_CHANNEL_MASK   _IOR('k', 0x31, uint32_t)
+#define IOCTL_BL_SET_CHANNEL_MASK   _IOW('k', 0x31, uint32_t)
+
+#define IOCTL_BL_GET_ACTUAL_RATE    _IOR('k', 0x32, struct beaglelogic_rate)
+
+#define IOCTL_BL_GET_EXT_CLOCK      _IOR('k', 0x33, struct beaglelogic_clock)
+#define IOCTL_BL_SET_EXT_CLOCK      _IOW('k', 0x33, struct beaglelogic_clock)
+
+#define IOCTL_BL_GET_SYNC           _IOR('k', 0x34, struct beaglelogic_sync)
+#define IOCTL_BL_SET_SYNC           _IOW('k', 0x34, struct beaglelogic_sync)
+
+#define IOCTL_BL_GET_TEST_MODE      _IOR('k', 0x35, uint32_t)
+#define IOCTL_BL_SET_TEST_MODE      _IOW('k', 0x35, uint32_t)
+
+#define IOCTL_BL_REARM              _IO('k', 0x36)
+
+/* Defaults and bounds of beaglelogic_autotune */
+#define BL_TUNE_MAXIRQRATE          200
+#define BL_TUNE_MAXLATENCY          100
+#define BL_TUNE_CALIBRATION         2000
+#define BL_TUNE_MINCOUNT            4
+#define BL_TUNE_MAXUNIT             (4 * 1024 * 1024)
+
 int beaglelogic_open(void) {
 	return open(BEAGLELOGIC_DEV_NODE, O_RDONLY);
 }
@@ -107,6 +152,34 @@ int beaglelogic_set_samplerate(int fd, uint32_t samplerate) {
 	return ioctl(fd, IOCTL_BL_SET_SAMPLE_RATE, samplerate);
 }
 
+int beaglelogic_get_actual_rate(int fd, struct beaglelogic_rate *rate) {
+	return ioctl(fd, IOCTL_BL_GET_ACTUAL_RATE, rate);
+}
+
+int beaglelogic_get_extclock(int fd, struct beaglelogic_clock *clock) {
+	return ioctl(fd, IOCTL_BL_GET_EXT_CLOCK, clock);
+}
+
+int beaglelogic_set_extclock(int fd, struct beaglelogic_clock *clock) {
+	return ioctl(fd, IOCTL_BL_SET_EXT_CLOCK, clock);
+}
+
+int beaglelogic_get_sync(int fd, struct beaglelogic_sync *sync) {
+	return ioctl(fd, IOCTL_BL_GET_SYNC, sync);
+}
+
+int beaglelogic_set_sync(int fd, struct beaglelogic_sync *sync) {
+	return ioctl(fd, IOCTL_BL_SET_SYNC, sync);
+}
+
+int beaglelogic_get_testmode(int fd, uint32_t *testmode) {
+	return ioctl(fd, IOCTL_BL_GET_TEST_MODE, testmode);
+}
+
+int beaglelogic_set_testmode(int fd, uint32_t testmode) {
+	return ioctl(fd, IOCTL_BL_SET_TEST_MODE, testmode);
+}
+
 int beaglelogic_get_sampleunit(int fd,
 		enum beaglelogic_sampleunit *sampleunit) {
 	return ioctl(fd, IOCTL_BL_GET_SAMPLE_UNIT, sampleunit);
@@ -117,6 +190,14 @@ int beaglelogic_set_sampleunit(int fd,
 	return ioctl(fd, IOCTL_BL_SET_SAMPLE_UNIT, sampleunit);
 }
 
+int beaglelogic_get_channelmask(int fd, uint32_t *channelmask) {
+	return ioctl(fd, IOCTL_BL_GET_CHANNEL_MASK, channelmask);
+}
+
+int beaglelogic_set_channelmask(int fd, uint32_t channelmask) {
+	return ioctl(fd, IOCTL_BL_SET_CHANNEL_MASK, channelmask);
+}
+
 int beaglelogic_get_triggerflags(int fd,
 		enum beaglelogic_triggerflags *triggerflags) {
 	return ioctl(fd, IOCTL_BL_GET_TRIGGER_FLAGS, triggerflags);
@@ -127,6 +208,36 @@ int beaglelogic_set_triggerflags(int fd,
 	return ioctl(fd, IOCTL_BL_SET_TRIGGER_FLAGS, triggerflags);
 }
 
+int beaglelogic_get_trigger(int fd, struct beaglelogic_trigger *trigger) {
+	return ioctl(fd, IOCTL_BL_GET_TRIGGER, trigger);
+}
+
+int beaglelogic_set_trigger(int fd, struct beaglelogic_trigger *trigger) {
+	return ioctl(fd, IOCTL_BL_SET_TRIGGER, trigger);
+}
+
+int beaglelogic_get_window(int fd, struct beaglelogic_window *window) {
+	return ioctl(fd, IOCTL_BL_GET_WINDOW, window);
+}
+
+int beaglelogic_set_window(int fd, struct beaglelogic_window *window) {
+	return ioctl(fd, IOCTL_BL_SET_WINDOW, window);
+}
+
+int beaglelogic_get_triggerinfo(int fd, struct beaglelogic_triggerinfo *info) {
+	return ioctl(fd, IOCTL_BL_GET_TRIGGER_INFO, info);
+}
+
+int beaglelogic_get_bufinfo(int fd, uint32_t index,
+		struct beaglelogic_bufinfo *info) {
+	info->index = index;
+	return ioctl(fd, IOCTL_BL_GET_BUFINFO, info);
+}
+
+int beaglelogic_get_lostbytes(int fd, uint64_t *lostbytes) {
+	return ioctl(fd, IOCTL_BL_GET_LOST_BYTES, lostbytes);
+}
+
 int beaglelogic_getlasterror(void) {
 	int fd = open(BEAGLELOGIC_SYSFS_ATTR(lasterror), O_RDONLY);
 	char buf[16];
@@ -153,6 +264,10 @@ int beaglelogic_stop(int fd) {
 	return ioctl(fd, IOCTL_BL_STOP);
 }
 
+int beaglelogic_rearm(int fd) {
+	return ioctl(fd, IOCTL_BL_REARM);
+}
+
 int beaglelogic_memcacheinvalidate(int fd) {
 	return ioctl(fd, IOCTL_BL_CACHE_INVALIDATE);
 }
@@ -163,6 +278,10 @@ int beaglelogic_getbufunitsize(int fd) {
 	return sz;
 }
 
+int beaglelogic_set_bufunitsize(int fd, uint32_t bufunitsize) {
+	return ioctl(fd, IOCTL_BL_SET_BUFUNIT_SIZE, bufunitsize);
+}
+
 void * beaglelogic_mmap(int fd) {
 	size_t sz;
 	void *addr;
@@ -186,18 +305,1418 @@ int beaglelogic_munmap(int fd, void *addr) {
 
 int beaglelogic_waitfornextbuffer(void) {
 	int fd = open(BEAGLELOGIC_SYSFS_ATTR(state), O_RDONLY);
+	struct pollfd pollfd;
 	char buf[16];
-	char *endptr;
-	int nextbuf, ret;
+	int ret;
 
-	if (!fd)
+	if (fd < 0)
 		return -1;
 
-	if ((ret = read(fd, buf, 16)) < 0)
+	/* The read blocks while running. Otherwise sleep until the driver
+	 * notifies a change of state, instead of having the caller spin */
+	ret = read(fd, buf, sizeof(buf) - 1);
+	if (ret > 0 && buf[0] == '-') {
+		pollfd.fd = fd;
+		pollfd.events = POLLPRI | POLLERR;
+		if (poll(&pollfd, 1, -1) > 0 && lseek(fd, 0, SEEK_SET) == 0)
+			ret = read(fd, buf, sizeof(buf) - 1);
+	}
+	close(fd);
+
+	if (ret <= 0)
+		return -1;
+	buf[ret] = 0;
+
+	return strtol(buf, NULL, 10);
+}
+
+/* Size of the ring control area mapping for a given buffer count */
+static size_t beaglelogic_ring_mapsize(uint32_t bufcount) {
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	size_t sz = sizeof(struct beaglelogic_ring) +
+		bufcount * sizeof(struct beaglelogic_ring_desc);
+
+	return (sz + pagesz - 1) & ~(pagesz - 1);
+}
+
+struct beaglelogic_ring *beaglelogic_mmap_ring(int fd) {
+	uint32_t sz, unitsz;
+
+	if (beaglelogic_get_buffersize(fd, &sz))
+		return MAP_FAILED;
+
+	if (ioctl(fd, IOCTL_BL_GET_BUFUNIT_SIZE, &unitsz) || unitsz == 0)
+		return MAP_FAILED;
+
+	return mmap(NULL, beaglelogic_ring_mapsize(sz / unitsz), PROT_READ,
+			MAP_SHARED, fd, BL_RING_MMAP_OFFSET);
+}
+
+int beaglelogic_munmap_ring(struct beaglelogic_ring *ring) {
+	return munmap(ring, beaglelogic_ring_mapsize(ring->bufcount));
+}
+
+void *beaglelogic_ring_buffer(void *mem, struct beaglelogic_ring *ring,
+		uint32_t seq) {
+	return (uint8_t *)mem + (size_t)(seq % ring->bufcount) *
+		ring->bufunitsize;
+}
+
+int beaglelogic_ring_ack(int fd, uint32_t seq) {
+	return ioctl(fd, IOCTL_BL_RING_ACK, seq);
+}
+
+int beaglelogic_stream_open(struct beaglelogic_stream *s, int fd) {
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+
+	s->mem = beaglelogic_mmap(fd);
+	if (s->mem == MAP_FAILED)
+		return -1;
+
+	s->ring = beaglelogic_mmap_ring(fd);
+	if (s->ring == MAP_FAILED) {
+		beaglelogic_munmap(fd, s->mem);
 		return -1;
+	}
 
+	s->seq = s->acked = s->ring->consumer;
+	return 0;
+}
+
+void beaglelogic_stream_close(struct beaglelogic_stream *s) {
+	beaglelogic_munmap_ring(s->ring);
+	beaglelogic_munmap(s->fd, s->mem);
+}
+
+int beaglelogic_stream_next(struct beaglelogic_stream *s,
+		struct beaglelogic_buffer *buf) {
+	struct beaglelogic_ring *ring = s->ring;
+	struct beaglelogic_ring_desc *desc;
+
+	if (ring->state == STATE_BL_ERROR) {
+		errno = EIO;
+		return -1;
+	}
+
+	/* Pairs with the barrier of the driver before it moves producer */
+	while (s->seq != __atomic_load_n(&ring->producer, __ATOMIC_ACQUIRE)) {
+		desc = &ring->desc[s->seq % ring->bufcount];
+		buf->seq = s->seq++;
+
+		/* Overwritten already: the gap in the offsets tells it */
+		if (desc->seq != buf->seq)
+			continue;
+
+		buf->data = beaglelogic_ring_buffer(s->mem, ring, buf->seq);
+		buf->size = desc->size;
+		buf->flags = desc->flags;
+		buf->lost = desc->lost;
+		buf->offset = desc->offset;
+		buf->tstart = desc->tstart;
+		buf->tend = desc->tend;
+		buf->samplerate = desc->samplerate;
+		return 1;
+	}
+
+	return 0;
+}
+
+int beaglelogic_stream_valid(struct beaglelogic_stream *s,
+		const struct beaglelogic_buffer *buf) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return s->ring->desc[buf->seq % s->ring->bufcount].seq == buf->seq;
+}
+
+int beaglelogic_stream_release(struct beaglelogic_stream *s) {
+	if (s->acked == s->seq)
+		return 0;
+
+	if (beaglelogic_ring_ack(s->fd, s->seq))
+		return -1;
+
+	s->acked = s->seq;
+	return 0;
+}
+
+int beaglelogic_stream_dispatch(struct beaglelogic_stream *s,
+		beaglelogic_buffer_cb cb, void *arg) {
+	struct beaglelogic_buffer buf;
+	int count = 0, ret;
+
+	while ((ret = beaglelogic_stream_next(s, &buf)) > 0) {
+		count++;
+		if (cb(s, &buf, arg))
+			break;
+	}
+
+	/* Handed back in one go, the driver posts them again */
+	if (beaglelogic_stream_release(s) || ret < 0)
+		return -1;
+
+	return count;
+}
+
+static uint64_t beaglelogic_usecs(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Reads one counter of the stats attribute */
+static int beaglelogic_read_stat(const char *name, uint64_t *val) {
+	int fd = open(BEAGLELOGIC_SYSFS_ATTR(stats), O_RDONLY);
+	size_t len = strlen(name);
+	char buf[512], *p;
+	int ret;
+
+	if (fd < 0)
+		return -1;
+
+	ret = read(fd, buf, sizeof(buf) - 1);
 	close(fd);
-	nextbuf = strtoul(buf, &endptr, 10);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = 0;
+
+	/* One "name value" pair per line */
+	for (p = buf; p; p = strchr(p, '\n')) {
+		if (*p == '\n')
+			p++;
+
+		if (!strncmp(p, name, len) && p[len] == ' ') {
+			*val = strtoull(p + len + 1, NULL, 10);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Runs the calibration capture of beaglelogic_autotune */
+static int beaglelogic_calibrate(int fd, struct beaglelogic_tune *tune,
+		uint32_t calibration, beaglelogic_buffer_cb cb, void *arg,
+		uint64_t *elapsed, uint64_t *busy) {
+	struct pollfd pollfd = { fd, POLLIN | POLLRDNORM, 0 };
+	struct beaglelogic_stream s;
+	struct beaglelogic_buffer buf;
+	uint64_t t0, t, end = 0, consumed = 0;
+	uint32_t lag;
+	int ret = 0, stop;
+
+	if (beaglelogic_stream_open(&s, fd))
+		return -1;
+
+	t0 = beaglelogic_usecs();
+	if (beaglelogic_start(fd)) {
+		beaglelogic_stream_close(&s);
+		return -1;
+	}
+
+	while (ret >= 0 && beaglelogic_usecs() - t0 < calibration * 1000ULL) {
+		if (poll(&pollfd, 1, 100) <= 0)
+			continue;
+
+		/* The backlog this consumer let build up */
+		lag = __atomic_load_n(&s.ring->producer, __ATOMIC_ACQUIRE) -
+			s.seq;
+		if (lag > s.ring->bufcount)
+			lag = s.ring->bufcount;
+		if (lag * s.ring->bufunitsize > tune->maxlag)
+			tune->maxlag = lag * s.ring->bufunitsize;
+
+		stop = 0;
+		while (!stop && (ret = beaglelogic_stream_next(&s, &buf)) > 0) {
+			consumed += buf.size;
+			end = buf.offset + buf.size;
+
+			if (!cb)
+				continue;
+
+			t = beaglelogic_usecs();
+			stop = cb(&s, &buf, arg);
+			t = beaglelogic_usecs() - t;
+
+			*busy += t;
+			if (t > tune->stall)
+				tune->stall = t;
+		}
+
+		if (beaglelogic_stream_release(&s))
+			ret = -1;
+	}
+
+	*elapsed = beaglelogic_usecs() - t0;
+	beaglelogic_stop(fd);
+	beaglelogic_stream_close(&s);
+
+	if (ret < 0)
+		return -1;
+
+	if (!consumed) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	/* Lost is what the stream offsets skipped over */
+	tune->byterate = end * 1000000 / *elapsed;
+	tune->lostbytes = end - consumed;
+	return 0;
+}
+
+int beaglelogic_autotune(int fd, struct beaglelogic_tune *tune,
+		beaglelogic_buffer_cb cb, void *arg) {
+	enum beaglelogic_triggerflags flags;
+	uint64_t irqs0, irqs1, bufs0, bufs1, elapsed = 0, busy = 0, need;
+	uint32_t maxirqrate, maxlatency, calibration, maxmem, pagesz, unit;
+	uint32_t count, size;
+	double irqsperunit = 1;
+	int stats, ret, i;
+
+	maxirqrate = tune->maxirqrate ? tune->maxirqrate : BL_TUNE_MAXIRQRATE;
+	maxlatency = tune->maxlatency ? tune->maxlatency : BL_TUNE_MAXLATENCY;
+	calibration = tune->calibration ? tune->calibration :
+		BL_TUNE_CALIBRATION;
+	maxmem = tune->maxmem;
+	if (!maxmem && beaglelogic_get_buffersize(fd, &maxmem))
+		return -1;
+
+	tune->maxlag = tune->stall = 0;
+
+	/* Calibrated in continuous mode, one-shot would end too early */
+	if (beaglelogic_get_triggerflags(fd, &flags) ||
+			beaglelogic_set_triggerflags(fd,
+				BL_TRIGGERFLAGS_CONTINUOUS))
+		return -1;
+
+	/* The interrupts per unit depend on the coalescing. Without the
+	 * stats attribute every unit is taken to raise one */
+	stats = !beaglelogic_read_stat("irqs", &irqs0) &&
+		!beaglelogic_read_stat("buffers", &bufs0);
+
+	ret = beaglelogic_calibrate(fd, tune, calibration, cb, arg, &elapsed,
+			&busy);
+	beaglelogic_set_triggerflags(fd, flags);
+	if (ret)
+		return -1;
+
+	if (stats && !beaglelogic_read_stat("irqs", &irqs1) &&
+			!beaglelogic_read_stat("buffers", &bufs1) &&
+			bufs1 > bufs0) {
+		irqsperunit = (double)(irqs1 - irqs0) / (bufs1 - bufs0);
+		tune->irqrate = (irqs1 - irqs0) * 1000000 / elapsed;
+	} else {
+		tune->irqrate = tune->byterate /
+			beaglelogic_getbufunitsize(fd);
+	}
+
+	/* Smallest unit within the interrupt budget, unless it takes too
+	 * long to fill in. Whole pages, at least 4 of them fitting in */
+	pagesz = sysconf(_SC_PAGESIZE);
+	unit = tune->byterate * irqsperunit / maxirqrate;
+	if (unit > tune->byterate * maxlatency / 1000)
+		unit = tune->byterate * maxlatency / 1000;
+	if (unit > BL_TUNE_MAXUNIT)
+		unit = BL_TUNE_MAXUNIT;
+	if (unit > maxmem / BL_TUNE_MINCOUNT)
+		unit = maxmem / BL_TUNE_MINCOUNT;
+	unit = (unit + pagesz - 1) & ~(pagesz - 1);
+	if (!unit)
+		unit = pagesz;
+
+	/* Room for twice the worst backlog, from the ring or from the
+	 * longest callback, plus the unit being filled and the next one */
+	need = tune->maxlag;
+	if (need < tune->byterate * tune->stall / 1000000)
+		need = tune->byterate * tune->stall / 1000000;
+	need = 2 * need + 2 * unit;
+
+	count = (need + unit - 1) / unit;
+	if (count < BL_TUNE_MINCOUNT)
+		count = BL_TUNE_MINCOUNT;
+
+	/* A consumer busy nearly all of the time falls behind, whatever the
+	 * buffers. So does one needing more memory than allowed */
+	tune->sustainable = busy < elapsed * 9 / 10;
+	if ((uint64_t)count * unit > maxmem) {
+		count = maxmem / unit;
+		tune->sustainable = 0;
+	}
+
+	/* The PRU buffer list bounds the count: trade it for larger units */
+	for (i = 0; i < 4; i++) {
+		if (!beaglelogic_set_bufunitsize(fd, unit) &&
+				!beaglelogic_set_buffersize(fd, count * unit))
+			break;
+
+		if (errno != ENOMEM || count <= BL_TUNE_MINCOUNT)
+			return -1;
+
+		count = (count + 1) / 2;
+		unit *= 2;
+	}
+	if (i == 4)
+		return -1;
+
+	/* The driver may have split the units to allocate them */
+	tune->bufunitsize = beaglelogic_getbufunitsize(fd);
+	if (beaglelogic_get_buffersize(fd, &size) || !tune->bufunitsize)
+		return -1;
+	tune->bufcount = size / tune->bufunitsize;
+
+	return 0;
+}
+
+size_t beaglelogic_rle_expand(const uint32_t *rec, size_t nrec,
+		uint16_t *out, size_t nsamples, size_t *consumed) {
+	size_t i, j, n = 0;
+	uint32_t count;
+	uint16_t value;
+
+	for (i = 0; i < nrec; i++) {
+		count = BL_RLE_COUNT(rec[i]);
+		if (n + count > nsamples)
+			break;
+
+		value = BL_RLE_VALUE(rec[i]);
+		for (j = 0; j < count; j++)
+			out[n++] = value;
+	}
+
+	if (consumed)
+		*consumed = i;
+
+	return n;
+}
+
+size_t beaglelogic_unpack(const void *in, size_t len, uint32_t channelmask,
+		uint16_t *out) {
+	const uint8_t *p = in;
+	uint32_t shift = 0, width = 0, bits = 0, mask;
+	size_t i, n = 0;
+	int k;
+
+	if (!channelmask)
+		return 0;
+
+	while (!(channelmask & (1 << shift)))
+		shift++;
+	while (channelmask & (1 << (shift + width)))
+		width++;
+	mask = (1 << width) - 1;
+
+	for (i = 0; i < len; i++) {
+		bits = p[i];
+		for (k = 0; k < 8; k += width)
+			out[n++] = ((bits >> k) & mask) << shift;
+	}
+
+	return n;
+}
+
+/* Sample to channel kernels: 64 samples at a time are turned into one
+ * 64-bit word per channel (sample i in bit i), 8 channels (one byte of the
+ * samples) at a time. Each 8 x 8 bit block is transposed with three delta
+ * swaps, which NEON does on two blocks at once */
+static inline uint64_t beaglelogic_transpose8x8(uint64_t x) {
+	uint64_t t;
+
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x ^= t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x ^= t ^ (t << 28);
+
+	return x;
+}
+
+static inline uint32_t beaglelogic_sample(const uint8_t *p, size_t i,
+		int samplesize) {
+	return samplesize == 1 ? p[i] : p[2 * i] | (p[2 * i + 1] << 8);
+}
+
+#if defined(BL_NEON)
+#define BL_DELTA_SWAP(x, t, s, m) do { \
+		t = vandq_u64(veorq_u64(x, vshrq_n_u64(x, s)), \
+				vdupq_n_u64(m)); \
+		x = veorq_u64(x, veorq_u64(t, vshlq_n_u64(t, s))); \
+	} while (0)
+
+/* Transposes 64 samples of byte 'hi' of the samples: out[c] is channel
+ * 8 * hi + c, sample i in bit (i % 8) of byte i / 8 */
+static inline void beaglelogic_transpose64(const uint8_t *in, int samplesize,
+		int hi, uint8x8_t out[8]) {
+	uint8x16_t q[4];
+	uint8x8x2_t t01, t23, t45, t67;
+	uint16x4x2_t u02, u13, u46, u57;
+	uint32x2x2_t v04, v15, v26, v37;
+	uint64x2_t x, t;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		q[i] = (samplesize == 1) ? vld1q_u8(in + 16 * i) :
+			vld2q_u8(in + 32 * i).val[hi];
+
+		x = vreinterpretq_u64_u8(q[i]);
+		BL_DELTA_SWAP(x, t, 7, 0x00AA00AA00AA00AAULL);
+		BL_DELTA_SWAP(x, t, 14, 0x0000CCCC0000CCCCULL);
+		BL_DELTA_SWAP(x, t, 28, 0x00000000F0F0F0F0ULL);
+		q[i] = vreinterpretq_u8_u64(x);
+	}
+
+	/* Byte n of block b to byte b of channel n: 8 x 8 byte transpose */
+	t01 = vtrn_u8(vget_low_u8(q[0]), vget_high_u8(q[0]));
+	t23 = vtrn_u8(vget_low_u8(q[1]), vget_high_u8(q[1]));
+	t45 = vtrn_u8(vget_low_u8(q[2]), vget_high_u8(q[2]));
+	t67 = vtrn_u8(vget_low_u8(q[3]), vget_high_u8(q[3]));
+
+	u02 = vtrn_u16(vreinterpret_u16_u8(t01.val[0]),
+			vreinterpret_u16_u8(t23.val[0]));
+	u13 = vtrn_u16(vreinterpret_u16_u8(t01.val[1]),
+			vreinterpret_u16_u8(t23.val[1]));
+	u46 = vtrn_u16(vreinterpret_u16_u8(t45.val[0]),
+			vreinterpret_u16_u8(t67.val[0]));
+	u57 = vtrn_u16(vreinterpret_u16_u8(t45.val[1]),
+			vreinterpret_u16_u8(t67.val[1]));
+
+	v04 = vtrn_u32(vreinterpret_u32_u16(u02.val[0]),
+			vreinterpret_u32_u16(u46.val[0]));
+	v26 = vtrn_u32(vreinterpret_u32_u16(u02.val[1]),
+			vreinterpret_u32_u16(u46.val[1]));
+	v15 = vtrn_u32(vreinterpret_u32_u16(u13.val[0]),
+			vreinterpret_u32_u16(u57.val[0]));
+	v37 = vtrn_u32(vreinterpret_u32_u16(u13.val[1]),
+			vreinterpret_u32_u16(u57.val[1]));
+
+	out[0] = vreinterpret_u8_u32(v04.val[0]);
+	out[1] = vreinterpret_u8_u32(v15.val[0]);
+	out[2] = vreinterpret_u8_u32(v26.val[0]);
+	out[3] = vreinterpret_u8_u32(v37.val[0]);
+	out[4] = vreinterpret_u8_u32(v04.val[1]);
+	out[5] = vreinterpret_u8_u32(v15.val[1]);
+	out[6] = vreinterpret_u8_u32(v26.val[1]);
+	out[7] = vreinterpret_u8_u32(v37.val[1]);
+}
+
+/* 16 bytes of samples all equal to 'value' */
+static inline int beaglelogic_unchanged(const uint8_t *p, int samplesize,
+		uint32_t value) {
+	uint8x16_t eq;
+	uint8x8_t m;
+
+	eq = (samplesize == 1) ? vceqq_u8(vld1q_u8(p), vdupq_n_u8(value)) :
+		vreinterpretq_u8_u16(vceqq_u16(vld1q_u16((const uint16_t *)p),
+				vdupq_n_u16(value)));
+	m = vand_u8(vget_low_u8(eq), vget_high_u8(eq));
+
+	return vget_lane_u64(vreinterpret_u64_u8(m), 0) == ~0ULL;
+}
+#else
+static inline void beaglelogic_transpose64(const uint8_t *in, int samplesize,
+		int hi, uint64_t out[8]) {
+	uint64_t x;
+	int b, c, i;
+
+	memset(out, 0, 8 * sizeof(*out));
+	for (b = 0; b < 8; b++) {
+		if (samplesize == 1) {
+			memcpy(&x, in + 8 * b, 8);
+		} else {
+			for (x = 0, i = 0; i < 8; i++)
+				x |= (uint64_t)in[16 * b + 2 * i + hi] << (8 * i);
+		}
+
+		x = beaglelogic_transpose8x8(x);
+		for (c = 0; c < 8; c++)
+			out[c] |= ((x >> (8 * c)) & 0xFF) << (8 * b);
+	}
+}
+
+static inline int beaglelogic_unchanged(const uint8_t *p, int samplesize,
+		uint32_t value) {
+	uint32_t w[4], pattern = value * (samplesize == 1 ? 0x01010101 :
+			0x00010001);
+
+	memcpy(w, p, sizeof(w));
+	return w[0] == pattern && w[1] == pattern && w[2] == pattern &&
+		w[3] == pattern;
+}
+#endif
+
+void beaglelogic_transpose(const void *samples, size_t n, int samplesize,
+		uint8_t *planes, size_t stride) {
+	const uint8_t *p = samples;
+	int c, hi, channels = samplesize * 8;
+	size_t i = 0;
+#if defined(BL_NEON)
+	uint8x8_t out[8];
+#else
+	uint64_t out[8];
+#endif
+
+	for (; i + 64 <= n; i += 64) {
+		for (hi = 0; hi < samplesize; hi++) {
+			beaglelogic_transpose64(p + i * samplesize, samplesize,
+					hi, out);
+			for (c = 0; c < 8; c++)
+#if defined(BL_NEON)
+				vst1_u8(planes + (8 * hi + c) * stride + i / 8,
+						out[c]);
+#else
+				memcpy(planes + (8 * hi + c) * stride + i / 8,
+						&out[c], 8);
+#endif
+		}
+	}
+
+	/* Tail, bit by bit */
+	for (c = 0; c < channels; c++)
+		memset(planes + c * stride + i / 8, 0, (n - i + 7) / 8);
+	for (; i < n; i++)
+		for (c = 0; c < channels; c++)
+			if (beaglelogic_sample(p, i, samplesize) & (1 << c))
+				planes[c * stride + i / 8] |= 1 << (i % 8);
+}
+
+size_t beaglelogic_edges(const void *samples, size_t n, int samplesize,
+		uint32_t *last, struct beaglelogic_edge *edges, size_t maxedges,
+		size_t *consumed) {
+	const uint8_t *p = samples;
+	size_t i = 0, end, ne = 0, skip = 16 / samplesize;
+	uint32_t v, prev = *last;
+
+	while (i < n) {
+		/* Inputs mostly hold still: skip 16 bytes at a time */
+		if (i + skip <= n && beaglelogic_unchanged(p + i * samplesize,
+					samplesize, prev)) {
+			i += skip;
+			continue;
+		}
+
+		end = (i + skip < n) ? i + skip : n;
+		for (; i < end; i++) {
+			v = beaglelogic_sample(p, i, samplesize);
+			if (v == prev)
+				continue;
+			if (ne == maxedges)
+				goto out;
+
+			edges[ne].pos = i;
+			edges[ne].value = v;
+			edges[ne].changed = v ^ prev;
+			ne++;
+			prev = v;
+		}
+	}
+out:
+	*last = prev;
+	if (consumed)
+		*consumed = i;
+
+	return ne;
+}
+
+void beaglelogic_highcount(const void *samples, size_t n, int samplesize,
+		uint64_t *counts) {
+	const uint8_t *p = samples;
+	int c, hi, channels = samplesize * 8;
+	size_t i = 0;
+#if defined(BL_NEON)
+	uint16x4_t acc[16];
+	uint8x8_t out[8];
+	uint32_t blocks = 0;
+
+	/* Popcounts of 8 bytes add up to 16 per lane and block: 16-bit
+	 * lanes are flushed well before they can overflow */
+	for (c = 0; c < channels; c++)
+		acc[c] = vdup_n_u16(0);
+
+	for (; i + 64 <= n; i += 64) {
+		for (hi = 0; hi < samplesize; hi++) {
+			beaglelogic_transpose64(p + i * samplesize, samplesize,
+					hi, out);
+			for (c = 0; c < 8; c++)
+				acc[8 * hi + c] = vpadal_u8(acc[8 * hi + c],
+						vcnt_u8(out[c]));
+		}
+
+		if (++blocks == 2048 || i + 128 > n) {
+			for (c = 0; c < channels; c++) {
+				counts[c] += vget_lane_u64(vpaddl_u32(
+						vpaddl_u16(acc[c])), 0);
+				acc[c] = vdup_n_u16(0);
+			}
+			blocks = 0;
+		}
+	}
+#else
+	uint64_t out[8];
+
+	for (; i + 64 <= n; i += 64) {
+		for (hi = 0; hi < samplesize; hi++) {
+			beaglelogic_transpose64(p + i * samplesize, samplesize,
+					hi, out);
+			for (c = 0; c < 8; c++)
+				counts[8 * hi + c] += __builtin_popcountll(out[c]);
+		}
+	}
+#endif
+
+	for (; i < n; i++)
+		for (c = 0; c < channels; c++)
+			counts[c] += (beaglelogic_sample(p, i, samplesize) >> c) & 1;
+}
+
+/* Decoder states */
+enum {
+	BL_DEC_IDLE,
+	BL_DEC_BUSY,		/* UART frame, SPI selected */
+	BL_DEC_ADDRESS,		/* I2C address byte */
+	BL_DEC_DATA		/* I2C data bytes */
+};
+
+static void beaglelogic_emit(struct beaglelogic_event *ev, size_t *nev,
+		uint64_t pos, int type, int flags, int bits, uint32_t data) {
+	ev += (*nev)++;
+	ev->pos = pos;
+	ev->type = type;
+	ev->flags = flags;
+	ev->bits = bits;
+	ev->data = data;
+}
+
+static int beaglelogic_parse_channel(const char *value, int *ch) {
+	char *end;
+	long v = strtol(value, &end, 0);
+
+	if (*end || v < 0 || v > 15)
+		return -1;
+	*ch = v;
+	return 0;
+}
+
+int beaglelogic_decoder_parse(struct beaglelogic_decoder *d,
+		const char *spec) {
+	char buf[128], *opt, *value, *save;
+	int ret = 0;
+
+	if (strlen(spec) >= sizeof(buf))
+		return -1;
+	strcpy(buf, spec);
+
+	memset(d, 0, sizeof(*d));
+	d->baud = 115200;
+	d->databits = 8;
+	d->mosi = 1;
+	d->miso = d->cs = -1;
+	d->wordbits = 8;
+	d->sda = 1;
+
+	opt = strtok_r(buf, ":", &save);
+	if (!opt)
+		return -1;
+	if (!strcmp(opt, "uart"))
+		d->protocol = BL_DECODE_UART;
+	else if (!strcmp(opt, "spi"))
+		d->protocol = BL_DECODE_SPI;
+	else if (!strcmp(opt, "i2c"))
+		d->protocol = BL_DECODE_I2C;
+	else
+		return -1;
+
+	while (!ret && (opt = strtok_r(NULL, ",", &save))) {
+		if (!(value = strchr(opt, '=')))
+			return -1;
+		*value++ = '\0';
+
+		if (!strcmp(opt, "rx"))
+			ret = beaglelogic_parse_channel(value, &d->rx);
+		else if (!strcmp(opt, "clk"))
+			ret = beaglelogic_parse_channel(value, &d->clk);
+		else if (!strcmp(opt, "mosi"))
+			ret = beaglelogic_parse_channel(value, &d->mosi);
+		else if (!strcmp(opt, "miso"))
+			ret = beaglelogic_parse_channel(value, &d->miso);
+		else if (!strcmp(opt, "cs"))
+			ret = beaglelogic_parse_channel(value, &d->cs);
+		else if (!strcmp(opt, "scl"))
+			ret = beaglelogic_parse_channel(value, &d->scl);
+		else if (!strcmp(opt, "sda"))
+			ret = beaglelogic_parse_channel(value, &d->sda);
+		else if (!strcmp(opt, "baud"))
+			ret = (d->baud = strtoul(value, NULL, 0)) ? 0 : -1;
+		else if (!strcmp(opt, "bits")) {
+			d->databits = d->wordbits = atoi(value);
+			ret = (d->databits < 1 || d->databits > 16) ? -1 : 0;
+		} else if (!strcmp(opt, "parity")) {
+			if (!strcmp(value, "odd"))
+				d->parity = 1;
+			else if (!strcmp(value, "even"))
+				d->parity = 2;
+			else if (strcmp(value, "none"))
+				ret = -1;
+		} else if (!strcmp(opt, "mode")) {
+			d->cpol = (atoi(value) >> 1) & 1;
+			d->cpha = atoi(value) & 1;
+			ret = (atoi(value) < 0 || atoi(value) > 3) ? -1 : 0;
+		} else if (!strcmp(opt, "order")) {
+			d->lsbfirst = !strcmp(value, "lsb");
+			ret = (d->lsbfirst || !strcmp(value, "msb")) ? 0 : -1;
+		} else
+			ret = -1;
+	}
+
+	/* A UART character is at most 9 bits */
+	if (d->protocol == BL_DECODE_UART && d->databits > 9)
+		ret = -1;
+
+	return ret;
+}
+
+int beaglelogic_decoder_start(struct beaglelogic_decoder *d,
+		uint32_t samplerate, int samplesize) {
+	int channels = samplesize * 8;
+
+	if (samplesize != 1 && samplesize != 2)
+		return -1;
+
+	switch (d->protocol) {
+	case BL_DECODE_UART:
+		if (d->rx >= channels || !d->baud ||
+				samplerate / d->baud < 4)
+			return -1;
+		d->period = ((uint64_t)samplerate << 16) / d->baud;
+		break;
+
+	case BL_DECODE_SPI:
+		if (d->clk >= channels || d->mosi >= channels ||
+				d->miso >= channels || d->cs >= channels)
+			return -1;
+		break;
+
+	case BL_DECODE_I2C:
+		if (d->scl >= channels || d->sda >= channels)
+			return -1;
+		break;
+
+	default:
+		return -1;
+	}
+
+	d->samplesize = samplesize;
+	d->pos = 0;
+	d->value = 0;
+	d->started = 0;
+	d->state = BL_DEC_IDLE;
+	d->bit = 0;
+	d->shift = d->shift2 = 0;
+
+	return 0;
+}
+
+/* UART bits are taken at their centers, which are reached between edges:
+ * this goes through the sample points before sample 'pos', during which
+ * the inputs are d->value */
+static void beaglelogic_uart_advance(struct beaglelogic_decoder *d,
+		uint64_t pos, struct beaglelogic_event *ev, size_t *nev) {
+	int level, ones, flags = 0;
+
+	while (d->state == BL_DEC_BUSY && (d->next >> 16) < pos) {
+		level = (d->value >> d->rx) & 1;
+		d->next += d->period;
+
+		if (d->bit == 0) {
+			/* Start bit gone by its center: a glitch */
+			if (level)
+				d->state = BL_DEC_IDLE;
+		} else if (d->bit <= d->databits) {
+			d->shift |= level << (d->bit - 1);
+		} else if (d->parity && d->bit == d->databits + 1) {
+			d->shift2 = level;
+		} else {
+			ones = __builtin_popcount(d->shift) + d->shift2;
+			if (d->parity && (ones & 1) != (d->parity == 1))
+				flags |= BL_EVENT_PARITY_ERROR;
+			if (!level)
+				flags |= BL_EVENT_FRAME_ERROR;
+
+			beaglelogic_emit(ev, nev, d->start, BL_EVENT_UART_DATA,
+					flags, d->databits, d->shift);
+			d->state = BL_DEC_IDLE;
+		}
+		d->bit++;
+	}
+}
+
+static void beaglelogic_uart_edge(struct beaglelogic_decoder *d,
+		uint64_t pos, uint32_t value) {
+	/* Falling edge of an idle line: start bit */
+	if (d->state == BL_DEC_IDLE && ((d->value >> d->rx) & 1) &&
+			!((value >> d->rx) & 1)) {
+		d->state = BL_DEC_BUSY;
+		d->start = pos;
+		d->next = (pos << 16) + d->period / 2;
+		d->bit = 0;
+		d->shift = d->shift2 = 0;
+	}
+}
+
+static void beaglelogic_spi_edge(struct beaglelogic_decoder *d,
+		uint64_t pos, uint32_t value, struct beaglelogic_event *ev,
+		size_t *nev) {
+	uint32_t changed = d->value ^ value, mosi, miso = 0;
+
+	if (d->cs >= 0 && (changed & (1 << d->cs))) {
+		if (!((value >> d->cs) & 1)) {
+			beaglelogic_emit(ev, nev, pos, BL_EVENT_SPI_SELECT, 0,
+					0, 0);
+			d->state = BL_DEC_BUSY;
+		} else {
+			if (d->bit)
+				beaglelogic_emit(ev, nev, d->start,
+						BL_EVENT_SPI_DATA,
+						BL_EVENT_PARTIAL, d->bit,
+						d->shift | (d->shift2 << 16));
+			beaglelogic_emit(ev, nev, pos, BL_EVENT_SPI_DESELECT,
+					0, 0, 0);
+			d->state = BL_DEC_IDLE;
+		}
+		d->bit = 0;
+		d->shift = d->shift2 = 0;
+	}
+
+	if ((d->cs >= 0 && d->state != BL_DEC_BUSY) ||
+			!(changed & (1 << d->clk)))
+		return;
+
+	/* Data is sampled on the rising edge in modes 0 and 3 */
+	if (((value >> d->clk) & 1) != (d->cpol == d->cpha))
+		return;
+
+	mosi = (value >> d->mosi) & 1;
+	if (d->miso >= 0)
+		miso = (value >> d->miso) & 1;
+
+	if (d->bit == 0)
+		d->start = pos;
+	if (d->lsbfirst) {
+		d->shift |= mosi << d->bit;
+		d->shift2 |= miso << d->bit;
+	} else {
+		d->shift = (d->shift << 1) | mosi;
+		d->shift2 = (d->shift2 << 1) | miso;
+	}
+
+	if (++d->bit == d->wordbits) {
+		beaglelogic_emit(ev, nev, d->start, BL_EVENT_SPI_DATA, 0,
+				d->bit, d->shift | (d->shift2 << 16));
+		d->bit = 0;
+		d->shift = d->shift2 = 0;
+	}
+}
+
+static void beaglelogic_i2c_edge(struct beaglelogic_decoder *d,
+		uint64_t pos, uint32_t value, struct beaglelogic_event *ev,
+		size_t *nev) {
+	int scl0 = (d->value >> d->scl) & 1, scl = (value >> d->scl) & 1;
+	int sda0 = (d->value >> d->sda) & 1, sda = (value >> d->sda) & 1;
+
+	/* SDA moving while SCL is high: start or stop condition */
+	if (scl0 && scl && sda0 != sda) {
+		if (!sda) {
+			beaglelogic_emit(ev, nev, pos, d->state == BL_DEC_IDLE ?
+					BL_EVENT_I2C_START :
+					BL_EVENT_I2C_RESTART, 0, 0, 0);
+			d->state = BL_DEC_ADDRESS;
+		} else {
+			beaglelogic_emit(ev, nev, pos, BL_EVENT_I2C_STOP, 0,
+					0, 0);
+			d->state = BL_DEC_IDLE;
+		}
+		d->bit = 0;
+		d->shift = 0;
+		return;
+	}
+
+	if (d->state == BL_DEC_IDLE || scl0 || !scl)
+		return;
+
+	/* Rising SCL: 8 data bits, then the acknowledge */
+	if (d->bit == 0)
+		d->start = pos;
+	if (d->bit++ < 8) {
+		d->shift = (d->shift << 1) | sda;
+		return;
+	}
+
+	beaglelogic_emit(ev, nev, d->start, d->state == BL_DEC_ADDRESS ?
+			BL_EVENT_I2C_ADDRESS : BL_EVENT_I2C_DATA,
+			sda ? BL_EVENT_NACK : 0, 8, d->shift);
+	d->state = BL_DEC_DATA;
+	d->bit = 0;
+	d->shift = 0;
+}
+
+size_t beaglelogic_decode(struct beaglelogic_decoder *d, const void *samples,
+		size_t n, struct beaglelogic_event *events, size_t maxevents,
+		size_t *consumed) {
+	struct beaglelogic_edge edges[256];
+	const uint8_t *p = samples;
+	size_t i = 0, j, ne, done, nev = 0;
+	uint64_t pos;
+	uint32_t last;
+
+	if (n && !d->started) {
+		d->value = beaglelogic_sample(p, 0, d->samplesize);
+		d->started = 1;
+	}
+
+	while (i < n) {
+		last = d->value;
+		ne = beaglelogic_edges(p + i * d->samplesize, n - i,
+				d->samplesize, &last, edges, 256, &done);
+
+		for (j = 0; j < ne; j++) {
+			/* No edge emits more than 2 events, nor the UART
+			 * sample points before it */
+			if (maxevents - nev < 4) {
+				i += edges[j].pos;
+				goto out;
+			}
+
+			pos = d->pos + i + edges[j].pos;
+			switch (d->protocol) {
+			case BL_DECODE_UART:
+				beaglelogic_uart_advance(d, pos, events, &nev);
+				beaglelogic_uart_edge(d, pos, edges[j].value);
+				break;
+			case BL_DECODE_SPI:
+				beaglelogic_spi_edge(d, pos, edges[j].value,
+						events, &nev);
+				break;
+			case BL_DECODE_I2C:
+				beaglelogic_i2c_edge(d, pos, edges[j].value,
+						events, &nev);
+				break;
+			}
+			d->value = edges[j].value;
+		}
+		i += done;
+	}
+
+	/* The last UART character may end before the next edge */
+	if (d->protocol == BL_DECODE_UART && maxevents - nev >= 4)
+		beaglelogic_uart_advance(d, d->pos + n, events, &nev);
+out:
+	d->pos += i;
+	*consumed = i;
+
+	return nev;
+}
+
+/* Run length encodes 1 or 2 byte samples. Returns the number of records,
+ * or 0 if they would take maxrec records or more */
+static size_t beaglelogic_rle_compress(const uint8_t *in, size_t nsamples,
+		int samplesize, uint32_t *rec, size_t maxrec) {
+	size_t i, n = 0;
+	uint32_t value, cur, count = 0;
+
+	if (nsamples == 0)
+		return 0;
+
+	cur = samplesize == 1 ? in[0] : in[0] | (in[1] << 8);
+	for (i = 1; i < nsamples; i++) {
+		value = samplesize == 1 ? in[i] :
+			in[2 * i] | (in[2 * i + 1] << 8);
+
+		if (value == cur && count < 0xFFFF) {
+			count++;
+			continue;
+		}
+
+		if (n + 1 >= maxrec)
+			return 0;
+		rec[n++] = cur | (count << 16);
+		cur = value;
+		count = 0;
+	}
+
+	/* Blocks shorter than a record can never be compressed */
+	if (n + 1 >= maxrec)
+		return 0;
+	rec[n++] = cur | (count << 16);
+
+	return n;
+}
+
+size_t beaglelogic_block_encode(const void *in, size_t len, int samplesize,
+		void *out) {
+	struct beaglelogic_block *blk = out;
+	uint32_t *rec = (uint32_t *)(blk + 1);
+	size_t nrec = 0;
+
+	blk->magic = BL_BLOCK_MAGIC;
+	blk->samplesize = samplesize;
+	blk->rawsize = len;
+
+	if (samplesize == 1 || samplesize == 2)
+		nrec = beaglelogic_rle_compress(in, len / samplesize,
+				samplesize, rec, len / 4);
+
+	if (nrec) {
+		blk->encoding = BL_BLOCK_RLE;
+		blk->size = nrec * 4;
+	} else {
+		blk->encoding = BL_BLOCK_RAW;
+		blk->size = len;
+		memcpy(blk + 1, in, len);
+	}
+
+	return sizeof(*blk) + blk->size;
+}
+
+ssize_t beaglelogic_block_decode(const void *block, size_t len,
+		void *out, size_t outsize) {
+	const struct beaglelogic_block *blk = block;
+	const uint32_t *rec = (const uint32_t *)(blk + 1);
+	uint8_t *o = out;
+	size_t i, j, n = 0;
+	uint32_t count, value;
+
+	if (len < sizeof(*blk) || blk->magic != BL_BLOCK_MAGIC ||
+			len - sizeof(*blk) < blk->size || blk->rawsize > outsize)
+		return -1;
+
+	if (blk->encoding == BL_BLOCK_RAW) {
+		if (blk->size != blk->rawsize)
+			return -1;
+		memcpy(out, blk + 1, blk->size);
+		return blk->size;
+	}
+
+	if (blk->encoding != BL_BLOCK_RLE ||
+			(blk->samplesize != 1 && blk->samplesize != 2))
+		return -1;
+
+	for (i = 0; i < blk->size / 4; i++) {
+		count = BL_RLE_COUNT(rec[i]);
+		value = BL_RLE_VALUE(rec[i]);
+		if (n + count * blk->samplesize > blk->rawsize)
+			return -1;
+
+		if (blk->samplesize == 1) {
+			memset(o + n, value, count);
+			n += count;
+		} else {
+			for (j = 0; j < count; j++, n += 2) {
+				o[n] = value;
+				o[n + 1] = value >> 8;
+			}
+		}
+	}
+
+	return n == blk->rawsize ? (ssize_t)n : -1;
+}
+
+static const struct beaglelogic_summary beaglelogic_summary_empty = {
+	0, 0xFFFFFFFF, 0
+};
+
+static void beaglelogic_summary_merge(struct beaglelogic_summary *s,
+		const struct beaglelogic_summary *t) {
+	s->any |= t->any;
+	s->all &= t->all;
+	s->changed |= t->changed;
+}
+
+/* Summarizes n samples into s, a 32-bit word (2 or 4 samples) at a time.
+ * 'last' is the sample before the first one, and then the last one */
+static void beaglelogic_summarize(const void *data, size_t n, int samplesize,
+		uint32_t *last, struct beaglelogic_summary *s) {
+	const uint32_t *w = data;
+	const uint8_t *p;
+	uint32_t any = 0, all = 0xFFFFFFFF, changed = 0, prev = *last, v;
+	uint32_t bits = samplesize * 8, mask = (1 << bits) - 1;
+	size_t i, words = n * samplesize / 4;
+
+	if (!n)
+		return;
+
+	for (i = 0; i < words; i++) {
+		v = w[i];
+		any |= v;
+		all &= v;
+		changed |= v ^ ((v << bits) | prev);
+		prev = v >> (32 - bits);
+	}
+
+	/* Fold the samples of a word together */
+	for (i = 16; i >= bits; i /= 2) {
+		any |= any >> i;
+		all &= all >> i;
+		changed |= changed >> i;
+	}
+	any &= mask;
+	all &= mask;
+	changed &= mask;
+
+	p = (const uint8_t *)(w + words);
+	for (i = 0; i < n - words * 4 / samplesize; i++) {
+		v = (samplesize == 1) ? p[i] : p[2 * i] | (p[2 * i + 1] << 8);
+		any |= v;
+		all &= v;
+		changed |= v ^ prev;
+		prev = v;
+	}
+
+	s->any |= any;
+	s->all &= all;
+	s->changed |= changed;
+	*last = prev;
+}
+
+int beaglelogic_index_init(struct beaglelogic_indexer *ix, int samplesize,
+		uint32_t decimation) {
+	if ((samplesize != 1 && samplesize != 2) || decimation < 32 ||
+			(decimation & (decimation - 1)))
+		return -1;
+
+	memset(ix, 0, sizeof(*ix));
+	ix->samplesize = samplesize;
+	ix->decimation = decimation;
+	ix->cur = beaglelogic_summary_empty;
+
+	return 0;
+}
+
+/* Closes the level 0 summaries before summary e */
+static int beaglelogic_index_flush(struct beaglelogic_indexer *ix,
+		uint64_t e) {
+	struct beaglelogic_summary *s;
+
+	while (ix->count < e) {
+		if (ix->count == ix->maxcount) {
+			s = realloc(ix->summaries, (ix->maxcount + 1024) * 2 *
+					sizeof(*s));
+			if (!s)
+				return -1;
+			ix->summaries = s;
+			ix->maxcount = (ix->maxcount + 1024) * 2;
+		}
+		ix->summaries[ix->count++] = ix->cur;
+		ix->cur = beaglelogic_summary_empty;
+	}
+
+	return 0;
+}
+
+int beaglelogic_index_add(struct beaglelogic_indexer *ix, uint64_t filepos,
+		const struct beaglelogic_chunk *chunk) {
+	const uint8_t *data = (const uint8_t *)chunk + BL_CHUNK_ALIGN;
+	struct beaglelogic_chunkinfo *ci;
+	struct beaglelogic_summary t;
+	uint64_t p = chunk->offset / ix->samplesize;
+	uint64_t n = chunk->size / ix->samplesize, e, span;
+
+	if (ix->nchunks == ix->maxchunks) {
+		ci = realloc(ix->chunks, (ix->maxchunks + 256) * 2 *
+				sizeof(*ci));
+		if (!ci)
+			return -1;
+		ix->chunks = ci;
+		ix->maxchunks = (ix->maxchunks + 256) * 2;
+	}
+
+	ci = &ix->chunks[ix->nchunks++];
+	ci->filepos = filepos;
+	ci->offset = chunk->offset;
+	ci->tstart = chunk->tstart;
+	ci->size = chunk->size;
+	ci->summary = beaglelogic_summary_empty;
+
+	if (!n)
+		return 0;
+
+	/* No transition across a gap, nor into the very first sample */
+	if (p != ix->next || !ix->next)
+		ix->last = (ix->samplesize == 1) ? data[0] :
+			data[0] | (data[1] << 8);
+
+	while (n) {
+		e = p / ix->decimation;
+		if (beaglelogic_index_flush(ix, e))
+			return -1;
+
+		span = (e + 1) * ix->decimation - p;
+		if (span > n)
+			span = n;
+
+		t = beaglelogic_summary_empty;
+		beaglelogic_summarize(data, span, ix->samplesize, &ix->last,
+				&t);
+		beaglelogic_summary_merge(&ix->cur, &t);
+		beaglelogic_summary_merge(&ci->summary, &t);
+
+		data += span * ix->samplesize;
+		p += span;
+		n -= span;
+	}
+	ix->next = p;
+
+	return 0;
+}
+
+int beaglelogic_index_write(struct beaglelogic_indexer *ix, int fd,
+		uint64_t filepos) {
+	struct beaglelogic_chunk *chunk;
+	struct beaglelogic_index *index;
+	struct beaglelogic_summary *s, *t;
+	struct beaglelogic_trailer *trailer;
+	uint64_t i, count, pos;
+	uint32_t k, chunksize;
+	uint8_t *p;
+
+	/* The last summary may be partly filled */
+	if (beaglelogic_index_flush(ix, (ix->next + ix->decimation - 1) /
+			ix->decimation))
+		return -1;
+
+	/* Lay the index out */
+	pos = sizeof(*index) + ix->nchunks * sizeof(*ix->chunks);
+	count = ix->count;
+	for (k = 0; k < BL_INDEX_LEVELS; k++) {
+		pos += count * sizeof(*s);
+		if (count <= 1)
+			break;
+		count = (count + BL_INDEX_FACTOR - 1) / BL_INDEX_FACTOR;
+	}
+
+	chunksize = BL_CHUNK_SIZE(pos + sizeof(*trailer));
+	if (posix_memalign((void **)&chunk, BL_CHUNK_ALIGN, chunksize))
+		return -1;
+	memset(chunk, 0, chunksize);
+
+	chunk->magic = BL_CHUNK_MAGIC;
+	chunk->chunksize = chunksize;
+	chunk->type = BL_CHUNK_INDEX;
+	chunk->size = pos;
+
+	index = (struct beaglelogic_index *)((uint8_t *)chunk +
+			BL_CHUNK_ALIGN);
+	index->samplesize = ix->samplesize;
+	index->chunks = ix->nchunks;
+	index->decimation = ix->decimation;
+	index->samples = ix->next;
+	memcpy(BL_INDEX_CHUNKS(index), ix->chunks,
+			ix->nchunks * sizeof(*ix->chunks));
+
+	/* Level 0 as built, then each level from the one below */
+	pos = sizeof(*index) + ix->nchunks * sizeof(*ix->chunks);
+	index->level[0].samples = ix->decimation;
+	index->level[0].count = ix->count;
+	index->level[0].pos = pos;
+	memcpy(BL_INDEX_LEVEL(index, 0), ix->summaries,
+			ix->count * sizeof(*s));
+	index->levels = 1;
+
+	for (k = 1; k < BL_INDEX_LEVELS && index->level[k - 1].count > 1;
+			k++) {
+		t = BL_INDEX_LEVEL(index, k - 1);
+		pos += index->level[k - 1].count * sizeof(*s);
+		index->level[k].samples = index->level[k - 1].samples *
+			BL_INDEX_FACTOR;
+		index->level[k].count = (index->level[k - 1].count +
+				BL_INDEX_FACTOR - 1) / BL_INDEX_FACTOR;
+		index->level[k].pos = pos;
+		index->levels++;
+
+		s = BL_INDEX_LEVEL(index, k);
+		for (i = 0; i < index->level[k].count; i++)
+			s[i] = beaglelogic_summary_empty;
+		for (i = 0; i < index->level[k - 1].count; i++)
+			beaglelogic_summary_merge(&s[i / BL_INDEX_FACTOR],
+					&t[i]);
+	}
+
+	trailer = (struct beaglelogic_trailer *)((uint8_t *)chunk +
+			chunksize - sizeof(*trailer));
+	trailer->indexpos = filepos;
+	trailer->magic = BL_TRAILER_MAGIC;
+
+	for (p = (uint8_t *)chunk; p < (uint8_t *)chunk + chunksize; ) {
+		ssize_t n = write(fd, p, (uint8_t *)chunk + chunksize - p);
+
+		if (n <= 0) {
+			free(chunk);
+			return -1;
+		}
+		p += n;
+	}
+
+	free(chunk);
+	return 0;
+}
+
+void beaglelogic_index_free(struct beaglelogic_indexer *ix) {
+	free(ix->chunks);
+	free(ix->summaries);
+	ix->chunks = NULL;
+	ix->summaries = NULL;
+}
+
+struct beaglelogic_index *beaglelogic_index_read(int fd) {
+	struct beaglelogic_trailer trailer;
+	struct beaglelogic_chunk chunk;
+	struct beaglelogic_index *index;
+	off_t end = lseek(fd, 0, SEEK_END);
+	uint32_t k;
+
+	if (end < (off_t)sizeof(trailer) || pread(fd, &trailer,
+			sizeof(trailer), end - sizeof(trailer)) !=
+			sizeof(trailer) || trailer.magic != BL_TRAILER_MAGIC)
+		return NULL;
+
+	if (pread(fd, &chunk, sizeof(chunk), trailer.indexpos) !=
+			sizeof(chunk) || chunk.magic != BL_CHUNK_MAGIC ||
+			chunk.type != BL_CHUNK_INDEX ||
+			chunk.size < sizeof(*index))
+		return NULL;
+
+	if (!(index = malloc(chunk.size)))
+		return NULL;
+
+	if (pread(fd, index, chunk.size, trailer.indexpos + BL_CHUNK_ALIGN) !=
+			chunk.size || index->levels > BL_INDEX_LEVELS ||
+			sizeof(*index) + (uint64_t)index->chunks *
+			sizeof(struct beaglelogic_chunkinfo) > chunk.size)
+		goto fail;
+
+	for (k = 0; k < index->levels; k++)
+		if (index->level[k].pos > chunk.size || index->level[k].count >
+				(chunk.size - index->level[k].pos) /
+				sizeof(struct beaglelogic_summary))
+			goto fail;
+
+	return index;
+fail:
+	free(index);
+	return NULL;
+}
+
+uint32_t beaglelogic_index_find(const struct beaglelogic_index *ix,
+		uint64_t offset) {
+	const struct beaglelogic_chunkinfo *ci = BL_INDEX_CHUNKS(ix);
+	uint32_t lo = 0, hi = ix->chunks, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ci[mid].offset + ci[mid].size <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	return nextbuf;
+	return lo;
 }
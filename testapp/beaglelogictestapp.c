@@ -24,6 +24,7 @@
 
 int bfd, i;
 uint8_t *buf, *buf2, *buf3, *bl_mem;
+struct beaglelogic_ring *ring;
 
 /* For testing nonblocking IO */
 #define NONBLOCK
@@ -66,6 +67,8 @@ int main(int argc, char **argv)
 {
 	int cnt1;
 	size_t sz, sz_to_read, cnt;
+	uint32_t seq = 0, lost = 0;
+	uint64_t lostbytes = 0;
 
 	struct timespec t1, t2;
 	struct pollfd pollfd;
@@ -91,6 +94,14 @@ int main(int argc, char **argv)
 
 	/* Memory map the file */
 	bl_mem = beaglelogic_mmap(bfd);
+#if defined(NONBLOCK)
+	/* Zero-copy consumption through the ring control area */
+	ring = beaglelogic_mmap_ring(bfd);
+	if (ring == MAP_FAILED) {
+		printf("BeagleLogic ring mapping failed! \n");
+		return -1;
+	}
+#endif
 
 	/* Configure the poll descriptor */
 	pollfd.fd = bfd;
@@ -131,21 +142,24 @@ int main(int argc, char **argv)
 		buf3 = bl_mem;
 #if defined(NONBLOCK)
 		poll (&pollfd, 1, 500);
-		while (cnt1 < sz_to_read && pollfd.revents) {
-			/* Do stuff until timeout */
-			sz = read(bfd, NULL, 64 * 1024);
-			memcpy(buf2, buf3, sz);
-
-			if (sz == 0)
-				break;
-			else if (sz == -1) {
-				poll(&pollfd, 1, 500);
-				continue;
+		while (cnt1 < sz_to_read && (pollfd.revents & POLLIN)) {
+			/* Work on every filled buffer in place, until timeout */
+			while (seq != ring->producer && cnt1 < sz_to_read) {
+				buf3 = beaglelogic_ring_buffer(bl_mem, ring, seq);
+				sz = ring->desc[seq % ring->bufcount].size;
+				lostbytes += ring->desc[seq % ring->bufcount].lost;
+				memcpy(buf2, buf3, sz);
+
+				/* Overwritten while we were working on it? */
+				if (ring->desc[seq % ring->bufcount].seq != seq)
+					lost++;
+
+				buf2 += sz;
+				cnt1 += sz;
+				seq++;
 			}
-
-			buf2 += sz;
-			buf3 += sz;
-			cnt1 += sz;
+			beaglelogic_ring_ack(bfd, seq);
+			poll(&pollfd, 1, 500);
 		}
 #else
 		(void)pollfd;
@@ -165,6 +179,11 @@ int main(int argc, char **argv)
 
 	printf("Read %d bytes in %jd us, speed=%jd MB/s\n",
 			cnt, timediff(&t1, &t2), cnt / timediff(&t1, &t2));
+#if defined(NONBLOCK)
+	printf("Buffers lost: %u, samples dropped by the PRU: %llu bytes\n",
+			lost, (unsigned long long)lostbytes);
+	beaglelogic_munmap_ring(ring);
+#endif
 
 	/* Done, close mappings, file and free the buffers */
 	beaglelogic_munmap(bfd, bl_mem);
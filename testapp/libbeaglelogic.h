@@ -54,7 +54,157 @@ enum beaglelogic_triggerflags {
 /* Possible sample unit / formats */
 enum beaglelogic_sampleunit {
 	BL_SAMPLEUNIT_16_BITS = 0,
-	BL_SAMPLEUNIT_8_BITS
+	BL_SAMPLEUNIT_8_BITS,
+	BL_SAMPLEUNIT_RLE		/* 32-bit run length records, see below */
+};
+
+/* External clock: one sample per rising or falling edge of a channel
+ * instead of the sample rate, for 8 and 16-bit samples */
+enum beaglelogic_clockedge {
+	BL_CLOCK_OFF = 0,		/* Sample at the sample rate */
+	BL_CLOCK_RISING,
+	BL_CLOCK_FALLING
+};
+
+struct beaglelogic_clock {
+	uint32_t channel;	/* Clock input, 0 - 15 */
+	uint32_t edge;		/* From enum beaglelogic_clockedge */
+};
+
+/* Synchronized start of several boards: the master raises a PRU0 output
+ * (R30 bit 'pin') as its capture starts, the slaves wait for a rising edge
+ * on a PRU0 input (R31 bit 'pin') before starting theirs. Buffer timestamps
+ * then count PRU cycles from the same instant on every board */
+enum beaglelogic_syncmode {
+	BL_SYNC_OFF = 0,
+	BL_SYNC_MASTER,			/* Drive the sync line */
+	BL_SYNC_SLAVE			/* Wait for the sync line */
+};
+
+struct beaglelogic_sync {
+	uint32_t mode;		/* From enum beaglelogic_syncmode */
+	uint32_t pin;		/* PRU0 R30 / R31 bit, 0 - 15 */
+};
+
+/* Test mode: PRU1 sends a 32-bit little-endian counter instead of samples,
+ * at the byte rate of the sample rate and unit. The word at stream offset
+ * o (including the bytes dropped for lack of a buffer) is o / 4 */
+#define BL_TEST_WORD(offset)	((uint32_t)((offset) / 4))
+
+/* Packed channels (channelmask): only a group of 1, 2, 4 or 8 neighbouring
+ * channels is stored, 32 / width samples per 32-bit little-endian word with
+ * the first sample in the lowest bits. The group starts at a multiple of
+ * its width, e.g. 0x0003, 0x00F0 or 0xFF00 */
+
+/* Run length records: a 16-bit sample value held for 1 to 65536 samples.
+ * A new record is emitted when the inputs change or the count overflows */
+#define BL_RLE_VALUE(rec)	((rec) & 0xFFFF)
+#define BL_RLE_COUNT(rec)	(((rec) >> 16) + 1)
+
+/* Possible sample buffer allocation modes (sysfs attribute 'allocmode') */
+enum beaglelogic_allocmode {
+	BL_ALLOCMODE_KMALLOC = 0,	/* One kmalloc() per buffer unit */
+	BL_ALLOCMODE_COHERENT,		/* Contiguous CMA / coherent chunks */
+	BL_ALLOCMODE_STREAMING		/* kmalloc(), DMA-mapped only once */
+};
+
+/* Ring control area for zero-copy consumers, see beaglelogic_mmap_ring */
+#define BL_RING_MMAP_OFFSET	0x40000000
+#define BL_RING_MAGIC		0xBEA6121C
+#define BL_RING_SEQ_INVALID	0xFFFFFFFF
+
+struct beaglelogic_ring_desc {
+	uint32_t seq;		/* Sequence number of the data in this buffer */
+	uint32_t size;		/* Valid bytes in this buffer */
+	uint32_t flags;		/* Buffer flags, see struct beaglelogic_bufinfo */
+	uint32_t lost;		/* Bytes lost right before this buffer */
+	uint64_t offset;	/* Stream offset of the first byte */
+	uint64_t tstart;	/* Timestamps of the first and last 32 bytes */
+	uint64_t tend;
+	uint32_t samplerate;	/* Sample rate of this buffer, 0 if clocked */
+	uint32_t reserved;
+};
+
+struct beaglelogic_ring {
+	uint32_t magic;		/* BL_RING_MAGIC */
+	uint32_t bufcount;	/* Number of entries in desc[] */
+	uint32_t bufunitsize;	/* Size of one buffer, in bytes */
+	uint32_t state;		/* Device state, from enum beaglelogic_states */
+
+	uint32_t producer;	/* Sequence number of the next buffer to fill */
+	uint32_t consumer;	/* Sequence number of the next buffer to use */
+	uint32_t dropped;	/* Buffers overwritten before being consumed */
+	uint32_t reserved;
+
+	struct beaglelogic_ring_desc desc[];
+};
+
+/* Buffer metadata, recorded by the PRU as every buffer completes
+ *
+ * 'offset' counts the bytes sampled since the start of the capture, including
+ * the ones that had to be dropped while no buffer was free: 'lost' bytes were
+ * dropped right before the buffer, which is then flagged BL_BUF_OVERRUN.
+ * Timestamps are in PRU cycles (200 MHz) since the start of the capture and
+ * mark the arrival of the first and the last 32 bytes of the buffer.
+ * tstart is only exact for buffers filled within 21 s (2^32 cycles) */
+#define BL_BUF_OVERRUN		(1 << 0)
+#define BL_BUF_RATECHANGE	(1 << 1)	/* First at a new samplerate */
+
+struct beaglelogic_bufinfo {
+	uint32_t index;		/* Buffer to query, set by the caller */
+	uint32_t size;		/* Valid bytes in this buffer */
+	uint32_t flags;		/* BL_BUF_* */
+	uint32_t lost;		/* Bytes lost right before this buffer */
+	uint64_t offset;	/* Stream offset of the first byte */
+	uint64_t tstart;	/* Timestamps of the first and last 32 bytes */
+	uint64_t tend;
+	uint32_t samplerate;	/* Sample rate of this buffer, 0 if clocked */
+	uint32_t reserved;
+};
+
+/* Hardware trigger, evaluated by the PRU before any sample is stored
+ *
+ * The capture starts at the first sample where (input & mask) equals
+ * (value & mask) and where every channel in 'rising' ('falling') has just
+ * gone from low to high (high to low). Several edge channels have to change
+ * in the same sample. Set everything to zero to disable the trigger */
+struct beaglelogic_trigger {
+	uint32_t mask;		/* Channels that have to match 'value' */
+	uint32_t value;
+	uint32_t rising;	/* Channels that have to rise */
+	uint32_t falling;	/* Channels that have to fall */
+};
+
+/* Trigger window capture: 'pretrigger' samples before the trigger and
+ * 'posttrigger' samples from the trigger on. The ring of buffers is
+ * overwritten until the trigger fires, then the capture ends 'posttrigger'
+ * samples later. A zero posttrigger disables window captures */
+struct beaglelogic_window {
+	uint32_t pretrigger;	/* Samples to keep before the trigger */
+	uint32_t posttrigger;	/* Samples to capture after the trigger */
+};
+
+/* Location of the trigger window after a capture. Byte offsets are counted
+ * from the start of the capture, 'offset' is the window start within the
+ * buffers mmap()ed at offset 0 (wrapping at the end of the mapping) */
+struct beaglelogic_triggerinfo {
+	uint32_t triggered;	/* 1 if the window is valid */
+	uint32_t trigpos;	/* Byte offset of the trigger sample */
+	uint32_t start;		/* Byte offset of the window start */
+	uint32_t size;		/* Window size, in bytes */
+	uint32_t offset;	/* Window start in the mapped buffers */
+};
+
+/* Sample rate actually generated by the PRU: clock * 65536 / period Hz.
+ * Rates that are not (100 / n) MHz use a period with a fraction of a cycle:
+ * every sample is then taken within one PRU cycle of its ideal time. In
+ * burst mode this is the rate within a burst, the period and the rate are
+ * 0 with an external clock */
+struct beaglelogic_rate {
+	uint32_t clock;		/* PRU clock, Hz */
+	uint32_t reserved;
+	uint64_t period;	/* PRU cycles per sample, in 1/65536 */
+	uint64_t millihz;	/* Sample rate, in mHz (rounded) */
 };
 
 /* Open and close functions */
@@ -75,6 +225,17 @@ int beaglelogic_read(int fd, void *buf, size_t bytes);
  */
 int beaglelogic_getbufunitsize(int fd);
 
+/* Sets the unit size of the capture buffer, in bytes
+ * This frees the capture buffer, set the buffer size again afterwards
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* bufunitsize : the new unit size, a multiple of 32
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_set_bufunitsize(int fd, uint32_t bufunitsize);
+
 /* Gets and sets the kernel capture buffer size in bytes
  * The buffer allocated may be more than the size requested, hence
  * the program should check the size of the allocated buffer before
@@ -90,6 +251,10 @@ int beaglelogic_get_buffersize(int fd, uint32_t *bufsize);
 int beaglelogic_set_buffersize(int fd, uint32_t bufsize);
 
 /* Gets and sets the sample rate (in Hz)
+ *
+ * Rates above 100 MHz select 200 MHz bursts of 32 8-bit samples, see the
+ * samplerate sysfs attribute in docs/sysfs_attributes.rst. Rates from 3052
+ * Hz to 13.3 MHz are kept as given, faster ones are rounded to (100 / n) MHz
  *
  * Parameters:
  * 	* fd : The file number to an open /dev/beaglelogic node
@@ -100,6 +265,53 @@ int beaglelogic_set_buffersize(int fd, uint32_t bufsize);
 int beaglelogic_get_samplerate(int fd, uint32_t *samplerate);
 int beaglelogic_set_samplerate(int fd, uint32_t samplerate);
 
+/* Gets the sample rate the PRU generates with the current settings
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* rate : filled with the PRU clock, sample period and rate
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_get_actual_rate(int fd, struct beaglelogic_rate *rate);
+
+/* Gets and sets the external sample clock, see the extclock sysfs attribute
+ * in docs/sysfs_attributes.rst. An edge of BL_CLOCK_OFF goes back to the
+ * sample rate (default)
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* clock : clock channel and edge to sample on
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_get_extclock(int fd, struct beaglelogic_clock *clock);
+int beaglelogic_set_extclock(int fd, struct beaglelogic_clock *clock);
+
+/* Gets and sets the synchronized start, see the syncstart sysfs attribute
+ * in docs/sysfs_attributes.rst. Start the slaves before the master
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* sync : mode (BL_SYNC_*) and PRU0 pin of the sync line
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_get_sync(int fd, struct beaglelogic_sync *sync);
+int beaglelogic_set_sync(int fd, struct beaglelogic_sync *sync);
+
+/* Gets and sets the test mode, see BL_TEST_WORD and the testmode sysfs
+ * attribute in docs/sysfs_attributes.rst
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* testmode : pointer to var (for get) and value (for set), 0 or 1
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_get_testmode(int fd, uint32_t *testmode);
+int beaglelogic_set_testmode(int fd, uint32_t testmode);
+
 /* Gets and sets the sample unit
  *
  * Parameters:
@@ -114,6 +326,20 @@ int beaglelogic_set_samplerate(int fd, uint32_t samplerate);
 int beaglelogic_get_sampleunit(int fd, enum beaglelogic_sampleunit *sampleunit);
 int beaglelogic_set_sampleunit(int fd, enum beaglelogic_sampleunit sampleunit);
 
+/* Gets and sets the packed channels, see the packed channels above
+ *
+ * Packing makes the buffers and the stream 16 / width times denser, for
+ * sample rates of 11.1 MHz or less. 0 disables it (default)
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* channelmask : pointer to var (for get) and value (for set)
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_get_channelmask(int fd, uint32_t *channelmask);
+int beaglelogic_set_channelmask(int fd, uint32_t channelmask);
+
 /* Gets and sets the trigger flags
  *
  * Parameters:
@@ -130,6 +356,72 @@ int beaglelogic_get_triggerflags(int fd,
 int beaglelogic_set_triggerflags(int fd,
 		enum beaglelogic_triggerflags triggerflags);
 
+/* Gets and sets the hardware trigger, see struct beaglelogic_trigger
+ *
+ * Samples before the trigger condition are not stored at all, so with the
+ * one-shot mode the buffer holds the data following the trigger
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* trigger : pointer to the trigger configuration
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_get_trigger(int fd, struct beaglelogic_trigger *trigger);
+int beaglelogic_set_trigger(int fd, struct beaglelogic_trigger *trigger);
+
+/* Gets and sets the trigger window, see struct beaglelogic_window
+ *
+ * Window captures need a trigger and run at up to 16.6 MSPS. read() then
+ * returns the window only, once the capture has ended
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* window : pointer to the window configuration
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_get_window(int fd, struct beaglelogic_window *window);
+int beaglelogic_set_window(int fd, struct beaglelogic_window *window);
+
+/* Locates the trigger window of the last capture, for mmap users
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* info : filled with the window location
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_get_triggerinfo(int fd, struct beaglelogic_triggerinfo *info);
+
+/* Gets the metadata of the data held in a buffer, see struct
+ * beaglelogic_bufinfo. Zero-copy ring users find it in the ring too
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* index : buffer index, from 0 to (memalloc / bufunitsize) - 1
+ * 	* info : filled with the buffer metadata
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_get_bufinfo(int fd, uint32_t index,
+		struct beaglelogic_bufinfo *info);
+
+/* Gets the number of bytes this reader missed since it started reading
+ *
+ * Several processes may read /dev/beaglelogic at the same time, each with
+ * its own position in the same capture. Buffers are only filled again once
+ * every reader is done with them, so a slow reader makes the PRU drop
+ * samples for everyone; this is what the byte count adds up.
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* lostbytes : filled with the number of bytes
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_get_lostbytes(int fd, uint64_t *lostbytes);
+
 /* Polls for last error and returns the error code
  *
  * This function waits till the capture session ends, so may not be
@@ -164,6 +456,19 @@ int beaglelogic_start(int fd);
  */
 int beaglelogic_stop(int fd);
 
+/* Starts the next one-shot capture once the last one is over
+ *
+ * Same as beaglelogic_stop followed by beaglelogic_start, in one call. The
+ * configuration is only written to the PRUs again if a setting changed
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ *
+ * Returns:
+ * 	0 on success, -1 on failure (errno EBUSY if still capturing)
+ */
+int beaglelogic_rearm(int fd);
+
 /* Invalidates the kernel buffer cache
  * To be used with mmap operations only.
  *
@@ -202,8 +507,9 @@ void * beaglelogic_mmap(int fd);
  */
 int beaglelogic_munmap(int fd, void *addr);
 
-/* Busy-waits for the next sample buffer to be filled in
- * To be used in conjunction with mmap
+/* Waits for the next sample buffer to be filled in
+ * To be used in conjunction with mmap. When not running, it sleeps until the
+ * state changes before returning. Event loops should use beaglelogic_stream
  *
  * Parameters:
  * 	none. This uses sysfs attributes, hence no params are required
@@ -214,4 +520,614 @@ int beaglelogic_munmap(int fd, void *addr);
  */
 int beaglelogic_waitfornextbuffer(void);
 
+/* Maps the ring control area for zero-copy consumption
+ * To be used in conjunction with beaglelogic_mmap. Once mapped, poll() on fd
+ * signals POLLIN while ring->producer != ring->consumer. Buffers are then
+ * processed in place and acknowledged with beaglelogic_ring_ack
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ *
+ * Returns:
+ * 	MAP_FAILED if mapping failed, otherwise the ring control area
+ */
+struct beaglelogic_ring *beaglelogic_mmap_ring(int fd);
+
+/* Destroys the mapping of the ring control area
+ *
+ * Parameters:
+ * 	* ring : The ring returned by beaglelogic_mmap_ring
+ *
+ * Returns:
+ * 	0 if successful
+ */
+int beaglelogic_munmap_ring(struct beaglelogic_ring *ring);
+
+/* Returns the address of the buffer holding a sequence number
+ *
+ * Parameters:
+ * 	* mem : The buffer mapping returned by beaglelogic_mmap
+ * 	* ring : The ring returned by beaglelogic_mmap_ring
+ * 	* seq : The sequence number, between ring->consumer and ring->producer
+ *
+ * NOTE: The data is valid only if ring->desc[seq % ring->bufcount].seq is
+ * still equal to seq once the buffer has been processed
+ */
+void *beaglelogic_ring_buffer(void *mem, struct beaglelogic_ring *ring,
+		uint32_t seq);
+
+/* Expands run length records [BL_SAMPLEUNIT_RLE] into 16-bit samples
+ *
+ * Records are only expanded as a whole, so nsamples should be at least
+ * 65536 to always make progress
+ *
+ * Parameters:
+ * 	* rec : The records, as read from the device
+ * 	* nrec : Number of records
+ * 	* out : Destination of the samples
+ * 	* nsamples : Room in out, in samples
+ * 	* consumed : Set to the number of records expanded
+ *
+ * Returns:
+ * 	the number of samples written to out
+ */
+size_t beaglelogic_rle_expand(const uint32_t *rec, size_t nrec,
+		uint16_t *out, size_t nsamples, size_t *consumed);
+
+/* Unpacks packed channels into 16-bit samples, the channels at their
+ * original bit positions and the others zero
+ *
+ * Parameters:
+ * 	* in : The packed data, as read from the device
+ * 	* len : Length of in, in bytes
+ * 	* channelmask : The packed channels
+ * 	* out : Destination of the samples, len * 8 / width samples
+ *
+ * Returns:
+ * 	the number of samples written to out
+ */
+size_t beaglelogic_unpack(const void *in, size_t len, uint32_t channelmask,
+		uint16_t *out);
+
+/* Sample to channel kernels, for 1 or 2 byte samples
+ *
+ * These work on 64 samples at a time, with NEON when libbeaglelogic is
+ * built for it (-mfpu=neon) and with 64-bit scalar code otherwise. See
+ * testapp/beaglelogic-kernelbench.c for their speed */
+
+/* Splits samples into one bit plane per channel
+ *
+ * Parameters:
+ * 	* samples : The samples
+ * 	* n : Number of samples
+ * 	* samplesize : Bytes per sample
+ * 	* planes : Destination, plane c at planes + c * stride holding
+ * 	           channel c of sample i in bit (i % 8) of byte i / 8
+ * 	* stride : Bytes between planes, at least (n + 7) / 8
+ */
+void beaglelogic_transpose(const void *samples, size_t n, int samplesize,
+		uint8_t *planes, size_t stride);
+
+/* Transition of the inputs, see beaglelogic_edges */
+struct beaglelogic_edge {
+	uint32_t pos;		/* Sample index */
+	uint16_t value;		/* New value of the inputs */
+	uint16_t changed;	/* Channels that toggled */
+};
+
+/* Lists the samples that differ from the one before them
+ *
+ * Parameters:
+ * 	* samples : The samples
+ * 	* n : Number of samples
+ * 	* samplesize : Bytes per sample
+ * 	* last : The sample before the first one, updated to the last one
+ * 	* edges : Destination of the transitions
+ * 	* maxedges : Room in edges
+ * 	* consumed : If not NULL, filled with the number of samples looked
+ * 	             at, less than n once edges is full
+ *
+ * Returns:
+ * 	the number of transitions written to edges
+ */
+size_t beaglelogic_edges(const void *samples, size_t n, int samplesize,
+		uint32_t *last, struct beaglelogic_edge *edges, size_t maxedges,
+		size_t *consumed);
+
+/* Counts the samples where each channel is high, for duty cycles
+ *
+ * Parameters:
+ * 	* samples : The samples
+ * 	* n : Number of samples
+ * 	* samplesize : Bytes per sample
+ * 	* counts : 8 * samplesize counters, channel c added to counts[c]
+ */
+void beaglelogic_highcount(const void *samples, size_t n, int samplesize,
+		uint64_t *counts);
+
+/* Protocol decoders, fed with the samples as they come (see
+ * beaglelogic_decode) and keeping their state from one buffer to the next.
+ * They turn a bus into a stream of events, e.g. for the 'decode' command of
+ * tcp-server-c. All the fields are little-endian */
+enum beaglelogic_protocol {
+	BL_DECODE_NONE = 0,
+	BL_DECODE_UART,
+	BL_DECODE_SPI,
+	BL_DECODE_I2C
+};
+
+#define BL_EVENT_UART_DATA	1	/* data: the character */
+#define BL_EVENT_SPI_SELECT	2	/* CS went low */
+#define BL_EVENT_SPI_DESELECT	3	/* CS went high */
+#define BL_EVENT_SPI_DATA	4	/* data: MOSI word | MISO word << 16 */
+#define BL_EVENT_I2C_START	5
+#define BL_EVENT_I2C_RESTART	6
+#define BL_EVENT_I2C_STOP	7
+#define BL_EVENT_I2C_ADDRESS	8	/* data: address << 1 | R/W */
+#define BL_EVENT_I2C_DATA	9	/* data: the byte */
+
+#define BL_EVENT_PARITY_ERROR	(1 << 0)
+#define BL_EVENT_FRAME_ERROR	(1 << 1)	/* UART stop bit low */
+#define BL_EVENT_NACK		(1 << 2)	/* I2C byte not acknowledged */
+#define BL_EVENT_PARTIAL	(1 << 3)	/* SPI word cut by CS */
+
+struct beaglelogic_event {
+	uint64_t pos;		/* Sample it started at, since the capture start */
+	uint8_t type;		/* BL_EVENT_* */
+	uint8_t flags;
+	uint16_t bits;		/* Bits in data */
+	uint32_t data;
+};
+
+struct beaglelogic_decoder {
+	/* Configuration, see beaglelogic_decoder_parse */
+	int protocol;		/* From enum beaglelogic_protocol */
+	int rx;			/* UART */
+	uint32_t baud;
+	int databits;
+	int parity;		/* 0 none, 1 odd, 2 even */
+	int clk, mosi, miso, cs;	/* SPI, -1 for no MISO / CS */
+	int cpol, cpha;
+	int wordbits;
+	int lsbfirst;
+	int scl, sda;		/* I2C */
+
+	/* State */
+	int samplesize;
+	uint64_t period;	/* UART samples per bit, in 1/65536 */
+	uint64_t pos;		/* Stream sample of the next sample fed */
+	uint32_t value;		/* Inputs right before it */
+	int started;
+	int state;
+	int bit;
+	uint32_t shift, shift2;
+	uint64_t start;		/* First sample of the current event */
+	uint64_t next;		/* UART sample point, in 1/65536 samples */
+};
+
+/* Configures a decoder from a description such as:
+ *
+ *     uart:rx=0,baud=115200,bits=8,parity=none|odd|even
+ *     spi:clk=0,mosi=1,miso=2,cs=3,mode=0,bits=8,order=msb|lsb
+ *     i2c:scl=0,sda=1
+ *
+ * Options left out take the values above, except miso and cs which are
+ * not used unless given
+ *
+ * Parameters:
+ * 	* d : The decoder
+ * 	* spec : The description
+ *
+ * Returns:
+ * 	0 on success, -1 on invalid descriptions
+ */
+int beaglelogic_decoder_parse(struct beaglelogic_decoder *d,
+		const char *spec);
+
+/* Resets a configured decoder for a new capture
+ *
+ * Parameters:
+ * 	* d : The decoder
+ * 	* samplerate : Sample rate of the capture, in Hz
+ * 	* samplesize : Bytes per sample, 1 or 2
+ *
+ * Returns:
+ * 	0 on success, -1 if a channel is not captured or the UART is faster
+ * 	than samplerate / 4
+ */
+int beaglelogic_decoder_start(struct beaglelogic_decoder *d,
+		uint32_t samplerate, int samplesize);
+
+/* Decodes the next samples of the capture
+ *
+ * Decoding stops early when events has no room left for the next ones:
+ * call again with the samples after 'consumed' then
+ *
+ * Parameters:
+ * 	* d : The decoder
+ * 	* samples : The samples
+ * 	* n : Number of samples
+ * 	* events : Destination of the events
+ * 	* maxevents : Room in events, at least 4
+ * 	* consumed : Filled with the number of samples decoded
+ *
+ * Returns:
+ * 	the number of events written to events
+ */
+size_t beaglelogic_decode(struct beaglelogic_decoder *d, const void *samples,
+		size_t n, struct beaglelogic_event *events, size_t maxevents,
+		size_t *consumed);
+
+/* Compressed TCP streams ('compress rle' command of tcp-server-c)
+ *
+ * The stream is then a sequence of blocks: a struct beaglelogic_block header
+ * followed by 'size' bytes. BL_BLOCK_RAW blocks hold the data as captured,
+ * BL_BLOCK_RLE blocks hold run length records (see BL_RLE_VALUE) of
+ * samplesize-byte samples, 'rawsize' bytes once expanded. All the fields
+ * are little-endian */
+#define BL_BLOCK_MAGIC		0xB10C
+#define BL_BLOCK_RAW		0
+#define BL_BLOCK_RLE		1
+
+struct beaglelogic_block {
+	uint16_t magic;		/* BL_BLOCK_MAGIC */
+	uint8_t encoding;	/* BL_BLOCK_RAW or BL_BLOCK_RLE */
+	uint8_t samplesize;	/* Bytes per sample */
+	uint32_t size;		/* Bytes following the header */
+	uint32_t rawsize;	/* Bytes of captured data in this block */
+};
+
+/* Encodes captured data into a stream block
+ *
+ * Data is run length encoded if that makes it smaller, and stored as is
+ * otherwise. Only 1 and 2 byte samples are run length encoded
+ *
+ * Parameters:
+ * 	* in : The samples
+ * 	* len : Length of in, in bytes (a multiple of samplesize)
+ * 	* samplesize : Bytes per sample
+ * 	* out : Destination of the block, at least
+ * 	        len + sizeof(struct beaglelogic_block) bytes
+ *
+ * Returns:
+ * 	the size of the block, header included
+ */
+size_t beaglelogic_block_encode(const void *in, size_t len, int samplesize,
+		void *out);
+
+/* Decodes a stream block
+ *
+ * Parameters:
+ * 	* block : The block, header included
+ * 	* len : Bytes available at block
+ * 	* out : Destination of the captured data
+ * 	* outsize : Room in out, in bytes
+ *
+ * Returns:
+ * 	the number of bytes written to out, -1 if the block is invalid,
+ * 	incomplete or does not fit in out
+ */
+ssize_t beaglelogic_block_decode(const void *block, size_t len,
+		void *out, size_t outsize);
+
+/* Recordings (testapp/beaglelogic-record.c)
+ *
+ * A recording is a sequence of chunks, one per captured buffer. A chunk is
+ * a struct beaglelogic_chunk header zero-padded to BL_CHUNK_ALIGN bytes,
+ * then the 'size' bytes of the buffer, zero-padded to a multiple of
+ * BL_CHUNK_ALIGN: 'chunksize' bytes in all. The alignment lets the recorder
+ * write with O_DIRECT. A gap in 'offset' between two chunks, and 'lost', are
+ * samples that were not recorded. All the fields are little-endian.
+ *
+ * Data chunks may be followed by one BL_CHUNK_INDEX chunk holding a struct
+ * beaglelogic_index, which then ends 16 bytes before the end of the file
+ * with a struct beaglelogic_trailer pointing back to it */
+#define BL_CHUNK_MAGIC		0xBEA6C4C4
+#define BL_CHUNK_ALIGN		4096
+#define BL_CHUNK_SIZE(size)	(BL_CHUNK_ALIGN + (((size) + \
+		BL_CHUNK_ALIGN - 1) & ~(BL_CHUNK_ALIGN - 1)))
+
+#define BL_CHUNK_DATA		0
+#define BL_CHUNK_INDEX		1
+
+struct beaglelogic_chunk {
+	uint32_t magic;		/* BL_CHUNK_MAGIC */
+	uint32_t chunksize;	/* Bytes to the next chunk, header included */
+	uint32_t seq;		/* Ring sequence number of the buffer */
+	uint32_t index;		/* Buffer the data was captured in */
+	uint32_t size;		/* Bytes of captured data */
+	uint32_t flags;		/* BL_BUF_* */
+	uint32_t lost;		/* Bytes lost right before this buffer */
+	uint32_t samplerate;	/* Capture settings, the rate may change */
+	uint32_t sampleunit;
+	uint32_t type;		/* BL_CHUNK_DATA or BL_CHUNK_INDEX */
+	uint64_t offset;	/* Stream offset of the first byte */
+	uint64_t tstart;	/* Timestamps, see struct beaglelogic_bufinfo */
+	uint64_t tend;
+};
+
+/* Activity of the channels over a run of samples: bit n of 'any' ('all')
+ * is set if channel n was high in any (all) of them, and of 'changed' if
+ * it toggled, counting from the sample right before the run. A run without
+ * any recorded sample has any = changed = 0 and all = 0xFFFFFFFF */
+struct beaglelogic_summary {
+	uint32_t any;
+	uint32_t all;
+	uint32_t changed;
+};
+
+/* Index of a recording, for viewers to seek and draw overviews without
+ * scanning the samples
+ *
+ * The index is followed by one struct beaglelogic_chunkinfo per data chunk,
+ * then by the overview levels: level k has 'count' summaries of
+ * decimation * BL_INDEX_FACTOR^k samples each, summary i covering stream
+ * samples [i * samples, (i + 1) * samples) of the level. Levels stop once
+ * one summary covers the whole recording. Positions are in bytes from the
+ * start of struct beaglelogic_index */
+#define BL_INDEX_LEVELS		8
+#define BL_INDEX_FACTOR		16
+#define BL_TRAILER_MAGIC	0xBEA61DC5
+
+struct beaglelogic_chunkinfo {
+	uint64_t filepos;	/* Position of the chunk in the file */
+	uint64_t offset;	/* Stream offset of its first byte */
+	uint64_t tstart;	/* Timestamp of its first 32 bytes */
+	uint32_t size;		/* Bytes of captured data */
+	struct beaglelogic_summary summary;
+};
+
+struct beaglelogic_index {
+	uint32_t samplesize;	/* Bytes per sample, 1 or 2 */
+	uint32_t chunks;	/* struct beaglelogic_chunkinfo entries */
+	uint32_t levels;	/* Overview levels */
+	uint32_t decimation;	/* Samples per summary of level 0 */
+	uint64_t samples;	/* Stream samples, up to the last recorded one */
+	struct {
+		uint64_t samples;	/* Samples per summary */
+		uint64_t count;		/* Summaries */
+		uint64_t pos;		/* Position of the first one */
+	} level[BL_INDEX_LEVELS];
+};
+
+#define BL_INDEX_CHUNKS(ix)	((struct beaglelogic_chunkinfo *)((ix) + 1))
+#define BL_INDEX_LEVEL(ix, k)	((struct beaglelogic_summary *)\
+		((uint8_t *)(ix) + (ix)->level[k].pos))
+
+struct beaglelogic_trailer {
+	uint64_t indexpos;	/* Position of the index chunk in the file */
+	uint32_t magic;		/* BL_TRAILER_MAGIC */
+	uint32_t reserved;
+};
+
+/* Builds the index of a recording as its chunks are written */
+struct beaglelogic_indexer {
+	uint32_t samplesize;
+	uint32_t decimation;
+	struct beaglelogic_chunkinfo *chunks;
+	uint32_t nchunks, maxchunks;
+	struct beaglelogic_summary *summaries;	/* Level 0 */
+	uint64_t count, maxcount;
+	struct beaglelogic_summary cur;		/* Summary being filled */
+	uint64_t next;		/* Stream sample after the last one added */
+	uint32_t last;		/* Value of that last sample */
+};
+
+/* Starts an index
+ *
+ * Parameters:
+ * 	* ix : The indexer
+ * 	* samplesize : Bytes per sample, 1 or 2. Packed and run length
+ * 	               encoded captures cannot be indexed
+ * 	* decimation : Samples per summary of the finest overview level, a
+ * 	               power of two from 32 on
+ *
+ * Returns:
+ * 	0 on success, -1 on invalid parameters
+ */
+int beaglelogic_index_init(struct beaglelogic_indexer *ix, int samplesize,
+		uint32_t decimation);
+
+/* Adds a data chunk to the index
+ *
+ * Parameters:
+ * 	* ix : The indexer
+ * 	* filepos : Position of the chunk in the recording
+ * 	* chunk : The chunk, header included
+ *
+ * Returns:
+ * 	0 on success, -1 if out of memory
+ */
+int beaglelogic_index_add(struct beaglelogic_indexer *ix, uint64_t filepos,
+		const struct beaglelogic_chunk *chunk);
+
+/* Writes the index chunk and the trailer at the end of a recording
+ *
+ * The writes are aligned to BL_CHUNK_ALIGN, fd may be opened with O_DIRECT
+ *
+ * Parameters:
+ * 	* ix : The indexer
+ * 	* fd : The recording, positioned at its end
+ * 	* filepos : That position
+ *
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_index_write(struct beaglelogic_indexer *ix, int fd,
+		uint64_t filepos);
+
+/* Frees the memory of an indexer */
+void beaglelogic_index_free(struct beaglelogic_indexer *ix);
+
+/* Reads the index of a recording
+ *
+ * Parameters:
+ * 	* fd : The recording
+ *
+ * Returns:
+ * 	the index, to be released with free(), NULL if there is none
+ */
+struct beaglelogic_index *beaglelogic_index_read(int fd);
+
+/* Finds the chunk holding a stream offset
+ *
+ * Returns:
+ * 	the first chunk that ends after offset, ix->chunks if none
+ */
+uint32_t beaglelogic_index_find(const struct beaglelogic_index *ix,
+		uint64_t offset);
+
+/* Acknowledges all buffers up to (and excluding) a sequence number
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ * 	* seq : The sequence number of the next buffer to be consumed
+ *
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_ring_ack(int fd, uint32_t seq);
+
+/* Event driven consumption of the zero-copy ring
+ *
+ * None of the stream calls block. Add the fd to an epoll set (or a libuv
+ * poll handle) for POLLIN, which the driver signals as buffers complete, and
+ * drain the stream when it fires. POLLHUP marks the end of the session and
+ * POLLERR a failed capture. A typical loop, started with beaglelogic_start:
+ *
+ * 	beaglelogic_stream_open(&s, fd);
+ * 	while (poll(&pollfd, 1, -1) > 0 && !(pollfd.revents & POLLHUP))
+ * 		if (beaglelogic_stream_dispatch(&s, callback, arg) < 0)
+ * 			break;
+ * 	beaglelogic_stream_close(&s);
+ */
+struct beaglelogic_buffer {
+	const void *data;	/* Samples, in place in the buffer mapping */
+	uint32_t size;		/* Valid bytes at data */
+	uint32_t seq;		/* Sequence number of the buffer */
+	uint32_t flags;		/* Buffer flags, see struct beaglelogic_bufinfo */
+	uint32_t lost;		/* Bytes lost right before this buffer */
+	uint64_t offset;	/* Stream offset of the first byte */
+	uint64_t tstart;	/* Timestamps of the first and last 32 bytes */
+	uint64_t tend;
+	uint32_t samplerate;	/* Sample rate of the buffer, 0 if clocked */
+};
+
+struct beaglelogic_stream {
+	int fd;			/* Open /dev/beaglelogic node, to poll */
+	void *mem;		/* Buffer mapping */
+	struct beaglelogic_ring *ring;	/* Ring control area */
+	uint32_t seq;		/* Next buffer to hand out */
+	uint32_t acked;		/* Buffers before this one are acknowledged */
+};
+
+/* Called for every buffer by beaglelogic_stream_dispatch
+ *
+ * Returns:
+ * 	0 to go on with the next buffer, anything else to stop for now
+ */
+typedef int (*beaglelogic_buffer_cb)(struct beaglelogic_stream *s,
+		const struct beaglelogic_buffer *buf, void *arg);
+
+/* Maps the buffers and the ring control area of a device for streaming
+ *
+ * Parameters:
+ * 	* s : The stream to set up
+ * 	* fd : The file number to an open /dev/beaglelogic node
+ *
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_stream_open(struct beaglelogic_stream *s, int fd);
+
+/* Unmaps what beaglelogic_stream_open mapped. The fd is left open */
+void beaglelogic_stream_close(struct beaglelogic_stream *s);
+
+/* Hands out the next completed buffer, if any
+ *
+ * Buffers overwritten before they could be handed out are skipped, the gap
+ * shows in buf->offset. A buffer stays in place until released
+ *
+ * Returns:
+ * 	1 if buf was filled in, 0 if no buffer is ready, -1 if the capture
+ * 	failed (errno set to EIO)
+ */
+int beaglelogic_stream_next(struct beaglelogic_stream *s,
+		struct beaglelogic_buffer *buf);
+
+/* Tells whether a handed out buffer still holds its data. To be checked once
+ * done with data, in case the buffer was overwritten in the meantime */
+int beaglelogic_stream_valid(struct beaglelogic_stream *s,
+		const struct beaglelogic_buffer *buf);
+
+/* Gives every buffer handed out so far back to the driver
+ *
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_stream_release(struct beaglelogic_stream *s);
+
+/* Calls cb for every completed buffer, then releases them all. The data is
+ * only to be used until cb returns
+ *
+ * Returns:
+ * 	The number of buffers passed to cb, -1 on failure
+ */
+int beaglelogic_stream_dispatch(struct beaglelogic_stream *s,
+		beaglelogic_buffer_cb cb, void *arg);
+
+/* Auto-tuning of the buffer layout
+ *
+ * Small buffer units keep the latency low but interrupt the CPU for each of
+ * them, large ones are cheap to complete but take long to fill in. How many
+ * of them are needed depends on how long the consumer can fall behind.
+ * beaglelogic_autotune measures all of it in a short calibration capture
+ * with the current settings (in continuous mode), then picks:
+ *
+ * 	* bufunitsize : the smallest unit, rounded to pages, that keeps the
+ * 	  interrupt rate below maxirqrate. A unit is never longer to fill in
+ * 	  than maxlatency though, which wins if both cannot be met
+ * 	* bufcount : twice the longest backlog the consumer built up, plus the
+ * 	  units in flight, at least 4 and at most maxmem bytes in total
+ *
+ * Limits are left at 0 for the defaults. Run it with the callback of the
+ * real consumer: tuning against a consumer that does nothing only tells the
+ * interrupt rate apart
+ */
+struct beaglelogic_tune {
+	/* Limits */
+	uint32_t maxirqrate;	/* Interrupts per second, 200 */
+	uint32_t maxlatency;	/* Milliseconds to fill a unit in, 100 */
+	uint32_t maxmem;	/* Bytes of buffers, the current memalloc */
+	uint32_t calibration;	/* Milliseconds of calibration capture, 2000 */
+
+	/* Measured in the calibration capture */
+	uint64_t byterate;	/* Bytes per second captured */
+	uint32_t irqrate;	/* Interrupts per second */
+	uint32_t maxlag;	/* Most bytes waiting for the consumer */
+	uint32_t stall;		/* Longest consumer callback run, in us */
+	uint64_t lostbytes;	/* Bytes lost */
+
+	/* Chosen and applied */
+	uint32_t bufunitsize;
+	uint32_t bufcount;
+	int sustainable;	/* 0 if the consumer cannot keep up */
+};
+
+/* Calibrates and applies a buffer layout, see struct beaglelogic_tune
+ *
+ * The fd must not be mapped, the buffers are allocated again
+ *
+ * Parameters:
+ * 	* fd : The file number to an open /dev/beaglelogic node, nonblocking
+ * 	* tune : limits in, measurements and chosen layout out
+ * 	* cb : consumer for the calibration buffers, NULL to drop them
+ * 	* arg : passed on to cb
+ *
+ * Returns:
+ * 	0 on success, -1 on failure
+ */
+int beaglelogic_autotune(int fd, struct beaglelogic_tune *tune,
+		beaglelogic_buffer_cb cb, void *arg);
+
 #endif /* LIBBEAGLELOGIC_H_ */